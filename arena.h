@@ -0,0 +1,89 @@
+#include "kvstore.h"
+
+// Bump allocator for data that lives and dies together: the nodes, keys
+// and values of one memtable, the records of one log batch being
+// replayed, the key and value copies of one iterator snapshot.
+// Allocations are carved out of ARENA_BLOCK_SIZE blocks; requests over a
+// quarter of that get a block of their own so little space is wasted
+// at the end of the current one. Nothing is freed individually; the whole
+// arena goes in one step. An arena is used by one thread at a time.
+
+void arena_init(Arena* arena) {
+    arena->blocks = NULL;
+    arena->ptr = NULL;
+    arena->remaining = 0;
+    arena->memory_usage = 0;
+}
+
+// Allocate a block with size usable bytes and link it in
+char* arena_new_block(Arena* arena, size_t size) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    if (!block) return NULL;
+    block->size = size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->memory_usage += sizeof(ArenaBlock) + size;
+    return block->data;
+}
+
+// size bytes aligned for any field of the structs stored in arenas.
+// Returns NULL only if memory runs out.
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t align = sizeof(void*) > sizeof(uint64_t) ? sizeof(void*) : sizeof(uint64_t);
+    size = (size + align - 1) & ~(align - 1);
+    if (size == 0) size = align;
+
+    if (size > arena->remaining) {
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            // The current block keeps its leftover space for later requests
+            return arena_new_block(arena, size);
+        }
+        arena->ptr = arena_new_block(arena, ARENA_BLOCK_SIZE);
+        arena->remaining = arena->ptr ? ARENA_BLOCK_SIZE : 0;
+        if (!arena->ptr) return NULL;
+    }
+    char* result = arena->ptr;
+    arena->ptr += size;
+    arena->remaining -= size;
+    return result;
+}
+
+// Copy n bytes into the arena as a NUL-terminated string
+char* arena_copy(Arena* arena, const char* data, size_t n) {
+    char* copy = arena_alloc(arena, n + 1);
+    if (!copy) return NULL;
+    memcpy(copy, data, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+// Release everything allocated so far but keep one standard block for
+// reuse, so an arena recycled per batch does not go back to malloc
+void arena_reset(Arena* arena) {
+    ArenaBlock* keep = NULL;
+    ArenaBlock* block = arena->blocks;
+    while (block) {
+        ArenaBlock* next = block->next;
+        if (!keep && block->size == ARENA_BLOCK_SIZE) {
+            keep = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    arena->blocks = keep;
+    arena->ptr = keep ? keep->data : NULL;
+    arena->remaining = keep ? ARENA_BLOCK_SIZE : 0;
+    arena->memory_usage = keep ? sizeof(ArenaBlock) + ARENA_BLOCK_SIZE : 0;
+    if (keep) keep->next = NULL;
+}
+
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena);
+}
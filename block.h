@@ -0,0 +1,231 @@
+#include "kvstore.h"
+
+// Data and index blocks of the block-based SSTable format.
+//
+// A block is a sequence of entries followed by a restart array:
+//   entry:   {varint: shared, varint: non_shared, varint: vLen + 1,
+//             array: non_shared <key bytes after the shared prefix>,
+//             array: vLen <value bytes>}
+//   trailer: {uint32: restart offsets[num_restarts], uint32: num_restarts}
+// Every BLOCK_RESTART_INTERVAL entries the key is stored in full
+// (shared == 0) and its offset recorded as a restart point, so a reader
+// can binary search the restarts and then scan at most one interval.
+// A vLen + 1 of 0 encodes a tombstone.
+
+// Append a varint-encoded value to buf, returning the bytes written
+int encode_varint64(char* buf, uint64_t value) {
+    unsigned char* ptr = (unsigned char*) buf;
+    int n = 0;
+    while (value >= 128) {
+        ptr[n++] = (unsigned char) (value | 128);
+        value >>= 7;
+    }
+    ptr[n++] = (unsigned char) value;
+    return n;
+}
+
+// Decode a varint from [p, limit). Returns the byte after it, or NULL
+// if the input is truncated or malformed.
+const char* decode_varint64(const char* p, const char* limit, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift <= 63 && p < limit; shift += 7) {
+        uint64_t byte = *(const unsigned char*) p++;
+        result |= (byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+const char* decode_varint32(const char* p, const char* limit, uint32_t* value) {
+    uint64_t v;
+    p = decode_varint64(p, limit, &v);
+    if (!p || v > UINT32_MAX) return NULL;
+    *value = (uint32_t) v;
+    return p;
+}
+
+// Growable byte buffer used by the builders
+void buffer_append(char** buf, size_t* len, size_t* cap, const char* data, size_t n) {
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < *len + n) new_cap *= 2;
+        *buf = realloc(*buf, new_cap);
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+void block_builder_init(BlockBuilder* builder) {
+    memset(builder, 0, sizeof(BlockBuilder));
+}
+
+void block_builder_reset(BlockBuilder* builder) {
+    builder->len = 0;
+    builder->num_restarts = 0;
+    builder->counter = 0;
+    builder->last_key_len = 0;
+    builder->entries = 0;
+}
+
+void block_builder_free(BlockBuilder* builder) {
+    free(builder->buf);
+    free(builder->restarts);
+    free(builder->last_key);
+    block_builder_init(builder);
+}
+
+// Size of the block if it were finished now
+size_t block_builder_size_estimate(BlockBuilder* builder) {
+    return builder->len + (builder->num_restarts + 1) * sizeof(uint32_t) + sizeof(uint32_t);
+}
+
+// Add an entry. Keys must be added in strictly increasing order.
+void block_builder_add(BlockBuilder* builder, const char* key, int kLen, const char* value, int64_t vLen) {
+    int shared = 0;
+    if (builder->counter < BLOCK_RESTART_INTERVAL && builder->entries > 0) {
+        int min_len = kLen < builder->last_key_len ? kLen : builder->last_key_len;
+        while (shared < min_len && builder->last_key[shared] == key[shared]) shared++;
+    } else {
+        // Start a new restart interval with the full key
+        if (builder->num_restarts >= builder->restarts_cap) {
+            builder->restarts_cap = builder->restarts_cap ? builder->restarts_cap * 2 : 16;
+            builder->restarts = realloc(builder->restarts, builder->restarts_cap * sizeof(uint32_t));
+        }
+        builder->restarts[builder->num_restarts++] = (uint32_t) builder->len;
+        builder->counter = 0;
+    }
+
+    char header[30];
+    int n = encode_varint64(header, (uint64_t) shared);
+    n += encode_varint64(header + n, (uint64_t) (kLen - shared));
+    n += encode_varint64(header + n, (uint64_t) (vLen + 1));
+    buffer_append(&builder->buf, &builder->len, &builder->cap, header, n);
+    buffer_append(&builder->buf, &builder->len, &builder->cap, key + shared, kLen - shared);
+    if (vLen > 0) {
+        buffer_append(&builder->buf, &builder->len, &builder->cap, value, (size_t) vLen);
+    }
+
+    if (kLen > builder->last_key_cap) {
+        builder->last_key_cap = kLen * 2;
+        builder->last_key = realloc(builder->last_key, builder->last_key_cap);
+    }
+    memcpy(builder->last_key, key, kLen);
+    builder->last_key_len = kLen;
+    builder->counter++;
+    builder->entries++;
+}
+
+// Append the restart array; the finished block is builder->buf[0..len)
+void block_builder_finish(BlockBuilder* builder) {
+    for (int i = 0; i < builder->num_restarts; i++) {
+        buffer_append(&builder->buf, &builder->len, &builder->cap,
+                      (char*) &builder->restarts[i], sizeof(uint32_t));
+    }
+    uint32_t num_restarts = (uint32_t) builder->num_restarts;
+    buffer_append(&builder->buf, &builder->len, &builder->cap, (char*) &num_restarts, sizeof(uint32_t));
+}
+
+// Prepare an iterator over a finished block. Returns -1 if the block is
+// too small to hold its own restart array.
+int block_iter_init(BlockIter* iter, const char* data, size_t size) {
+    memset(iter, 0, sizeof(BlockIter));
+    if (size < sizeof(uint32_t)) return -1;
+
+    uint32_t num_restarts;
+    memcpy(&num_restarts, data + size - sizeof(uint32_t), sizeof(uint32_t));
+    if (num_restarts == 0 || (size_t) num_restarts + 1 > size / sizeof(uint32_t)) return -1;
+
+    iter->data = data;
+    iter->restarts = size - (num_restarts + 1) * sizeof(uint32_t);
+    iter->num_restarts = num_restarts;
+    iter->next_offset = iter->restarts;
+    return 0;
+}
+
+void block_iter_free(BlockIter* iter) {
+    free(iter->key);
+    iter->key = NULL;
+    iter->key_cap = 0;
+}
+
+uint32_t block_iter_restart_point(BlockIter* iter, uint32_t index) {
+    uint32_t offset;
+    memcpy(&offset, iter->data + iter->restarts + index * sizeof(uint32_t), sizeof(uint32_t));
+    return offset;
+}
+
+// Decode the entry at next_offset, rebuilding its key from the previous one
+int block_iter_next(BlockIter* iter) {
+    const char* p = iter->data + iter->next_offset;
+    const char* limit = iter->data + iter->restarts;
+    iter->valid = 0;
+    if (p >= limit) return 0;
+
+    uint32_t shared, non_shared;
+    uint64_t value_tag;
+    p = decode_varint32(p, limit, &shared);
+    if (p) p = decode_varint32(p, limit, &non_shared);
+    if (p) p = decode_varint64(p, limit, &value_tag);
+    if (!p || shared > (uint32_t) iter->kLen || value_tag > INT64_MAX) return 0;
+
+    int64_t vLen = (int64_t) value_tag - 1;
+    size_t available = (size_t) (limit - p);
+    if (available < non_shared || (vLen > 0 && (uint64_t) vLen > available - non_shared)) return 0;
+
+    int kLen = (int) (shared + non_shared);
+    if (kLen + 1 > iter->key_cap) {
+        iter->key_cap = (kLen + 1) * 2;
+        iter->key = realloc(iter->key, iter->key_cap);
+    }
+    memcpy(iter->key + shared, p, non_shared);
+    iter->key[kLen] = '\0';
+    iter->kLen = kLen;
+    p += non_shared;
+
+    iter->vLen = vLen;
+    iter->value = vLen >= 0 ? p : NULL;
+    if (vLen > 0) p += vLen;
+
+    iter->next_offset = (size_t) (p - iter->data);
+    iter->valid = 1;
+    return 1;
+}
+
+void block_iter_seek_to_restart(BlockIter* iter, uint32_t index) {
+    iter->kLen = 0;
+    iter->next_offset = block_iter_restart_point(iter, index);
+}
+
+int block_iter_seek_to_first(BlockIter* iter) {
+    block_iter_seek_to_restart(iter, 0);
+    return block_iter_next(iter);
+}
+
+// Position the iterator at the first entry whose key is >= key.
+// Returns 0 if every entry in the block is smaller.
+int block_iter_seek(BlockIter* iter, const char* key, int kLen) {
+    // Binary search for the last restart point whose key is < key
+    uint32_t lo = 0;
+    uint32_t hi = iter->num_restarts - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        block_iter_seek_to_restart(iter, mid);
+        if (!block_iter_next(iter)) return 0;
+        if (compare_key_bytes(iter->key, iter->kLen, key, kLen) < 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    // Linear scan within the restart interval
+    block_iter_seek_to_restart(iter, lo);
+    while (block_iter_next(iter)) {
+        if (compare_key_bytes(iter->key, iter->kLen, key, kLen) >= 0) return 1;
+    }
+    return 0;
+}
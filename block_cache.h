@@ -0,0 +1,214 @@
+#include "kvstore.h"
+
+// Sharded LRU cache of SSTable blocks read with pread(). Entries are
+// keyed by (table id, block offset) and charged by block size. Every
+// shard has its own mutex, hash table and LRU list, so concurrent
+// lookups for different blocks rarely contend on the same lock.
+//
+// A looked-up entry stays pinned until block_cache_release(); pinned
+// entries are never evicted, so the block memory stays valid while the
+// caller decodes it.
+
+uint64_t block_cache_hash(uint64_t table_id, uint64_t offset) {
+    uint64_t h = table_id * 0x9E3779B97F4A7C15ULL ^ offset;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+BlockCache* block_cache_create(size_t capacity) {
+    BlockCache* cache = malloc(sizeof(BlockCache));
+    cache->next_table_id = 1;
+    pthread_mutex_init(&cache->id_mutex, NULL);
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->capacity = capacity / BLOCK_CACHE_SHARDS;
+        shard->usage = 0;
+        shard->num_buckets = 64;
+        shard->num_entries = 0;
+        shard->buckets = calloc(shard->num_buckets, sizeof(CacheEntry*));
+        // Circular LRU list: lru.next is the oldest entry, lru.prev the newest
+        shard->lru.lru_next = &shard->lru;
+        shard->lru.lru_prev = &shard->lru;
+        shard->hits = 0;
+        shard->misses = 0;
+        shard->evictions = 0;
+    }
+    return cache;
+}
+
+// Hand out a table id that is never reused, so blocks of a deleted
+// table can simply age out of the cache
+uint64_t block_cache_new_table_id(BlockCache* cache) {
+    pthread_mutex_lock(&cache->id_mutex);
+    uint64_t id = cache->next_table_id++;
+    pthread_mutex_unlock(&cache->id_mutex);
+    return id;
+}
+
+void block_cache_lru_remove(CacheEntry* entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+void block_cache_lru_append(CacheShard* shard, CacheEntry* entry) {
+    entry->lru_next = &shard->lru;
+    entry->lru_prev = shard->lru.lru_prev;
+    entry->lru_prev->lru_next = entry;
+    shard->lru.lru_prev = entry;
+}
+
+// Unlink entry from its hash chain
+void block_cache_hash_remove(CacheShard* shard, CacheEntry* entry) {
+    CacheEntry** slot = &shard->buckets[entry->hash % shard->num_buckets];
+    while (*slot != entry) slot = &(*slot)->hash_next;
+    *slot = entry->hash_next;
+    shard->num_entries--;
+}
+
+void block_cache_resize(CacheShard* shard) {
+    int num_buckets = shard->num_buckets * 2;
+    CacheEntry** buckets = calloc(num_buckets, sizeof(CacheEntry*));
+    for (int i = 0; i < shard->num_buckets; i++) {
+        CacheEntry* entry = shard->buckets[i];
+        while (entry) {
+            CacheEntry* next = entry->hash_next;
+            CacheEntry** slot = &buckets[entry->hash % num_buckets];
+            entry->hash_next = *slot;
+            *slot = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+// Drop unpinned entries, oldest first, until the shard fits its capacity
+void block_cache_evict(CacheShard* shard) {
+    CacheEntry* entry = shard->lru.lru_next;
+    while (shard->usage > shard->capacity && entry != &shard->lru) {
+        CacheEntry* next = entry->lru_next;
+        if (entry->refs == 0) {
+            block_cache_lru_remove(entry);
+            block_cache_hash_remove(shard, entry);
+            shard->usage -= entry->size;
+            shard->evictions++;
+            free(entry->data);
+            free(entry);
+        }
+        entry = next;
+    }
+}
+
+CacheShard* block_cache_shard(BlockCache* cache, uint64_t hash) {
+    return &cache->shards[(hash >> 60) % BLOCK_CACHE_SHARDS];
+}
+
+// Look up a block, pinning it on a hit. Returns NULL on a miss.
+CacheEntry* block_cache_lookup(BlockCache* cache, uint64_t table_id, uint64_t offset) {
+    uint64_t hash = block_cache_hash(table_id, offset);
+    CacheShard* shard = block_cache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry* entry = shard->buckets[hash % shard->num_buckets];
+    while (entry && !(entry->table_id == table_id && entry->offset == offset)) {
+        entry = entry->hash_next;
+    }
+    if (entry) {
+        entry->refs++;
+        block_cache_lru_remove(entry);
+        block_cache_lru_append(shard, entry);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return entry;
+}
+
+// Insert a block (taking ownership of data) and return it pinned. If
+// another reader inserted the same block first, data is freed and the
+// existing entry is returned instead.
+CacheEntry* block_cache_insert(BlockCache* cache, uint64_t table_id, uint64_t offset, char* data, size_t size) {
+    uint64_t hash = block_cache_hash(table_id, offset);
+    CacheShard* shard = block_cache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry* entry = shard->buckets[hash % shard->num_buckets];
+    while (entry && !(entry->table_id == table_id && entry->offset == offset)) {
+        entry = entry->hash_next;
+    }
+
+    if (entry) {
+        free(data);
+    } else {
+        entry = malloc(sizeof(CacheEntry));
+        entry->table_id = table_id;
+        entry->offset = offset;
+        entry->hash = hash;
+        entry->data = data;
+        entry->size = size;
+        entry->refs = 0;
+
+        if (shard->num_entries >= shard->num_buckets) {
+            block_cache_resize(shard);
+        }
+        CacheEntry** slot = &shard->buckets[hash % shard->num_buckets];
+        entry->hash_next = *slot;
+        *slot = entry;
+        shard->num_entries++;
+        block_cache_lru_append(shard, entry);
+        shard->usage += size;
+    }
+    entry->refs++;
+    block_cache_evict(shard);
+    pthread_mutex_unlock(&shard->mutex);
+    return entry;
+}
+
+// Unpin an entry returned by block_cache_lookup/block_cache_insert
+void block_cache_release(BlockCache* cache, CacheEntry* entry) {
+    CacheShard* shard = block_cache_shard(cache, entry->hash);
+    pthread_mutex_lock(&shard->mutex);
+    entry->refs--;
+    if (entry->refs == 0 && shard->usage > shard->capacity) {
+        block_cache_evict(shard);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Sum the per-shard counters into stats
+void block_cache_add_stats(BlockCache* cache, KVStoreStats* stats) {
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->block_cache_hits += shard->hits;
+        stats->block_cache_misses += shard->misses;
+        stats->block_cache_evictions += shard->evictions;
+        stats->block_cache_usage += shard->usage;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void block_cache_free(BlockCache* cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        CacheEntry* entry = shard->lru.lru_next;
+        while (entry != &shard->lru) {
+            CacheEntry* next = entry->lru_next;
+            free(entry->data);
+            free(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    pthread_mutex_destroy(&cache->id_mutex);
+    free(cache);
+}
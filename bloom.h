@@ -0,0 +1,164 @@
+#include "kvstore.h"
+
+// Bloom filter built over the keys of one SSTable. A negative answer
+// means the key is definitely not in the table, so get() can skip it
+// without touching its files. Persisted next to the table as
+// {uint32: BLOOM_FILE_MAGIC, int: num_probes, int: num_bytes,
+//  array: num_bytes <filter bits>, uint32: CRC32C of all before it}.
+// Filters written before the checksum lack the magic and the CRC.
+
+// 32-bit MurmurHash2-style hash over the key bytes
+uint32_t bloom_hash(const char* key, int kLen) {
+    const uint32_t m = 0x5bd1e995;
+    uint32_t h = 0xbc9f1d34 ^ (uint32_t) kLen;
+    const unsigned char* data = (const unsigned char*) key;
+
+    while (kLen >= 4) {
+        uint32_t k;
+        memcpy(&k, data, 4);
+        k *= m;
+        k ^= k >> 24;
+        k *= m;
+        h *= m;
+        h ^= k;
+        data += 4;
+        kLen -= 4;
+    }
+
+    switch (kLen) {
+        case 3: h ^= (uint32_t) data[2] << 16; // fall through
+        case 2: h ^= (uint32_t) data[1] << 8;  // fall through
+        case 1: h ^= data[0]; h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+BloomFilter* bloom_create(int num_keys, int bits_per_key) {
+    BloomFilter* filter = malloc(sizeof(BloomFilter));
+
+    // k = bits_per_key * ln(2) minimises the false positive rate
+    filter->num_probes = (int) (bits_per_key * 0.69);
+    if (filter->num_probes < 1) filter->num_probes = 1;
+    if (filter->num_probes > 30) filter->num_probes = 30;
+
+    long bits = (long) num_keys * bits_per_key;
+    if (bits < 64) bits = 64;
+    filter->num_bytes = (int) ((bits + 7) / 8);
+    filter->bits = calloc(filter->num_bytes, 1);
+    return filter;
+}
+
+// Set the probe bits for a key hash, using double hashing to derive all
+// probes from a single hash value
+void bloom_add_hash(BloomFilter* filter, uint32_t h) {
+    uint32_t delta = (h >> 17) | (h << 15);
+    uint32_t num_bits = (uint32_t) filter->num_bytes * 8;
+
+    for (int i = 0; i < filter->num_probes; i++) {
+        uint32_t bit = h % num_bits;
+        filter->bits[bit / 8] |= (uint8_t) (1 << (bit % 8));
+        h += delta;
+    }
+}
+
+// Returns 0 if key is definitely absent, 1 if it may be present
+int bloom_may_contain(BloomFilter* filter, const char* key, int kLen) {
+    uint32_t h = bloom_hash(key, kLen);
+    uint32_t delta = (h >> 17) | (h << 15);
+    uint32_t num_bits = (uint32_t) filter->num_bytes * 8;
+
+    for (int i = 0; i < filter->num_probes; i++) {
+        uint32_t bit = h % num_bits;
+        if ((filter->bits[bit / 8] & (1 << (bit % 8))) == 0) return 0;
+        h += delta;
+    }
+    return 1;
+}
+
+void bloom_free(BloomFilter* filter) {
+    if (filter) {
+        free(filter->bits);
+        free(filter);
+    }
+}
+
+// Write the filter to its own file next to the SSTable and sync it, so it
+// is durable before the MANIFEST edit that adds the table. Returns -1 if
+// any of it failed.
+int bloom_write_to_file(BloomFilter* filter, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return -1;
+
+    uint32_t header[3] = {BLOOM_FILE_MAGIC, (uint32_t) filter->num_probes, (uint32_t) filter->num_bytes};
+    uint32_t crc = crc32c_value((char*) header, sizeof(header));
+    crc = crc32c_extend(crc, (char*) filter->bits, (size_t) filter->num_bytes);
+
+    int result = 0;
+    if (fwrite(header, sizeof(header), 1, file) != 1 ||
+        fwrite(filter->bits, 1, filter->num_bytes, file) != (size_t) filter->num_bytes ||
+        fwrite(&crc, sizeof(crc), 1, file) != 1) {
+        result = -1;
+    }
+    if (fflush(file) != 0 || fdatasync(fileno(file)) != 0) result = -1;
+    if (fclose(file) != 0) result = -1;
+    return result;
+}
+
+// Read a filter written by bloom_write_to_file, or NULL if missing or
+// damaged. A table without a filter is probed for every key, so a filter
+// failing its checksum is dropped rather than trusted.
+BloomFilter* bloom_read_from_file(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+
+    uint32_t header[3];
+    int checksummed = 0;
+    if (fread(header, sizeof(uint32_t), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+    if (header[0] == BLOOM_FILE_MAGIC) {
+        checksummed = 1;
+        if (fread(&header[1], sizeof(uint32_t), 2, file) != 2) {
+            fclose(file);
+            return NULL;
+        }
+    } else {
+        // Legacy filter: the first word was num_probes
+        header[1] = header[0];
+        if (fread(&header[2], sizeof(uint32_t), 1, file) != 1) {
+            fclose(file);
+            return NULL;
+        }
+    }
+
+    int num_probes = (int) header[1];
+    int num_bytes = (int) header[2];
+    if (num_probes < 1 || num_probes > 30 || num_bytes <= 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    BloomFilter* filter = malloc(sizeof(BloomFilter));
+    filter->num_probes = num_probes;
+    filter->num_bytes = num_bytes;
+    filter->bits = malloc(num_bytes);
+    if (fread(filter->bits, 1, (size_t) num_bytes, file) != (size_t) num_bytes) {
+        bloom_free(filter);
+        filter = NULL;
+    } else if (checksummed) {
+        uint32_t stored;
+        uint32_t crc = crc32c_value((char*) header, sizeof(header));
+        crc = crc32c_extend(crc, (char*) filter->bits, (size_t) num_bytes);
+        if (fread(&stored, sizeof(stored), 1, file) != 1 || stored != crc) {
+            bloom_free(filter);
+            filter = NULL;
+        }
+    }
+    fclose(file);
+    return filter;
+}
@@ -0,0 +1,580 @@
+#include "kvstore.h"
+
+// Leveled compaction. Flushed heaps land in L0, whose tables may overlap.
+// Once L0 holds level0_file_trigger tables they are merged, together with
+// the overlapping part of L1, into L1. Levels 1..NUM_LEVELS-1 hold
+// non-overlapping tables and have size targets growing by
+// level_size_multiplier; a level over its target pushes one table
+// (round-robin through its key space) down into the next level.
+//
+// The size-tiered policy (COMPACTION_STYLE_SIZE_TIERED) keeps every table
+// in L0 instead. Starting from the newest table, it collects the run of
+// tables whose sizes are similar to the run's average and, once the run
+// is tiered_min_merge_width long, merges it into a single table. Runs
+// always start at the newest table, so the output, which takes the
+// newest sequence of its inputs, stays in front of older data. Each
+// table is rewritten about once per tier, trading read amplification for
+// less write amplification than leveling.
+//
+// Merges keep only the newest version of each key, and drop tombstones
+// once no older table outside the merge can hold the key.
+
+// Start a new output table at level
+int compaction_output_open(KVStore* kvstore, CompactionOutput* output, int level) {
+    char path[512];
+    memset(output, 0, sizeof(CompactionOutput));
+    // Subcompactions open outputs concurrently
+    output->file_number = __atomic_fetch_add(&kvstore->next_file_number, 1, __ATOMIC_RELAXED);
+
+    // A crash between writing a table and logging it in the MANIFEST can
+    // leave files under a number that is handed out again
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_INDEX_PREFIX, output->file_number);
+    unlink(path);
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_BLOOM_PREFIX, output->file_number);
+    unlink(path);
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_PREFIX, output->file_number);
+    return table_builder_open(&output->builder, path, kvstore->block_size, level, kvstore->compression);
+}
+
+void compaction_output_add(CompactionOutput* output, const char* key, int kLen, const char* value, int64_t vLen) {
+    table_builder_add(&output->builder, key, kLen, value, vLen);
+
+    if (output->num_hashes >= output->hashes_cap) {
+        output->hashes_cap = output->hashes_cap ? output->hashes_cap * 2 : 256;
+        output->key_hashes = realloc(output->key_hashes, output->hashes_cap * sizeof(uint32_t));
+    }
+    output->key_hashes[output->num_hashes++] = bloom_hash(key, kLen);
+}
+
+// Bytes written to the output so far
+uint64_t compaction_output_size(CompactionOutput* output) {
+    return output->builder.offset + output->builder.data_block.len;
+}
+
+// Finish the table and its Bloom filter and open it for reads. Returns
+// NULL (and removes the files) if nothing was written or either failed
+// to reach disk.
+SSTable* compaction_output_finish(KVStore* kvstore, CompactionOutput* output) {
+    int record_count = output->builder.record_count;
+    int result = table_builder_finish(&output->builder);
+
+    char path[512];
+    if (result != 0 || record_count == 0) {
+        sstable_file_path(kvstore, path, sizeof(path), SSTABLE_PREFIX, output->file_number);
+        unlink(path);
+        free(output->key_hashes);
+        return NULL;
+    }
+
+    if (kvstore->bloom_bits_per_key > 0) {
+        BloomFilter* bloom = bloom_create(output->num_hashes, kvstore->bloom_bits_per_key);
+        for (int i = 0; i < output->num_hashes; i++) {
+            bloom_add_hash(bloom, output->key_hashes[i]);
+        }
+        sstable_file_path(kvstore, path, sizeof(path), SSTABLE_BLOOM_PREFIX, output->file_number);
+        int written = bloom_write_to_file(bloom, path);
+        bloom_free(bloom);
+        if (written != 0) {
+            unlink(path);
+            sstable_file_path(kvstore, path, sizeof(path), SSTABLE_PREFIX, output->file_number);
+            unlink(path);
+            free(output->key_hashes);
+            return NULL;
+        }
+    }
+    free(output->key_hashes);
+
+    // The MANIFEST will name the table and its filter, so their directory
+    // entries must be durable before the edit is
+    if (manifest_sync_directory(kvstore) != 0) {
+        sstable_file_path(kvstore, path, sizeof(path), SSTABLE_BLOOM_PREFIX, output->file_number);
+        unlink(path);
+        sstable_file_path(kvstore, path, sizeof(path), SSTABLE_PREFIX, output->file_number);
+        unlink(path);
+        return NULL;
+    }
+
+    return open_sstable(kvstore, output->file_number);
+}
+
+// Stream the newest record of every key of memtable, which is already
+// sorted, into output and finish it. The table takes the sequence of the
+// newest of them.
+SSTable* compaction_output_write_memtable(KVStore* kvstore, CompactionOutput* output, Memtable* memtable) {
+    uint64_t sequence = 0;
+    for (MemtableNode* node = memtable_first(memtable, UINT64_MAX); node;
+         node = memtable_next_key(node, UINT64_MAX)) {
+        compaction_output_add(output, node->key, node->kLen, node->value, node->vLen);
+        if (node->seq > sequence) sequence = node->seq;
+    }
+    SSTable* sstable = compaction_output_finish(kvstore, output);
+    if (sstable) sstable->sequence = sequence;
+    return sstable;
+}
+
+int level_file_count(KVStore* kvstore, int level) {
+    int count = 0;
+    for (SSTable* t = kvstore->levels[level]; t; t = t->next) count++;
+    return count;
+}
+
+long level_bytes(KVStore* kvstore, int level) {
+    long bytes = 0;
+    for (SSTable* t = kvstore->levels[level]; t; t = t->next) bytes += (long) t->data_size;
+    return bytes;
+}
+
+// What level_bytes() would be had no block been compressed
+long level_raw_bytes(KVStore* kvstore, int level) {
+    long bytes = 0;
+    for (SSTable* t = kvstore->levels[level]; t; t = t->next) bytes += (long) t->raw_size;
+    return bytes;
+}
+
+long level_max_bytes(KVStore* kvstore, int level) {
+    long bytes = kvstore->level1_max_bytes;
+    for (int l = 1; l < level; l++) bytes *= kvstore->level_size_multiplier;
+    return bytes;
+}
+
+// Pick the level most in need of compaction, or -1 if all are in shape.
+// The last level has nowhere to push data and is never picked.
+int pick_compaction_level(KVStore* kvstore) {
+    int best_level = -1;
+    double best_score = 1.0;
+
+    for (int level = 0; level < NUM_LEVELS - 1; level++) {
+        double score;
+        if (level == 0) {
+            score = (double) level_file_count(kvstore, 0) / kvstore->level0_file_trigger;
+        } else {
+            score = (double) level_bytes(kvstore, level) / level_max_bytes(kvstore, level);
+        }
+        if (score >= best_score) {
+            best_score = score;
+            best_level = level;
+        }
+    }
+    return best_level;
+}
+
+int is_compaction_input(SSTable* sstable, SSTable** inputs, int num_inputs) {
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i] == sstable) return 1;
+    }
+    return 0;
+}
+
+// Could a table of version outside the merge, at output_level or deeper,
+// hold an older version of key?
+int key_may_exist_below(Version* version, SSTable** inputs, int num_inputs, int output_level,
+                        const char* key, int kLen) {
+    for (int level = output_level; level < NUM_LEVELS; level++) {
+        for (int i = 0; i < version->num_files[level]; i++) {
+            SSTable* t = version->files[level][i];
+            if (sstable_contains_key(t, key, kLen) && !is_compaction_input(t, inputs, num_inputs)) return 1;
+        }
+    }
+    return 0;
+}
+
+void subcompaction_add_output(Subcompaction* sub, SSTable* table) {
+    if (sub->num_outputs >= sub->outputs_cap) {
+        sub->outputs_cap = sub->outputs_cap ? sub->outputs_cap * 2 : 4;
+        sub->outputs = realloc(sub->outputs, sub->outputs_cap * sizeof(SSTable*));
+    }
+    sub->outputs[sub->num_outputs++] = table;
+}
+
+// Merge the keys of sub's range, newest input first, into tables at its
+// output level, starting a new table once one reaches max_output_size (0
+// for a single table). Runs without the store mutex, possibly next to
+// the other ranges of the same compaction: it sees the levels only
+// through sub->version. On failure the outputs are removed and
+// sub->result is -1.
+void subcompaction_run(Subcompaction* sub) {
+    KVStore* kvstore = sub->kvstore;
+    MergingIter merge;
+    merging_iter_init_tables(&merge, sub->inputs, sub->num_inputs);
+
+    CompactionOutput output;
+    int output_open = 0;
+    char* last_key = NULL;
+    int last_kLen = -1;
+    int last_key_cap = 0;
+    sub->result = 0;
+
+    int ok = sub->start ? merging_iter_seek(&merge, sub->start, sub->start_kLen)
+                        : merging_iter_seek_to_first(&merge);
+    for (; ok; ok = merging_iter_next(&merge)) {
+        TableIter* current = merging_iter_current(&merge);
+        if (sub->limit && compare_key_bytes(current->key, current->kLen, sub->limit, sub->limit_kLen) >= 0) {
+            break;
+        }
+
+        // Older versions of a key come after the newest one; skip them
+        if (last_kLen >= 0 && compare_key_bytes(current->key, current->kLen, last_key, last_kLen) == 0) {
+            continue;
+        }
+        if (current->kLen > last_key_cap) {
+            last_key_cap = current->kLen * 2;
+            last_key = realloc(last_key, last_key_cap);
+        }
+        memcpy(last_key, current->key, current->kLen);
+        last_kLen = current->kLen;
+
+        if (current->vLen < 0 &&
+            !key_may_exist_below(sub->version, sub->inputs, sub->num_inputs, sub->output_level,
+                                 current->key, current->kLen)) {
+            continue;
+        }
+
+        // Split outputs between keys once they reach the target size
+        if (output_open && sub->max_output_size > 0 &&
+            compaction_output_size(&output) >= (uint64_t) sub->max_output_size) {
+            SSTable* table = compaction_output_finish(kvstore, &output);
+            output_open = 0;
+            if (!table) {
+                sub->result = -1;
+                break;
+            }
+            subcompaction_add_output(sub, table);
+        }
+        if (!output_open) {
+            if (compaction_output_open(kvstore, &output, sub->output_level) != 0) {
+                sub->result = -1;
+                break;
+            }
+            output_open = 1;
+        }
+        compaction_output_add(&output, current->key, current->kLen, current->value, current->vLen);
+    }
+
+    // Outputs are only opened to take a record, so a missing table means
+    // it could not be written
+    if (output_open) {
+        SSTable* table = compaction_output_finish(kvstore, &output);
+        if (table) {
+            subcompaction_add_output(sub, table);
+        } else {
+            sub->result = -1;
+        }
+    }
+
+    // A corrupt input block must not silently drop the rest of its table
+    if (merging_iter_status(&merge) != 0) {
+        sub->result = -1;
+    }
+    free(last_key);
+    merging_iter_free(&merge);
+
+    if (sub->result != 0) {
+        for (int i = 0; i < sub->num_outputs; i++) {
+            delete_sstable(sub->outputs[i]);
+        }
+        sub->num_outputs = 0;
+    }
+}
+
+void* subcompaction_worker(void* arg) {
+    subcompaction_run(arg);
+    return NULL;
+}
+
+int compare_block_handles(const void* a, const void* b) {
+    const TableBlockHandle* x = *(const TableBlockHandle* const*) a;
+    const TableBlockHandle* y = *(const TableBlockHandle* const*) b;
+    return compare_key_bytes(x->last_key, x->kLen, y->last_key, y->kLen);
+}
+
+// Pick up to num_ranges - 1 keys splitting the inputs into ranges of
+// about equal input bytes. The samples are the block indexes of the
+// inputs: each data block's last key, weighted by the block's size.
+// Tables without a block index are not sampled. Returns the number of
+// keys stored in bounds, in increasing order.
+int pick_subcompaction_bounds(SSTable** inputs, int num_inputs, int num_ranges, TableBlockHandle** bounds) {
+    int num_samples = 0;
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i]->format == SSTABLE_FORMAT_BLOCK) num_samples += inputs[i]->block_count;
+    }
+    if (num_samples < 2) return 0;
+
+    TableBlockHandle** samples = malloc(num_samples * sizeof(TableBlockHandle*));
+    uint64_t total = 0;
+    int n = 0;
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i]->format != SSTABLE_FORMAT_BLOCK) continue;
+        for (int b = 0; b < inputs[i]->block_count; b++) {
+            samples[n++] = &inputs[i]->blocks[b];
+            total += inputs[i]->blocks[b].size;
+        }
+    }
+    qsort(samples, num_samples, sizeof(TableBlockHandle*), compare_block_handles);
+
+    // Cutting after the last sample would only leave an empty range
+    int num_bounds = 0;
+    uint64_t seen = 0;
+    for (int i = 0; i < num_samples - 1 && num_bounds < num_ranges - 1; i++) {
+        seen += samples[i]->size;
+        if (seen < total / num_ranges * (num_bounds + 1)) continue;
+        if (num_bounds > 0 && compare_block_handles(&bounds[num_bounds - 1], &samples[i]) >= 0) continue;
+        bounds[num_bounds++] = samples[i];
+    }
+    free(samples);
+    return num_bounds;
+}
+
+// Merge inputs (newest first) of version into non-overlapping tables at
+// output_level, starting a new table once one reaches max_output_size (0
+// for a single table). Leveled merges with enough input are split by key
+// range into subcompactions that run on threads of their own; their
+// outputs never overlap and come back in key order, to be installed
+// together. Called without the store mutex. Returns -1 if an output could
+// not be written or an input could not be read in full; all outputs are
+// then removed.
+int merge_sstables(KVStore* kvstore, Version* version, SSTable** inputs, int num_inputs, int output_level,
+                   long max_output_size, SSTable*** outputs, int* num_outputs) {
+    // Each range should still fill a couple of output tables
+    int num_ranges = 1;
+    if (max_output_size > 0 && kvstore->max_subcompactions > 1) {
+        uint64_t input_bytes = 0;
+        for (int i = 0; i < num_inputs; i++) {
+            input_bytes += inputs[i]->data_size;
+        }
+        uint64_t by_size = input_bytes / (2 * (uint64_t) max_output_size);
+        num_ranges = by_size < (uint64_t) kvstore->max_subcompactions ? (int) by_size : kvstore->max_subcompactions;
+        if (num_ranges < 1) num_ranges = 1;
+    }
+    TableBlockHandle** bounds = malloc(num_ranges * sizeof(TableBlockHandle*));
+    num_ranges = 1 + (num_ranges > 1 ? pick_subcompaction_bounds(inputs, num_inputs, num_ranges, bounds) : 0);
+
+    Subcompaction* subs = calloc(num_ranges, sizeof(Subcompaction));
+    for (int i = 0; i < num_ranges; i++) {
+        Subcompaction* sub = &subs[i];
+        sub->kvstore = kvstore;
+        sub->version = version;
+        sub->inputs = inputs;
+        sub->num_inputs = num_inputs;
+        sub->output_level = output_level;
+        sub->max_output_size = max_output_size;
+        if (i > 0) {
+            sub->start = bounds[i - 1]->last_key;
+            sub->start_kLen = bounds[i - 1]->kLen;
+        }
+        if (i < num_ranges - 1) {
+            sub->limit = bounds[i]->last_key;
+            sub->limit_kLen = bounds[i]->kLen;
+        }
+    }
+
+    // The first range runs on this thread; one that gets no thread of its
+    // own runs here afterwards
+    pthread_t* threads = malloc(num_ranges * sizeof(pthread_t));
+    int* started = calloc(num_ranges, sizeof(int));
+    for (int i = 1; i < num_ranges; i++) {
+        started[i] = pthread_create(&threads[i], NULL, subcompaction_worker, &subs[i]) == 0;
+    }
+    subcompaction_run(&subs[0]);
+    for (int i = 1; i < num_ranges; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            subcompaction_run(&subs[i]);
+        }
+    }
+
+    int result = 0;
+    int total = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        if (subs[i].result != 0) result = -1;
+        total += subs[i].num_outputs;
+    }
+    *outputs = malloc((total > 0 ? total : 1) * sizeof(SSTable*));
+    *num_outputs = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        for (int j = 0; j < subs[i].num_outputs; j++) {
+            if (result == 0) {
+                (*outputs)[(*num_outputs)++] = subs[i].outputs[j];
+            } else {
+                delete_sstable(subs[i].outputs[j]);
+            }
+        }
+        free(subs[i].outputs);
+    }
+    __atomic_add_fetch(&kvstore->stats.subcompactions, num_ranges, __ATOMIC_RELAXED);
+
+    free(started);
+    free(threads);
+    free(subs);
+    free(bounds);
+    return result;
+}
+
+// Merge inputs into output_level, then swap the outputs in for the inputs
+// and publish the result. Called with the store mutex held, which is
+// released for the merge itself so writers and group commits go on: the
+// merge reads a snapshot of the levels, which also keeps the inputs open,
+// and only the compacting thread changes the levels meanwhile.
+int run_compaction(KVStore* kvstore, SSTable** inputs, int num_inputs, int output_level, long max_output_size) {
+    Version* version = version_create(kvstore);
+    SSTable** outputs;
+    int num_outputs;
+    pthread_mutex_unlock(&kvstore->store_mutex);
+    int merged = merge_sstables(kvstore, version, inputs, num_inputs, output_level, max_output_size,
+                                &outputs, &num_outputs);
+    pthread_mutex_lock(&kvstore->store_mutex);
+    if (merged != 0) {
+        free(outputs);
+        version_unref(version);
+        return -1;
+    }
+
+    // Outputs carry the newest sequence among the inputs
+    uint64_t sequence = 0;
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i]->sequence > sequence) sequence = inputs[i]->sequence;
+    }
+    for (int i = 0; i < num_outputs; i++) {
+        outputs[i]->sequence = sequence;
+    }
+    if (manifest_log_edit(kvstore, outputs, num_outputs, inputs, num_inputs) != 0) {
+        for (int i = 0; i < num_outputs; i++) {
+            delete_sstable(outputs[i]);
+        }
+        free(outputs);
+        version_unref(version);
+        return -1;
+    }
+
+    // Install the outputs, then retire the inputs
+    for (int i = 0; i < num_outputs; i++) {
+        add_sstable_to_level(kvstore, outputs[i]);
+        kvstore->stats.compaction_bytes_written += (long) outputs[i]->data_size;
+    }
+    for (int i = 0; i < num_inputs; i++) {
+        kvstore->stats.compaction_bytes_read += (long) inputs[i]->data_size;
+        remove_sstable_from_level(kvstore, inputs[i]);
+        delete_sstable(inputs[i]);
+    }
+    kvstore->stats.compactions++;
+    version_install(kvstore);
+    version_unref(version);
+
+    free(outputs);
+    return 0;
+}
+
+// Compact level into level + 1. Returns -1 (leaving the inputs in place)
+// if the merge failed.
+int compact_level(KVStore* kvstore, int level) {
+    int capacity = level_file_count(kvstore, level) + level_file_count(kvstore, level + 1);
+    SSTable** inputs = malloc((capacity > 0 ? capacity : 1) * sizeof(SSTable*));
+    int num_inputs = 0;
+
+    const char* smallest = NULL;
+    const char* largest = NULL;
+    int smallest_kLen = 0, largest_kLen = 0;
+
+    if (level == 0) {
+        // L0 tables may overlap each other, so they all move together
+        for (SSTable* t = kvstore->levels[0]; t; t = t->next) {
+            inputs[num_inputs++] = t;
+            if (!t->smallest_key) continue;
+            if (!smallest || compare_key_bytes(t->smallest_key, t->smallest_kLen, smallest, smallest_kLen) < 0) {
+                smallest = t->smallest_key;
+                smallest_kLen = t->smallest_kLen;
+            }
+            if (!largest || compare_key_bytes(t->largest_key, t->largest_kLen, largest, largest_kLen) > 0) {
+                largest = t->largest_key;
+                largest_kLen = t->largest_kLen;
+            }
+        }
+    } else {
+        // Take the first table past the previous compaction's end key
+        SSTable* picked = kvstore->levels[level];
+        if (kvstore->compact_pointer[level]) {
+            const char* pointer = kvstore->compact_pointer[level];
+            int pointer_kLen = kvstore->compact_pointer_kLen[level];
+            for (SSTable* t = kvstore->levels[level]; t; t = t->next) {
+                if (t->largest_key &&
+                    compare_key_bytes(t->largest_key, t->largest_kLen, pointer, pointer_kLen) > 0) {
+                    picked = t;
+                    break;
+                }
+            }
+        }
+        inputs[num_inputs++] = picked;
+        smallest = picked->smallest_key;
+        smallest_kLen = picked->smallest_kLen;
+        largest = picked->largest_key;
+        largest_kLen = picked->largest_kLen;
+
+        free(kvstore->compact_pointer[level]);
+        kvstore->compact_pointer[level] =
+            picked->largest_key ? copy_bytes(picked->largest_key, picked->largest_kLen) : NULL;
+        kvstore->compact_pointer_kLen[level] = picked->largest_kLen;
+    }
+
+    if (smallest) {
+        for (SSTable* t = kvstore->levels[level + 1]; t; t = t->next) {
+            if (sstable_overlaps(t, smallest, smallest_kLen, largest, largest_kLen)) {
+                inputs[num_inputs++] = t;
+            }
+        }
+    }
+
+    int result = run_compaction(kvstore, inputs, num_inputs, level + 1, kvstore->target_file_size);
+    free(inputs);
+    return result;
+}
+
+// Keep compacting until every level is within its target
+void run_level_compactions(KVStore* kvstore) {
+    int level;
+    while ((level = pick_compaction_level(kvstore)) >= 0) {
+        if (compact_level(kvstore, level) != 0) break;
+    }
+}
+
+// Length of the run of similar-sized tables at the newest end of L0, or 0
+// if it is too short to be worth merging
+int pick_tiered_compaction(KVStore* kvstore) {
+    int width = 0;
+    double total = 0;
+    for (SSTable* t = kvstore->levels[0]; t && width < kvstore->tiered_max_merge_width; t = t->next) {
+        if (width > 0) {
+            double average = total / width;
+            if ((double) t->data_size < average * TIERED_BUCKET_LOW ||
+                (double) t->data_size > average * TIERED_BUCKET_HIGH) {
+                break;
+            }
+        }
+        total += (double) t->data_size;
+        width++;
+    }
+    return width >= kvstore->tiered_min_merge_width ? width : 0;
+}
+
+// Merge runs of similar-sized tables until none is long enough
+void run_tiered_compactions(KVStore* kvstore) {
+    int width;
+    while ((width = pick_tiered_compaction(kvstore)) > 0) {
+        SSTable** inputs = malloc(width * sizeof(SSTable*));
+        SSTable* t = kvstore->levels[0];
+        for (int i = 0; i < width; i++, t = t->next) {
+            inputs[i] = t;
+        }
+        int result = run_compaction(kvstore, inputs, width, 0, 0);
+        free(inputs);
+        if (result != 0) break;
+    }
+}
+
+// Run the store's compaction policy after a flush
+void run_compactions(KVStore* kvstore) {
+    if (kvstore->compaction_style == COMPACTION_STYLE_SIZE_TIERED) {
+        run_tiered_compactions(kvstore);
+    } else {
+        run_level_compactions(kvstore);
+    }
+}
@@ -0,0 +1,210 @@
+#include "kvstore.h"
+
+// Block compression. Tables written with SSTABLE_FOOTER_V4 end every
+// block in a one-byte trailer naming the codec its contents were stored
+// with; COMPRESSION_NONE blocks hold their contents as is, others hold
+// {varint64: uncompressed size} followed by the codec's output. A block
+// is only stored compressed if that saves at least 1/8 of it, so
+// incompressible data costs one byte per block.
+//
+// Codecs are looked up by id in a registry that starts out with the
+// built-in LZ codec; block_codec_register() adds others. Ids are written
+// to disk, so a codec's id must never change.
+
+// Built-in LZ77 codec in the style of LZ4's block format: a sequence of
+// {token, literal length bytes, literals, uint16: match offset, match
+// length bytes}, the token's high nibble holding the literal length and
+// its low nibble the match length minus LZ_MIN_MATCH, each extended with
+// 255-valued bytes once it reaches 15. The last sequence has literals
+// only. Matches are found through a hash table of the 4-byte prefixes
+// seen so far, so compression is a single greedy pass.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+uint32_t lz_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_max_compressed_size(size_t n) {
+    return n + n / 255 + 16;
+}
+
+unsigned char* lz_write_length(unsigned char* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+// Emit literals [anchor, anchor + literals) and, if match_len > 0, a match
+unsigned char* lz_write_sequence(unsigned char* op, const unsigned char* anchor, size_t literals,
+                                 size_t offset, size_t match_len) {
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *op++ = (unsigned char) (((literals < 15 ? literals : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literals >= 15) op = lz_write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (match_len == 0) return op;
+
+    *op++ = (unsigned char) (offset & 0xff);
+    *op++ = (unsigned char) (offset >> 8);
+    if (match_code >= 15) op = lz_write_length(op, match_code - 15);
+    return op;
+}
+
+size_t lz_compress(const char* src, size_t n, char* dst) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* op = (unsigned char*) dst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t h = lz_hash(lz_read32(in + ip));
+        size_t candidate = table[h];
+        table[h] = (uint32_t) ip;
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET ||
+            lz_read32(in + candidate) != lz_read32(in + ip)) {
+            ip++;
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n && in[candidate + len] == in[ip + len]) len++;
+        op = lz_write_sequence(op, in + anchor, ip - anchor, ip - candidate, len);
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_write_sequence(op, in + anchor, n - anchor, 0, 0);
+    return (size_t) (op - (unsigned char*) dst);
+}
+
+// Read an extended length at *ip, adding it to *len. Returns -1 if the
+// input ends first.
+int lz_read_length(const unsigned char** ip, const unsigned char* end, size_t* len) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) return -1;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz_decompress(const char* src, size_t n, char* dst, size_t size) {
+    const unsigned char* ip = (const unsigned char*) src;
+    const unsigned char* end = ip + n;
+    unsigned char* op = (unsigned char*) dst;
+    unsigned char* op_end = op + size;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lz_read_length(&ip, end, &literals) != 0) return -1;
+        if ((size_t) (end - ip) < literals || (size_t) (op_end - op) < literals) return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end) break;
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && lz_read_length(&ip, end, &len) != 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - (unsigned char*) dst) || (size_t) (op_end - op) < len) return -1;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        const unsigned char* match = op - offset;
+        for (size_t i = 0; i < len; i++) {
+            op[i] = match[i];
+        }
+        op += len;
+    }
+    return op == op_end ? 0 : -1;
+}
+
+BlockCodec lz_codec = {COMPRESSION_LZ, "lz", lz_max_compressed_size, lz_compress, lz_decompress};
+
+BlockCodec* block_codecs[MAX_COMPRESSION_CODECS] = {[COMPRESSION_LZ] = &lz_codec};
+
+// Add a codec under its id, which must be unused and below
+// MAX_COMPRESSION_CODECS. Call before opening stores that use it.
+int block_codec_register(BlockCodec* codec) {
+    if (!codec || codec->id <= COMPRESSION_NONE || codec->id >= MAX_COMPRESSION_CODECS ||
+        block_codecs[codec->id]) {
+        return -1;
+    }
+    block_codecs[codec->id] = codec;
+    return 0;
+}
+
+BlockCodec* block_codec_find(int id) {
+    if (id <= COMPRESSION_NONE || id >= MAX_COMPRESSION_CODECS) return NULL;
+    return block_codecs[id];
+}
+
+// Compress a finished block for storage with codec into *scratch (grown
+// as needed and kept by the caller across blocks), trailer included.
+// Returns its stored size, or 0 if the codec is unknown or does not save
+// enough, in which case the block is stored as is.
+size_t block_compress(int codec_id, const char* data, size_t size, char** scratch, size_t* scratch_cap) {
+    BlockCodec* codec = block_codec_find(codec_id);
+    if (!codec) return 0;
+
+    size_t needed = 10 + codec->max_compressed_size(size) + 1;
+    if (needed > *scratch_cap) {
+        *scratch_cap = needed;
+        *scratch = realloc(*scratch, needed);
+    }
+    char* buf = *scratch;
+    size_t n = (size_t) encode_varint64(buf, (uint64_t) size);
+    size_t compressed = codec->compress(data, size, buf + n);
+    n += compressed;
+    if (compressed == 0 || n >= size - size / 8) return 0;
+    buf[n++] = (char) codec_id;
+    return n;
+}
+
+// Decode a stored block (contents, possibly compressed, plus trailer).
+// Uncompressed contents are returned in place with *owned set to NULL;
+// compressed ones are decompressed into *owned, which the caller frees.
+// Returns -1 for an unknown codec or damaged block.
+int block_decode(const char* raw, size_t size, const char** data, size_t* data_size, char** owned) {
+    *owned = NULL;
+    if (size < 1) return -1;
+    int codec_id = (unsigned char) raw[size - 1];
+    if (codec_id == COMPRESSION_NONE) {
+        *data = raw;
+        *data_size = size - 1;
+        return 0;
+    }
+
+    BlockCodec* codec = block_codec_find(codec_id);
+    uint64_t raw_size;
+    const char* limit = raw + size - 1;
+    const char* p = codec ? decode_varint64(raw, limit, &raw_size) : NULL;
+    if (!p) return -1;
+
+    char* buf = malloc(raw_size > 0 ? raw_size : 1);
+    if (!buf) return -1;
+    if (codec->decompress(p, (size_t) (limit - p), buf, (size_t) raw_size) != 0) {
+        free(buf);
+        return -1;
+    }
+    *data = buf;
+    *data_size = (size_t) raw_size;
+    *owned = buf;
+    return 0;
+}
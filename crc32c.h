@@ -0,0 +1,96 @@
+#include "kvstore.h"
+
+// CRC32C (Castagnoli) checksums for log records and SSTable blocks. On
+// x86-64 CPUs with SSE4.2 the crc32 instruction does 8 bytes per step;
+// elsewhere a slicing-by-8 table does the same work with eight lookups.
+// The implementation is picked once, on first use.
+
+#define CRC32C_POLY 0x82f63b78u  // Reflected Castagnoli polynomial
+
+uint32_t crc32c_table[8][256];
+uint32_t (*crc32c_update)(uint32_t crc, const unsigned char* p, size_t n);
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_update_table(uint32_t crc, const unsigned char* p, size_t n) {
+    while (n > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+    while (n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HAVE_SSE42 1
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_sse42(uint32_t crc, const unsigned char* p, size_t n) {
+    while (n > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        n--;
+    }
+    uint64_t crc64 = crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t) crc64;
+    while (n > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        n--;
+    }
+    return crc;
+}
+#endif
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    // Table k advances a byte through k more zero bytes
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    crc32c_update = crc32c_update_table;
+#ifdef CRC32C_HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_update_sse42;
+    }
+#endif
+}
+
+// Extend crc, the CRC32C of some earlier bytes, with n more bytes
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t n) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, (const unsigned char*) data, n);
+}
+
+uint32_t crc32c_value(const char* data, size_t n) {
+    return crc32c_extend(0, data, n);
+}
@@ -2,74 +2,88 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-// Helper function to create a data record
-DataRecord* create_record(char* key, char* value, int position) {
-    DataRecord* record = malloc(sizeof(DataRecord));
-    record->kLen = strlen(key);
-    record->vLen = value ? strlen(value) : -1;
-    record->key = strdup(key);
-    record->value = value ? strdup(value) : NULL;
-    record->position = position;
-    return record;
+// Bytes of each of the two length fields that start a record or batch
+// header in a log of HEAP_FILE_* format version
+size_t heap_length_size(int version) {
+    return version >= HEAP_FILE_V3 ? sizeof(int64_t) : sizeof(int);
 }
 
-// Comparison function for sorting records
-int compare_records(const void* a, const void* b) {
-    DataRecord* rec_a = *(DataRecord**)a;
-    DataRecord* rec_b = *(DataRecord**)b;
-    return strcmp(rec_a->key, rec_b->key);
+// Encode the two length fields of a record or batch header for a log of
+// format version into buf, returning the bytes written
+size_t encode_heap_lengths(char* buf, int version, int64_t first, int64_t second) {
+    if (version >= HEAP_FILE_V3) {
+        memcpy(buf, &first, sizeof(int64_t));
+        memcpy(buf + sizeof(int64_t), &second, sizeof(int64_t));
+    } else {
+        int fields[2] = {(int) first, (int) second};
+        memcpy(buf, fields, sizeof(fields));
+    }
+    return 2 * heap_length_size(version);
 }
 
-// Read a data record from file
-DataRecord* read_record_from_file(FILE* file, int position) {
-    if (fseek(file, position, SEEK_SET) != 0) return NULL;
+// Read the two length fields at the file's position into fields[]; raw
+// gets their bytes as stored, which the checksum covers. Returns 0 if the
+// file ends first.
+int read_heap_lengths(FILE* file, int version, char* raw, int64_t fields[2]) {
+    size_t width = heap_length_size(version);
+    if (fread(raw, width, 2, file) != 2) return 0;
+    if (version >= HEAP_FILE_V3) {
+        memcpy(fields, raw, 2 * sizeof(int64_t));
+    } else {
+        int narrow[2];
+        memcpy(narrow, raw, sizeof(narrow));
+        fields[0] = narrow[0];
+        fields[1] = narrow[1];
+    }
+    return 1;
+}
+
+// Read a data record from file, a log in HEAP_FILE_* format version,
+// decoding it straight into arena: the record, its key and its value all
+// live there until the arena is released. file_size, the size of the file
+// taken once by the caller, bounds the lengths. Returns NULL if the record
+// is cut short, has lengths reaching past the end of the file or (from
+// HEAP_FILE_V2 on) fails its checksum.
+DataRecord* read_record_from_file(FILE* file, int64_t position, int64_t file_size, int version, Arena* arena) {
+    if (fseeko(file, (off_t) position, SEEK_SET) != 0) return NULL;
     
-    int kLen, vLen;
-    if (fread(&kLen, sizeof(int), 1, file) != 1) return NULL;
-    if (fread(&vLen, sizeof(int), 1, file) != 1) return NULL;
+    char lengths[2 * sizeof(int64_t)];
+    int64_t fields[2];
+    if (!read_heap_lengths(file, version, lengths, fields)) return NULL;
+    size_t lengths_size = 2 * heap_length_size(version);
+    int64_t kLen = fields[0];
+    int64_t vLen = fields[1];
+    if (kLen < 0 || kLen > INT_MAX || vLen < -1) return NULL;
     
-    char* key = malloc(kLen + 1);
-    if (fread(key, sizeof(char), (size_t) kLen, file) != (size_t) kLen) {
-        free(key);
+    // Damaged lengths must not turn into huge allocations
+    int64_t available = file_size - position - (int64_t) lengths_size;
+    if (kLen > available || (vLen > 0 && vLen > available - kLen)) {
         return NULL;
     }
-    key[kLen] = '\0';
     
-    char* value = NULL;
+    // One block for the record with its key and value behind it
+    size_t size = sizeof(DataRecord) + (size_t) kLen + 1 + (vLen >= 0 ? (size_t) vLen + 1 : 0);
+    DataRecord* record = arena_alloc(arena, size);
+    if (!record) return NULL;
+    record->kLen = (int) kLen;
+    record->vLen = vLen;
+    record->key = (char*) (record + 1);
+    record->value = vLen >= 0 ? record->key + kLen + 1 : NULL;
+    record->position = position;
+    
+    if (fread(record->key, sizeof(char), (size_t) kLen, file) != (size_t) kLen) return NULL;
+    record->key[kLen] = '\0';
     if (vLen >= 0) {
-        value = malloc(vLen + 1);
-        if (fread(value, sizeof(char), (size_t) vLen, file) != (size_t) vLen) {
-            free(key);
-            free(value);
-            return NULL;
-        }
-        value[vLen] = '\0';
+        if (fread(record->value, sizeof(char), (size_t) vLen, file) != (size_t) vLen) return NULL;
+        record->value[vLen] = '\0';
     }
     
-    DataRecord* record = create_record(key, value, position);
-    free(key);
-    free(value);
-    return record;
-}
-
-// Write a data record to file
-void write_record_to_file(FILE* file, DataRecord* record) {
-    fwrite(&record->kLen, sizeof(int), 1, file);
-    fwrite(&record->vLen, sizeof(int), 1, file);
-    fwrite(record->key, sizeof(char), record->kLen, file);
-    if (record->vLen >= 0) {
-        fwrite(record->value, sizeof(char), record->vLen, file);
-    }
-    fflush(file);
-}
-
-// Helper function to free a data record
-void free_record(DataRecord* record) {
-    if (record) {
-        free(record->key);
-        free(record->value);
-        free(record);
+    if (version >= HEAP_FILE_V2) {
+        uint32_t stored;
+        uint32_t crc = crc32c_value(lengths, lengths_size);
+        crc = crc32c_extend(crc, record->key, (size_t) kLen);
+        if (vLen > 0) crc = crc32c_extend(crc, record->value, (size_t) vLen);
+        if (fread(&stored, sizeof(uint32_t), 1, file) != 1 || stored != crc) return NULL;
     }
+    return record;
 }
-
-
@@ -92,6 +92,35 @@ int parse_del_command(char* line, char* key) {
     return 1;
 }
 
+// SCAN [<start_key>] [<limit>]; key is left empty to scan from the start.
+// Returns 1 for a SCAN, 0 if the line is not one and -1 if it is a SCAN
+// with invalid arguments, which has already been reported.
+int parse_scan_command(char* line, char* key, int* limit) {
+    char* token = strtok(line, " \t");
+    if (!token || strcasecmp(token, "SCAN") != 0) return 0;
+    
+    key[0] = '\0';
+    *limit = 10;
+    token = strtok(NULL, " \t\n\r");
+    if (token) {
+        if (strlen(token) >= MAX_KEY_LENGTH) {
+            printf("Error: SCAN start key longer than %d bytes\n", MAX_KEY_LENGTH - 1);
+            return -1;
+        }
+        strcpy(key, token);
+        token = strtok(NULL, " \t\n\r");
+        if (token) {
+            *limit = atoi(token);
+            if (*limit <= 0) {
+                printf("Error: SCAN limit must be a positive number\n");
+                return -1;
+            }
+        }
+    }
+    
+    return 1;
+}
+
 int parse_compact_command(char* line) {
     char* token = strtok(line, " \t\n\r");
     return (token && strcasecmp(token, "COMPACT") == 0);
@@ -155,12 +184,39 @@ void process_query(char* line) {
                         printf("COMPACT executed\n");
                     }
                     else {
-                        printf("Error: Unknown command. Supported commands:\n");
-                        printf("  PUT <key> <value>\n");
-                        printf("  GET <key>\n");
-                        printf("  DGET <key>\n");
-                        printf("  DEL <key>\n");
-                        printf("  COMPACT\n");
+                        strcpy(line_copy, line);
+                        trim_whitespace(line_copy);
+                        
+                        int limit;
+                        int scan = parse_scan_command(line_copy, key, &limit);
+                        if (scan == 1) {
+                            KVIterator* it = iterator_create();
+                            if (key[0]) {
+                                iterator_seek(it, key);
+                            } else {
+                                iterator_seek_to_first(it);
+                            }
+                            int count = 0;
+                            for (; iterator_valid(it) && count < limit; iterator_next(it)) {
+                                printf("SCAN %s -> %s\n", iterator_key(it), iterator_value(it));
+                                count++;
+                            }
+                            if (iterator_status(it) != 0) {
+                                printf("Error: SCAN stopped after %d keys at data that could not be read\n", count);
+                            } else {
+                                printf("SCAN returned %d keys\n", count);
+                            }
+                            iterator_free(it);
+                        }
+                        else if (scan == 0) {
+                            printf("Error: Unknown command. Supported commands:\n");
+                            printf("  PUT <key> <value>\n");
+                            printf("  GET <key>\n");
+                            printf("  DGET <key>\n");
+                            printf("  DEL <key>\n");
+                            printf("  SCAN [<start_key>] [<limit>]\n");
+                            printf("  COMPACT\n");
+                        }
                     }
                 }
             }
@@ -179,6 +235,7 @@ int main(int argc, char* argv[]) {
         printf("    GET <key>         - Retrieve value for key\n");
         printf("    DGET <key>        - (With debug steps) Retrieve value for key\n");
         printf("    DEL <key>         - Delete key (creates tombstone)\n");
+        printf("    SCAN [start] [n]  - List up to n keys (default 10) from start\n");
         printf("    COMPACT           - Trigger compaction\n");
         printf("    quit              - Exit the program\n");
         return 1;
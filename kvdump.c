@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -9,6 +10,58 @@
 #define HEAP_FILE_NAME "heap.dat"
 #define INDEX_FILE_NAME "index.dat"
 #define SSTABLE_PREFIX "sstable_"
+#define SSTABLE_INDEX_PREFIX "sstable_index_"
+#define SSTABLE_BLOOM_PREFIX "sstable_bloom_"
+#define MANIFEST_FILE_NAME "MANIFEST"
+
+// Block-based SSTable footer (matching kvstore.h and sstable.h)
+#define SSTABLE_MAGIC 0x74696e7964627462ULL
+#define SSTABLE_FOOTER_V2 2
+#define SSTABLE_FOOTER_V3 3
+#define SSTABLE_FOOTER_V4 4
+#define SSTABLE_FOOTER_V5 5
+#define SSTABLE_FOOTER_V6 6
+#define BLOCK_CHECKSUM_SIZE 4
+#define SSTABLE_FOOTER_MAX_SIZE 64
+
+// Block codecs (matching kvstore.h)
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ 1
+
+// Write batch header in heap.dat (matching kvstore.h)
+#define WAL_BATCH_MARKER -2
+
+// heap.dat versions (matching kvstore.h); logs without a header are
+// version 1, from version 2 on records and batch headers end in a CRC32C
+// and from version 3 on their two length fields are int64s
+#define HEAP_FILE_MARKER -1
+#define HEAP_FILE_V2 2
+#define HEAP_FILE_V3 3
+
+// Index file versions (matching kvstore.h); SSTable index files and old
+// heap indexes have no header and are version 1
+#define INDEX_FILE_MARKER -1
+#define INDEX_FILE_V1 1
+#define INDEX_FILE_V2 2
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint32_t record_count;
+    uint32_t level;
+    uint32_t compression;
+    uint64_t raw_data_size;
+    uint32_t version;
+    uint64_t magic;
+} TableFooter;
+
+// Strips the codec trailer off a v4 block, decompressing it if needed
+// (compression.h, linked in from kvstore.o)
+int block_decode(const char* raw, size_t size, const char** data, size_t* data_size, char** owned);
+
+// CRC32C of data (crc32c.h, linked in from kvstore.o)
+uint32_t crc32c_value(const char* data, size_t n);
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t n);
 
 // ANSI color codes for better output formatting
 #define COLOR_RESET   "\033[0m"
@@ -47,10 +100,10 @@ void print_file_header(const char* filename, const char* file_type) {
 }
 
 // Print record in formatted way
-void print_record(int record_num, int kLen, int vLen, const char* key, const char* value, long position) {
+void print_record(int record_num, int kLen, int64_t vLen, const char* key, const char* value, long position) {
     printf("%s[Record #%d]%s Position: %ld\n", COLOR_CYAN, record_num, COLOR_RESET, position);
     printf("  Key Length:   %d\n", kLen);
-    printf("  Value Length: %d", vLen);
+    printf("  Value Length: %lld", (long long) vLen);
     
     if (vLen == -1) {
         printf(" %s(TOMBSTONE)%s\n", COLOR_RED, COLOR_RESET);
@@ -71,14 +124,230 @@ void print_record(int record_num, int kLen, int vLen, const char* key, const cha
 }
 
 // Print index entry
-void print_index_entry(int entry_num, int kLen, int position, const char* key) {
+void print_index_entry(int entry_num, int kLen, int64_t position, const char* key) {
     printf("%s[Index Entry #%d]%s\n", COLOR_CYAN, entry_num, COLOR_RESET);
     printf("  Key Length:   %d\n", kLen);
-    printf("  Data Position: %d\n", position);
+    printf("  Data Position: %lld\n", (long long) position);
     printf("  Key:          \"%s%s%s\"\n", COLOR_YELLOW, key, COLOR_RESET);
     printf("\n");
 }
 
+// Decode a varint from [p, limit), returning the byte after it or NULL
+const unsigned char* read_varint(const unsigned char* p, const unsigned char* limit, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift <= 63 && p < limit; shift += 7) {
+        uint64_t byte = *p++;
+        result |= (byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Walk every entry of one block, calling visit() with the rebuilt key.
+// Returns the number of entries decoded, or -1 on corruption.
+int walk_block(const unsigned char* block, uint64_t size,
+               void (*visit)(const char* key, int kLen, const unsigned char* value, int64_t vLen, void* ctx),
+               void* ctx) {
+    if (size < sizeof(uint32_t)) return -1;
+    uint32_t num_restarts;
+    memcpy(&num_restarts, block + size - sizeof(uint32_t), sizeof(uint32_t));
+    if ((uint64_t) (num_restarts + 1) * sizeof(uint32_t) > size) return -1;
+    
+    const unsigned char* p = block;
+    const unsigned char* limit = block + size - (num_restarts + 1) * sizeof(uint32_t);
+    char* key = NULL;
+    int kLen = 0;
+    int count = 0;
+    
+    while (p < limit) {
+        uint64_t shared, non_shared, value_tag;
+        p = read_varint(p, limit, &shared);
+        if (p) p = read_varint(p, limit, &non_shared);
+        if (p) p = read_varint(p, limit, &value_tag);
+        int64_t vLen = (int64_t) value_tag - 1;
+        if (!p || shared > (uint64_t) kLen || value_tag > INT64_MAX || (uint64_t) (limit - p) < non_shared ||
+            (vLen > 0 && (uint64_t) vLen > (uint64_t) (limit - p) - non_shared)) {
+            free(key);
+            return -1;
+        }
+        
+        kLen = (int) (shared + non_shared);
+        key = realloc(key, kLen + 1);
+        memcpy(key + shared, p, non_shared);
+        key[kLen] = '\0';
+        p += non_shared;
+        
+        visit(key, kLen, p, vLen, ctx);
+        if (vLen > 0) p += vLen;
+        count++;
+    }
+    free(key);
+    return count;
+}
+
+typedef struct {
+    FileStats* stats;
+    int record_num;
+    long block_offset;
+} BlockDumpContext;
+
+void visit_data_entry(const char* key, int kLen, const unsigned char* value, int64_t vLen, void* ctx) {
+    BlockDumpContext* dump = ctx;
+    char* value_copy = NULL;
+    if (vLen > 0) {
+        value_copy = malloc(vLen + 1);
+        memcpy(value_copy, value, vLen);
+        value_copy[vLen] = '\0';
+        dump->stats->live_records++;
+        dump->stats->total_value_bytes += vLen;
+    } else if (vLen == -1) {
+        dump->stats->tombstone_records++;
+    }
+    
+    print_record(dump->record_num++, kLen, vLen, key, value_copy, dump->block_offset);
+    dump->stats->total_records++;
+    dump->stats->total_key_bytes += kLen;
+    free(value_copy);
+}
+
+typedef struct {
+    uint64_t* offsets;
+    uint64_t* sizes;
+    int count;
+} BlockHandles;
+
+void visit_index_entry(const char* key, int kLen, const unsigned char* value, int64_t vLen, void* ctx) {
+    BlockHandles* handles = ctx;
+    uint64_t offset = 0, size = 0;
+    const unsigned char* limit = value + (vLen > 0 ? vLen : 0);
+    const unsigned char* p = read_varint(value, limit, &offset);
+    if (p) read_varint(p, limit, &size);
+    
+    printf("%s[Block #%d]%s Offset: %llu  Size: %llu  Last Key: \"%s%s%s\" (%d bytes)\n",
+           COLOR_CYAN, handles->count + 1, COLOR_RESET,
+           (unsigned long long) offset, (unsigned long long) size,
+           COLOR_YELLOW, key, COLOR_RESET, kLen);
+    
+    handles->offsets = realloc(handles->offsets, (handles->count + 1) * sizeof(uint64_t));
+    handles->sizes = realloc(handles->sizes, (handles->count + 1) * sizeof(uint64_t));
+    handles->offsets[handles->count] = offset;
+    handles->sizes[handles->count] = size;
+    handles->count++;
+}
+
+// Read the footer from the end of a block-based SSTable. Every version
+// ends in {uint32: version, uint64: magic}; the fields before that
+// depend on the version.
+int read_table_footer(FILE* file, long file_size, TableFooter* footer) {
+    unsigned char tail[SSTABLE_FOOTER_MAX_SIZE];
+    long tail_len = file_size < SSTABLE_FOOTER_MAX_SIZE ? file_size : SSTABLE_FOOTER_MAX_SIZE;
+    if (tail_len < 12) return -1;
+    
+    fseek(file, file_size - tail_len, SEEK_SET);
+    if (fread(tail, 1, tail_len, file) != (size_t) tail_len) return -1;
+    memcpy(&footer->magic, tail + tail_len - 8, 8);
+    memcpy(&footer->version, tail + tail_len - 12, 4);
+    if (footer->magic != SSTABLE_MAGIC) return -1;
+    
+    long size;
+    if (footer->version == SSTABLE_FOOTER_V2) size = 32;
+    else if (footer->version == SSTABLE_FOOTER_V3) size = 36;
+    else if (footer->version >= SSTABLE_FOOTER_V4 && footer->version <= SSTABLE_FOOTER_V6) size = 48;
+    else return -1;
+    if (size > tail_len) return -1;
+    
+    const unsigned char* p = tail + tail_len - size;
+    memcpy(&footer->index_offset, p, 8);
+    memcpy(&footer->index_size, p + 8, 8);
+    memcpy(&footer->record_count, p + 16, 4);
+    footer->level = 0;
+    footer->compression = COMPRESSION_NONE;
+    footer->raw_data_size = footer->index_offset;
+    if (footer->version >= SSTABLE_FOOTER_V3) {
+        memcpy(&footer->level, p + 20, 4);
+    }
+    if (footer->version >= SSTABLE_FOOTER_V4) {
+        memcpy(&footer->compression, p + 24, 4);
+        memcpy(&footer->raw_data_size, p + 28, 8);
+    }
+    if (footer->index_offset + footer->index_size > (uint64_t) (file_size - size)) return -1;
+    return 0;
+}
+
+const char* codec_name(uint32_t compression) {
+    switch (compression) {
+        case COMPRESSION_NONE: return "none";
+        case COMPRESSION_LZ: return "lz";
+        default: return "unknown";
+    }
+}
+
+// Walk one stored block, checking its CRC and decoding it first if the
+// table has block trailers. Returns -1 if it is damaged.
+int walk_table_block(const unsigned char* data, TableFooter* footer, uint64_t offset, uint64_t size,
+                     void (*visit)(const char* key, int kLen, const unsigned char* value, int64_t vLen, void* ctx),
+                     void* ctx) {
+    if (footer->version < SSTABLE_FOOTER_V4) {
+        return walk_block(data + offset, size, visit, ctx);
+    }
+    if (footer->version >= SSTABLE_FOOTER_V5) {
+        uint32_t stored;
+        if (size <= BLOCK_CHECKSUM_SIZE) return -1;
+        size -= BLOCK_CHECKSUM_SIZE;
+        memcpy(&stored, data + offset + size, BLOCK_CHECKSUM_SIZE);
+        if (crc32c_value((const char*) data + offset, size) != stored) {
+            printf("%sChecksum mismatch in block at offset %llu%s\n",
+                   COLOR_RED, (unsigned long long) offset, COLOR_RESET);
+            return -1;
+        }
+    }
+    const char* contents;
+    size_t contents_size;
+    char* owned;
+    if (block_decode((const char*) data + offset, size, &contents, &contents_size, &owned) != 0) return -1;
+    int count = walk_block((const unsigned char*) contents, contents_size, visit, ctx);
+    free(owned);
+    return count;
+}
+
+// Dump a block-based SSTable: the block index, then every data block
+void dump_block_table(const unsigned char* data, TableFooter* footer, FileStats* stats) {
+    printf("Format: block-based (version %u), level %u, %u records\n",
+           footer->version, footer->level, footer->record_count);
+    if (footer->version >= SSTABLE_FOOTER_V4) {
+        printf("Compression: %s (codec %u), data blocks %llu -> %llu bytes (ratio %.2f)\n",
+               codec_name(footer->compression), footer->compression,
+               (unsigned long long) footer->raw_data_size, (unsigned long long) footer->index_offset,
+               footer->index_offset > 0 ? (double) footer->raw_data_size / footer->index_offset : 1.0);
+    }
+    printf("\n");
+    
+    BlockHandles handles = {NULL, NULL, 0};
+    if (walk_table_block(data, footer, footer->index_offset, footer->index_size, visit_index_entry, &handles) < 0) {
+        printf("%sCorrupted block index%s\n", COLOR_RED, COLOR_RESET);
+    }
+    printf("\n");
+    
+    BlockDumpContext dump = {stats, 1, 0};
+    for (int i = 0; i < handles.count; i++) {
+        if (handles.offsets[i] + handles.sizes[i] > footer->index_offset) {
+            printf("%sBlock #%d lies outside the data region%s\n", COLOR_RED, i + 1, COLOR_RESET);
+            break;
+        }
+        dump.block_offset = (long) handles.offsets[i];
+        if (walk_table_block(data, footer, handles.offsets[i], handles.sizes[i], visit_data_entry, &dump) < 0) {
+            printf("%sCorrupted data block #%d%s\n", COLOR_RED, i + 1, COLOR_RESET);
+            break;
+        }
+    }
+    
+    free(handles.offsets);
+    free(handles.sizes);
+}
+
 // Read and dump a data file (heap file or SSTable)
 FileStats dump_data_file(const char* filepath, const char* file_type) {
     FileStats stats = {0, 0, 0, 0, 0, 0};
@@ -97,29 +366,78 @@ FileStats dump_data_file(const char* filepath, const char* file_type) {
     print_file_header(filepath, file_type);
     printf("File Size: %ld bytes\n\n", stats.file_size);
     
+    // Block-based SSTables end with a footer carrying the format magic
+    TableFooter footer;
+    if (read_table_footer(file, stats.file_size, &footer) == 0) {
+        unsigned char* data = malloc(stats.file_size);
+        fseek(file, 0, SEEK_SET);
+        if (fread(data, 1, stats.file_size, file) == (size_t) stats.file_size) {
+            dump_block_table(data, &footer, &stats);
+        }
+        free(data);
+        fclose(file);
+        return stats;
+    }
+    fseek(file, 0, SEEK_SET);
+    
+    // Logs from version 2 on start with a header and carry checksums
+    int version = 1;
+    int log_header[2];
+    if (fread(log_header, sizeof(int), 2, file) == 2 && log_header[0] == HEAP_FILE_MARKER) {
+        version = log_header[1];
+        printf("Log format version %d%s\n\n", version,
+               version >= HEAP_FILE_V2 ? ", records checksummed" : "");
+    } else {
+        fseek(file, 0, SEEK_SET);
+    }
+    int checksummed = version >= HEAP_FILE_V2;
+    size_t width = version >= HEAP_FILE_V3 ? sizeof(int64_t) : sizeof(int);
+    
     int record_num = 1;
     while (!feof(file)) {
         long position = ftell(file);
         
-        // Read key length
-        int kLen;
-        if (fread(&kLen, sizeof(int), 1, file) != 1) {
+        // Read the key length (or batch marker) and value length (or count)
+        char lengths[2 * sizeof(int64_t)];
+        int64_t fields[2];
+        if (fread(lengths, width, 2, file) != 2) {
             if (feof(file)) break;
-            printf("%sError reading key length at position %ld%s\n", COLOR_RED, position, COLOR_RESET);
+            printf("%sError reading record lengths at position %ld%s\n", COLOR_RED, position, COLOR_RESET);
             break;
         }
-        
+        if (width == sizeof(int64_t)) {
+            memcpy(fields, lengths, sizeof(fields));
+        } else {
+            int narrow[2];
+            memcpy(narrow, lengths, sizeof(narrow));
+            fields[0] = narrow[0];
+            fields[1] = narrow[1];
+        }
+
+        // A write batch header is followed by the batch's records
+        if (fields[0] == WAL_BATCH_MARKER) {
+            uint32_t stored;
+            if (checksummed && (fread(&stored, sizeof(uint32_t), 1, file) != 1 ||
+                                stored != crc32c_value(lengths, 2 * width))) {
+                printf("%sChecksum mismatch in batch header at position %ld%s\n", COLOR_RED, position, COLOR_RESET);
+                break;
+            }
+            printf("%sWrite batch of %lld records at position %ld%s\n", COLOR_CYAN,
+                   (long long) fields[1], position, COLOR_RESET);
+            continue;
+        }
+
         // Validate key length
-        if (kLen <= 0 || kLen > 10000) {
-            printf("%sInvalid key length %d at position %ld - possibly corrupted data%s\n", 
-                   COLOR_RED, kLen, position, COLOR_RESET);
+        if (fields[0] <= 0 || fields[0] > 10000) {
+            printf("%sInvalid key length %lld at position %ld - possibly corrupted data%s\n",
+                   COLOR_RED, (long long) fields[0], position, COLOR_RESET);
             break;
         }
-        
-        // Read value length
-        int vLen;
-        if (fread(&vLen, sizeof(int), 1, file) != 1) {
-            printf("%sError reading value length at position %ld%s\n", COLOR_RED, position, COLOR_RESET);
+        int kLen = (int) fields[0];
+        int64_t vLen = fields[1];
+        if (vLen < -1 || vLen > stats.file_size) {
+            printf("%sInvalid value length %lld at position %ld - possibly corrupted data%s\n",
+                   COLOR_RED, (long long) vLen, position, COLOR_RESET);
             break;
         }
         
@@ -152,6 +470,20 @@ FileStats dump_data_file(const char* filepath, const char* file_type) {
         // Print record
         print_record(record_num, kLen, vLen, key, value, position);
         
+        // Replay stops at the first record failing its checksum
+        if (checksummed) {
+            uint32_t stored;
+            uint32_t crc = crc32c_value(lengths, 2 * width);
+            crc = crc32c_extend(crc, key, (size_t) kLen);
+            if (vLen > 0) crc = crc32c_extend(crc, value, (size_t) vLen);
+            if (fread(&stored, sizeof(uint32_t), 1, file) != 1 || stored != crc) {
+                printf("%sChecksum mismatch in record at position %ld%s\n", COLOR_RED, position, COLOR_RESET);
+                free(key);
+                free(value);
+                break;
+            }
+        }
+        
         // Update statistics
         stats.total_records++;
         stats.total_key_bytes += kLen;
@@ -180,7 +512,21 @@ void dump_index_file(const char* filepath) {
     fseek(file, 0, SEEK_SET);
     
     print_file_header(filepath, "INDEX");
-    printf("File Size: %ld bytes\n\n", file_size);
+    printf("File Size: %ld bytes\n", file_size);
+    
+    int version = INDEX_FILE_V1;
+    int header[2];
+    if (fread(header, sizeof(int), 2, file) == 2 && header[0] == INDEX_FILE_MARKER) {
+        version = header[1];
+    } else {
+        fseek(file, 0, SEEK_SET);
+    }
+    printf("Format Version: %d\n\n", version);
+    if (version != INDEX_FILE_V1 && version != INDEX_FILE_V2) {
+        printf("%sUnknown index format version %d%s\n", COLOR_RED, version, COLOR_RESET);
+        fclose(file);
+        return;
+    }
     
     int entry_num = 1;
     while (!feof(file)) {
@@ -199,12 +545,16 @@ void dump_index_file(const char* filepath) {
             break;
         }
         
-        // Read position
-        int position;
-        if (fread(&position, sizeof(int), 1, file) != 1) {
+        // Read position, 32 bits wide in version 1
+        int64_t position = 0;
+        int32_t position32;
+        size_t read = version == INDEX_FILE_V1 ? fread(&position32, sizeof(int32_t), 1, file)
+                                               : fread(&position, sizeof(int64_t), 1, file);
+        if (read != 1) {
             printf("%sError reading position%s\n", COLOR_RED, COLOR_RESET);
             break;
         }
+        if (version == INDEX_FILE_V1) position = position32;
         
         // Read key
         char* key = malloc(kLen + 1);
@@ -272,6 +622,63 @@ void print_statistics(FileStats* stats_array, int num_files, char** filenames) {
     }
 }
 
+// Print every edit of the MANIFEST (layout in kvstore.h)
+void dump_manifest_file(const char* filepath) {
+    FILE* file = fopen(filepath, "rb");
+    if (!file) return;
+    
+    print_file_header(filepath, "MANIFEST");
+    int edit_num = 1;
+    uint32_t size;
+    unsigned char* body = NULL;
+    while (fread(&size, sizeof(uint32_t), 1, file) == 1) {
+        body = realloc(body, size > 0 ? size : 1);
+        if (fread(body, 1, size, file) != size || size < 3 * sizeof(int)) {
+            printf("%sIncomplete edit #%d (ignored on open)%s\n", COLOR_YELLOW, edit_num, COLOR_RESET);
+            break;
+        }
+        
+        const unsigned char* p = body;
+        const unsigned char* limit = body + size;
+        int header[3];
+        memcpy(header, p, sizeof(header));
+        p += sizeof(header);
+        printf("%s[Edit #%d]%s Next File: %d  Deleted: %d  Added: %d\n",
+               COLOR_CYAN, edit_num++, COLOR_RESET, header[0], header[1], header[2]);
+        
+        for (int i = 0; i < header[1] && limit - p >= (long) sizeof(int); i++, p += sizeof(int)) {
+            int file_number;
+            memcpy(&file_number, p, sizeof(int));
+            printf("  %s- %s%d.dat%s\n", COLOR_RED, SSTABLE_PREFIX, file_number, COLOR_RESET);
+        }
+        for (int i = 0; i < header[2]; i++) {
+            int fields[2], lens[2];
+            uint64_t sequence;
+            if (limit - p < (long) (4 * sizeof(int) + sizeof(uint64_t))) break;
+            memcpy(fields, p, sizeof(fields));
+            memcpy(&sequence, p + sizeof(fields), sizeof(uint64_t));
+            memcpy(lens, p + sizeof(fields) + sizeof(uint64_t), sizeof(lens));
+            p += 4 * sizeof(int) + sizeof(uint64_t);
+            if (lens[0] < 0 || lens[1] < 0 || limit - p < (long) lens[0] + lens[1]) break;
+            printf("  %s+ %s%d.dat%s  Level: %d  Sequence: %llu  Range: \"%s%.*s%s\" .. \"%s%.*s%s\"\n",
+                   COLOR_GREEN, SSTABLE_PREFIX, fields[0], COLOR_RESET, fields[1], (unsigned long long) sequence,
+                   COLOR_YELLOW, lens[0], (const char*) p, COLOR_RESET,
+                   COLOR_YELLOW, lens[1], (const char*) p + lens[0], COLOR_RESET);
+            p += lens[0] + lens[1];
+        }
+        if (limit - p >= (long) (2 * sizeof(int64_t))) {
+            int64_t replayed[2];
+            memcpy(replayed, p, sizeof(replayed));
+            if (replayed[0] || replayed[1]) {
+                printf("  Replayed: heap.imm to %lld, heap.dat to %lld\n",
+                       (long long) replayed[0], (long long) replayed[1]);
+            }
+        }
+    }
+    free(body);
+    fclose(file);
+}
+
 int main(int argc, char* argv[]) {
     if (argc != 2) {
         printf("Usage: %s <data_directory>\n", argv[0]);
@@ -316,6 +723,10 @@ int main(int argc, char* argv[]) {
         printf("%sNo current heap file found%s\n", COLOR_YELLOW, COLOR_RESET);
     }
     
+    char manifest_path[512];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", data_directory, MANIFEST_FILE_NAME);
+    dump_manifest_file(manifest_path);
+    
     // Then, find and dump all SSTable files
     DIR* dir = opendir(data_directory);
     if (!dir) {
@@ -326,6 +737,8 @@ int main(int argc, char* argv[]) {
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
         if (strncmp(entry->d_name, SSTABLE_PREFIX, strlen(SSTABLE_PREFIX)) == 0 &&
+            strncmp(entry->d_name, SSTABLE_INDEX_PREFIX, strlen(SSTABLE_INDEX_PREFIX)) != 0 &&
+            strncmp(entry->d_name, SSTABLE_BLOOM_PREFIX, strlen(SSTABLE_BLOOM_PREFIX)) != 0 &&
             strstr(entry->d_name, ".dat") != NULL) {
             
             char sstable_path[512];
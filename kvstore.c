@@ -1,266 +1,689 @@
 #include "kvstore.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <limits.h>
 #include "utils.h"
+#include "arena.h"
+#include "crc32c.h"
 #include "data_record.h"
+#include "memtable.h"
+#include "bloom.h"
+#include "block.h"
+#include "compression.h"
+#include "block_cache.h"
 #include "sstable.h"
+#include "manifest.h"
+#include "merge_iter.h"
+#include "version.h"
+#include "compaction.h"
+#include "multi_get.h"
+#include "wal.h"
+#include "shard.h"
 
 // Global KVStore instance
 KVStore* kvstore = NULL;
 
-// Get current heap file size
-long get_heap_size() {
-    if (!kvstore->heap_file) return 0;
+// Swap the active memtable and its log out as the immutable memtable:
+// heap.dat becomes heap.imm and writers continue in a fresh heap.dat.
+// Called with store_mutex held and no group commit in flight.
+int rotate_memtable(KVStore* kvstore) {
+    char heap_path[256];
+    char imm_path[256];
+    char index_path[256];
+    sprintf(heap_path, "%s/%s", kvstore->data_directory, HEAP_FILE_NAME);
+    sprintf(imm_path, "%s/%s", kvstore->data_directory, IMM_HEAP_FILE_NAME);
+    sprintf(index_path, "%s/%s", kvstore->data_directory, INDEX_FILE_NAME);
     
-    long current_pos = ftell(kvstore->heap_file);
-    fseek(kvstore->heap_file, 0, SEEK_END);
-    long size = ftell(kvstore->heap_file);
-    fseek(kvstore->heap_file, current_pos, SEEK_SET);
-    return size;
-}
-
-// Comparison function that considers both key and original order
-int compare_records_stable(const void* a, const void* b) {
-    DataRecord* record_a = *(DataRecord**)a;
-    DataRecord* record_b = *(DataRecord**)b;
+    // Replay offsets logged for the old logs must not carry over to new
+    // ones: heap.dat's moves to heap.imm with the file, and the fresh
+    // heap.dat starts at 0. Log that before the rename can happen.
+    if (kvstore->imm_replayed != 0 || kvstore->heap_replayed != 0) {
+        long imm_replayed = kvstore->imm_replayed;
+        kvstore->imm_replayed = kvstore->heap_replayed;
+        kvstore->heap_replayed = 0;
+        if (manifest_log_edit(kvstore, NULL, 0, NULL, 0) != 0) {
+            kvstore->heap_replayed = kvstore->imm_replayed;
+            kvstore->imm_replayed = imm_replayed;
+            return -1;
+        }
+    }
     
-    int key_cmp = strcmp(record_a->key, record_b->key);
-    if (key_cmp != 0) {
-        return key_cmp;  // Different keys, sort by key
+    fclose(kvstore->heap_file);
+    fclose(kvstore->index_file);
+    int status = rename(heap_path, imm_path);
+    if (status != 0) {
+        perror("rename heap file");
     }
     
-    // Same key: sort by original order (newer records should come later)
-    // We'll use the original_index field to maintain chronological order
-    return record_a->original_index - record_b->original_index;
-}
-
-// Compaction worker thread
-void* compaction_worker(void* arg) {
-    pthread_mutex_lock(&kvstore->store_mutex);
+    // A failed rename leaves the log in place, so append to it as before
+    kvstore->heap_file = fopen(heap_path, "a+b");
+    kvstore->index_file = fopen(index_path, "a+b");
+    if (status != 0) return -1;
     
-    // Close current files
+    // The new log is always written in the current format
     if (kvstore->heap_file) {
-        fclose(kvstore->heap_file);
-        kvstore->heap_file = NULL;
+        write_heap_header(kvstore->heap_file);
     }
+    
+    // index.dat only ever describes the active log
     if (kvstore->index_file) {
-        fclose(kvstore->index_file);
-        kvstore->index_file = NULL;
+        if (ftruncate(fileno(kvstore->index_file), 0) != 0) {
+            perror("ftruncate index file");
+        }
+        write_index_header(kvstore->index_file);
     }
     
-    // Create SSTable filename with timestamp
-    static int sstable_counter = 0;
-    char sstable_filename[256];
-    char sstable_index_filename[256];
+    kvstore->imm = kvstore->memtable;
+    kvstore->imm_size = kvstore->heap_size;
+    kvstore->memtable = memtable_create();
+    kvstore->heap_size = HEAP_FILE_HEADER_SIZE;
+    kvstore->heap_version = HEAP_FILE_VERSION;
+    kvstore->wal_dirty = 0;
+    version_install(kvstore);
+    return 0;
+}
+
+// Release the flush claimed by kv_compact() and wake writers stalled on
+// it. Called with the store mutex held.
+void finish_flush(KVStore* kvstore) {
+    kvstore->imm_flushing = 0;
+    __atomic_store_n(&kvstore->compaction_status, COMPACTION_COMPLETED, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&kvstore->writer_cond);
+}
+
+// Compaction worker thread. The memtable is swapped out under the mutex,
+// then written to an L0 table without it: writers go on filling the new
+// memtable and get() still finds the old one in kvstore->imm until the
+// table is installed. The flush is released as soon as it is logged, so
+// writers and the next flush do not wait for the merges that follow.
+void* compaction_worker(void* arg) {
+    KVStore* kvstore = arg;
+    pthread_mutex_lock(&kvstore->store_mutex);
     
-    sprintf(sstable_filename, "%s/%s%d.dat", kvstore->data_directory, SSTABLE_PREFIX, sstable_counter);
-    sprintf(sstable_index_filename, "%s/%s%d.dat", kvstore->data_directory, SSTABLE_INDEX_PREFIX, sstable_counter);
-    sstable_counter++;
+    // Only one flush may own imm; it also releases it. Give back the
+    // status this trigger claimed, or kv_close() would wait for it forever.
+    if (kvstore->imm_flushing) {
+        __atomic_store_n(&kvstore->compaction_status, COMPACTION_COMPLETED, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&kvstore->writer_cond);
+        pthread_mutex_unlock(&kvstore->store_mutex);
+        return NULL;
+    }
     
-    // Read all records from heap file
-    char heap_path[256];
-    sprintf(heap_path, "%s/%s", kvstore->data_directory, HEAP_FILE_NAME);
+    // A previous flush that failed leaves its memtable to retry first;
+    // otherwise let an in-flight group commit land and swap the log out
+    if (!kvstore->imm) {
+        wal_wait_idle(kvstore);
+        if (!kvstore->heap_file || !kvstore->index_file || rotate_memtable(kvstore) != 0) {
+            finish_flush(kvstore);
+            pthread_mutex_unlock(&kvstore->store_mutex);
+            return NULL;
+        }
+    }
+    Memtable* imm = kvstore->imm;
+    kvstore->imm_flushing = 1;
     
-    FILE* old_heap = fopen(heap_path, "rb");
-    DataRecord** records = NULL;
-    int record_count = 0;
-    int capacity = 100;
+    CompactionOutput output;
+    int opened = imm->count > 0 && compaction_output_open(kvstore, &output, 0) == 0;
+    pthread_mutex_unlock(&kvstore->store_mutex);
     
-    if (old_heap) {
-        records = malloc(capacity * sizeof(DataRecord*));
-        
-        int original_index = 0;  // Track original order
-        while (!feof(old_heap)) {
-            long pos = ftell(old_heap);
-            DataRecord* record = read_record_from_file(old_heap, pos);
-            if (!record) break;
-            
-            // Store original order to maintain chronological sequence
-            record->original_index = original_index++;
-            
-            if (record_count >= capacity) {
-                capacity *= 2;
-                records = realloc(records, capacity * sizeof(DataRecord*));
-            }
-            
-            records[record_count++] = record;
+    SSTable* new_sstable = opened ? compaction_output_write_memtable(kvstore, &output, imm) : NULL;
+    
+    pthread_mutex_lock(&kvstore->store_mutex);
+    if (new_sstable) {
+        // If replay left part of heap.imm in runs, mark all of it written
+        // so a crash before the unlink below does not replay it again
+        long imm_replayed = kvstore->imm_replayed;
+        if (imm_replayed > 0) kvstore->imm_replayed = kvstore->imm_size;
+        if (manifest_log_edit(kvstore, &new_sstable, 1, NULL, 0) != 0) {
+            kvstore->imm_replayed = imm_replayed;
+            delete_sstable(new_sstable);
+            new_sstable = NULL;
         }
-        fclose(old_heap);
-        
-        // Sort records by key, maintaining chronological order for same keys
-        qsort(records, record_count, sizeof(DataRecord*), compare_records_stable);
-        
-        // Write sorted SSTable and index
-        FILE* sstable_file = fopen(sstable_filename, "wb");
-        FILE* sstable_index_file = fopen(sstable_index_filename, "wb");
-        
-        // Declare unique_count in proper scope
-        int unique_count = 0;
-        
-        if (sstable_file && sstable_index_file) {
-            // Remove duplicates, keeping the latest entry (highest original_index)
-            // Since records are sorted by key, we can process linearly
-            DataRecord** unique_records = malloc(record_count * sizeof(DataRecord*));
-            
-            for (int i = 0; i < record_count; i++) {
-                // Check if next record has different key (or if we're at the end)
-                int is_last_of_key = (i == record_count - 1) || 
-                                     (strcmp(records[i]->key, records[i + 1]->key) != 0);
-                
-                if (is_last_of_key) {
-                    unique_records[unique_count++] = records[i];
-                }
-            }
-            
-            // Write unique records to SSTable
-            for (int i = 0; i < unique_count; i++) {
-                long pos = ftell(sstable_file);
-                unique_records[i]->position = pos;
-                write_record_to_file(sstable_file, unique_records[i]);
-                write_index_entry_to_file(sstable_index_file, unique_records[i]);
-            }
-            
-            free(unique_records);
+    }
+    if (new_sstable || imm->count == 0) {
+        if (new_sstable) {
+            add_sstable_to_level(kvstore, new_sstable);
+            kvstore->stats.flushes++;
+            kvstore->stats.flush_bytes_written += (long) new_sstable->data_size;
         }
         
-        if (sstable_file) fclose(sstable_file);
-        if (sstable_index_file) fclose(sstable_index_file);
-        
-        // Add new SSTable to list
-        SSTable* new_sstable = malloc(sizeof(SSTable));
-        new_sstable->filename = strdup(sstable_filename);
-        new_sstable->index_filename = strdup(sstable_index_filename);
-        new_sstable->record_count = unique_count;  // Use unique_count for accurate count
-        new_sstable->next = kvstore->sstables;
-        kvstore->sstables = new_sstable;
+        // Everything in the old memtable now lives in the new SSTable
+        char imm_path[256];
+        sprintf(imm_path, "%s/%s", kvstore->data_directory, IMM_HEAP_FILE_NAME);
+        unlink(imm_path);
+        kvstore->imm = NULL;
+        memtable_unref(imm);
+        version_install(kvstore);
+        finish_flush(kvstore);
         
-        // Cleanup
-        for (int i = 0; i < record_count; i++) {
-            free_record(records[i]);
+        // Merge tables according to the store's compaction policy; each
+        // merge drops the mutex while it runs and publishes its result.
+        // A worker already merging re-picks under the mutex after every
+        // merge, so it also covers the table just added.
+        if (!kvstore->merging) {
+            __atomic_store_n(&kvstore->merging, 1, __ATOMIC_RELEASE);
+            run_compactions(kvstore);
+            __atomic_store_n(&kvstore->merging, 0, __ATOMIC_RELEASE);
         }
-        free(records);
+    } else {
+        fprintf(stderr, "Failed to flush memtable, keeping %s for the next attempt\n", IMM_HEAP_FILE_NAME);
+        finish_flush(kvstore);
     }
-    
-    // Create new heap and index files
-    sprintf(heap_path, "%s/%s", kvstore->data_directory, HEAP_FILE_NAME);
-    char index_path[256];
-    sprintf(index_path, "%s/%s", kvstore->data_directory, INDEX_FILE_NAME);
-    
-    // Truncate the heap file and index file
-    kvstore->heap_file = fopen(heap_path, "wb");
-    kvstore->index_file = fopen(index_path, "wb");
-    fclose(kvstore->heap_file);
-    fclose(kvstore->index_file);
-    kvstore->heap_size = 0;
-
-    // Reopen in append mode for future writes
-    kvstore->heap_file = fopen(heap_path, "a+b");
-    kvstore->index_file = fopen(index_path, "a+b");
-    
-    kvstore->compaction_status = COMPACTION_COMPLETED;
     pthread_mutex_unlock(&kvstore->store_mutex);
     
     return NULL;
 }
 
-// Initialize the KVStore
-void init(char* data_directory) {
-    kvstore = malloc(sizeof(KVStore));
+// Default tunables used by kv_open()
+KVStoreOptions default_options() {
+    KVStoreOptions options;
+    options.compaction_threshold = DEFAULT_COMPACTION_THRESHOLD;
+    options.bloom_bits_per_key = DEFAULT_BLOOM_BITS_PER_KEY;
+    options.block_size = DEFAULT_BLOCK_SIZE;
+    options.use_mmap = 1;
+    options.compression = COMPRESSION_NONE;
+    options.verify_checksums = 1;
+    options.block_cache_size = DEFAULT_BLOCK_CACHE_SIZE;
+    options.level0_file_trigger = DEFAULT_LEVEL0_FILE_TRIGGER;
+    options.level1_max_bytes = DEFAULT_LEVEL1_MAX_BYTES;
+    options.level_size_multiplier = DEFAULT_LEVEL_SIZE_MULTIPLIER;
+    options.target_file_size = DEFAULT_TARGET_FILE_SIZE;
+    options.max_subcompactions = DEFAULT_MAX_SUBCOMPACTIONS;
+    options.compaction_style = COMPACTION_STYLE_LEVELED;
+    options.tiered_min_merge_width = DEFAULT_TIERED_MIN_MERGE_WIDTH;
+    options.tiered_max_merge_width = DEFAULT_TIERED_MAX_MERGE_WIDTH;
+    options.wal_sync_mode = WAL_SYNC_NONE;
+    options.wal_sync_interval_ms = DEFAULT_WAL_SYNC_INTERVAL_MS;
+    return options;
+}
+
+// Write a memtable replayed at open out as an L0 table and log it in the
+// MANIFEST together with offset, the point of its log (*replayed is that
+// log's field) up to which replay never has to return. Returns -1 if that
+// failed, leaving the memtable and *replayed as they were.
+int flush_replayed_memtable(KVStore* kvstore, Memtable* memtable, long* replayed, long offset) {
+    if (memtable->count == 0) return 0;
+    
+    CompactionOutput output;
+    if (compaction_output_open(kvstore, &output, 0) != 0) return -1;
+    SSTable* sstable = compaction_output_write_memtable(kvstore, &output, memtable);
+    if (!sstable) return -1;
+    long previous = *replayed;
+    *replayed = offset;
+    if (manifest_log_edit(kvstore, &sstable, 1, NULL, 0) != 0) {
+        *replayed = previous;
+        delete_sstable(sstable);
+        return -1;
+    }
+    add_sstable_to_level(kvstore, sstable);
+    kvstore->stats.flushes++;
+    kvstore->stats.flush_bytes_written += (long) sstable->data_size;
+    kvstore->stats.replay_runs++;
+    return 0;
+}
+
+// Replay a log into *memtable with bounded memory. Every time the
+// memtable holds compaction_threshold bytes, the size at which the write
+// path rotates it too, it is written out as a sorted run in L0 and replay
+// continues into a fresh one; compaction then merges the runs like any
+// other L0 tables. A log larger than memory, say one written with a bigger
+// threshold, thus never has to fit in memory at once.
+//
+// Replay starts at *replayed, the log's offset from the MANIFEST, and
+// each run is logged with the offset it reached, so a crash part way
+// through resumes after the last run. Returns the offset replay reached
+// (see memtable_load_from_heap) and adds the runs written to *runs; if
+// one cannot be written, the rest of the log stays in memory and *failed
+// is set.
+long replay_log(KVStore* kvstore, Memtable** memtable, FILE* file, FILE* index_file, long* replayed,
+                int* runs, int* failed) {
+    long limit = kvstore->compaction_threshold;
+    long end = *replayed;
+    while (1) {
+        int full;
+        end = memtable_load_from_heap(*memtable, file, end, index_file, &kvstore->last_sequence,
+                                      *failed ? 0 : limit, &full);
+        if (!full) return end;
+        
+        // Reads check the immutable memtable before L0, so the older log
+        // it came from has to reach L0 ahead of this one's runs
+        if (kvstore->imm && kvstore->imm != *memtable) {
+            if (flush_replayed_memtable(kvstore, kvstore->imm, &kvstore->imm_replayed, kvstore->imm_size) != 0) {
+                *failed = 1;
+                continue;
+            }
+            char imm_path[256];
+            sprintf(imm_path, "%s/%s", kvstore->data_directory, IMM_HEAP_FILE_NAME);
+            unlink(imm_path);
+            memtable_unref(kvstore->imm);
+            kvstore->imm = NULL;
+        }
+        if (flush_replayed_memtable(kvstore, *memtable, replayed, end) != 0) {
+            *failed = 1;
+            continue;
+        }
+        memtable_unref(*memtable);
+        *memtable = memtable_create();
+        (*runs)++;
+    }
+}
+
+// Open the store in data_directory, creating it if needed, with explicit
+// tunables (NULL for defaults). Stores opened on different directories are
+// independent; close each with kv_close().
+KVStore* kv_open(const char* data_directory, KVStoreOptions* options) {
+    KVStoreOptions defaults = default_options();
+    if (!options) options = &defaults;
+    
+    KVStore* kvstore = malloc(sizeof(KVStore));
     kvstore->data_directory = strdup(data_directory);
     kvstore->heap_file = NULL;
     kvstore->index_file = NULL;
-    kvstore->sstables = NULL;
+    kvstore->manifest_fd = -1;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        kvstore->levels[level] = NULL;
+        kvstore->compact_pointer[level] = NULL;
+        kvstore->compact_pointer_kLen[level] = 0;
+    }
+    kvstore->next_file_number = 0;
+    kvstore->memtable = memtable_create();
+    kvstore->imm = NULL;
+    kvstore->last_sequence = 0;
+    kvstore->current = NULL;
+    kvstore->version_epoch = 0;
+    kvstore->version_readers[0] = 0;
+    kvstore->version_readers[1] = 0;
     kvstore->heap_size = 0;
-    kvstore->compaction_threshold = DEFAULT_COMPACTION_THRESHOLD;
+    kvstore->imm_size = 0;
+    kvstore->heap_replayed = 0;
+    kvstore->imm_replayed = 0;
+    kvstore->heap_version = HEAP_FILE_VERSION;
+    kvstore->compaction_threshold = options->compaction_threshold;
+    kvstore->bloom_bits_per_key = options->bloom_bits_per_key;
+    kvstore->block_size = options->block_size;
+    kvstore->use_mmap = options->use_mmap;
+    kvstore->compression = block_codec_find(options->compression) ? options->compression : COMPRESSION_NONE;
+    kvstore->verify_checksums = options->verify_checksums;
+    kvstore->block_cache = options->block_cache_size > 0 ? block_cache_create(options->block_cache_size) : NULL;
+    kvstore->level0_file_trigger = options->level0_file_trigger > 0 ? options->level0_file_trigger : 1;
+    kvstore->level1_max_bytes = options->level1_max_bytes > 0 ? options->level1_max_bytes : DEFAULT_LEVEL1_MAX_BYTES;
+    kvstore->level_size_multiplier = options->level_size_multiplier > 1 ? options->level_size_multiplier : DEFAULT_LEVEL_SIZE_MULTIPLIER;
+    kvstore->target_file_size = options->target_file_size > 0 ? options->target_file_size : DEFAULT_TARGET_FILE_SIZE;
+    kvstore->max_subcompactions = options->max_subcompactions > 0 ? options->max_subcompactions : 1;
+    kvstore->compaction_style = options->compaction_style;
+    kvstore->tiered_min_merge_width = options->tiered_min_merge_width > 1 ? options->tiered_min_merge_width : 2;
+    kvstore->tiered_max_merge_width = options->tiered_max_merge_width >= kvstore->tiered_min_merge_width ?
+                                      options->tiered_max_merge_width : kvstore->tiered_min_merge_width;
+    kvstore->writers_head = NULL;
+    kvstore->writers_tail = NULL;
+    kvstore->wal_busy = 0;
+    kvstore->wal_dirty = 0;
+    kvstore->wal_sync_mode = options->wal_sync_mode;
+    kvstore->wal_sync_interval_ms = options->wal_sync_interval_ms > 0 ? options->wal_sync_interval_ms : DEFAULT_WAL_SYNC_INTERVAL_MS;
+    memset(&kvstore->stats, 0, sizeof(KVStoreStats));
     kvstore->compaction_status = COMPACTION_COMPLETED;
+    kvstore->imm_flushing = 0;
+    kvstore->merging = 0;
     
     pthread_mutex_init(&kvstore->store_mutex, NULL);
+    pthread_cond_init(&kvstore->writer_cond, NULL);
+    pthread_cond_init(&kvstore->wal_sync_cond, NULL);
     
     // Create directory if it doesn't exist
     mkdir(data_directory, 0755);
     
-    // Load existing SSTables
-    load_sstables(kvstore);
+    // Load existing SSTables from the MANIFEST, or from the directory of a
+    // store written before it kept one, then start a fresh MANIFEST
+    if (manifest_recover(kvstore) != 0) {
+        load_sstables(kvstore);
+    }
+    if (manifest_write_snapshot(kvstore) != 0) {
+        perror("write manifest");
+    }
     
     // Open or create heap and index files
     char heap_path[256];
+    char imm_path[256];
     char index_path[256];
     sprintf(heap_path, "%s/%s", data_directory, HEAP_FILE_NAME);
+    sprintf(imm_path, "%s/%s", data_directory, IMM_HEAP_FILE_NAME);
     sprintf(index_path, "%s/%s", data_directory, INDEX_FILE_NAME);
     
+    // A flush interrupted by a crash left its log behind; replay it as the
+    // immutable memtable and flush it again below
+    int runs = 0;
+    int failed = 0;
+    FILE* imm_file = fopen(imm_path, "rb");
+    if (imm_file) {
+        kvstore->imm = memtable_create();
+        kvstore->imm_size = replay_log(kvstore, &kvstore->imm, imm_file, NULL, &kvstore->imm_replayed,
+                                       &runs, &failed);
+        fclose(imm_file);
+    }
+    
     kvstore->heap_file = fopen(heap_path, "a+b");
     kvstore->index_file = fopen(index_path, "a+b");
     
+    // index.dat is rebuilt from the log, which also moves an index written
+    // in an older format to the current one
+    FILE* index_file = kvstore->index_file;
+    if (index_file) {
+        if (ftruncate(fileno(index_file), 0) != 0) {
+            perror("ftruncate index file");
+        }
+        write_index_header(index_file);
+    }
+    
     if (kvstore->heap_file) {
-        kvstore->heap_size = get_heap_size();
+        // Drop a record torn by a crash (or failing its checksum) so new
+        // writes follow the last good one
+        int imm_runs = runs;
+        kvstore->heap_size = replay_log(kvstore, &kvstore->memtable, kvstore->heap_file,
+                                        index_file, &kvstore->heap_replayed, &runs, &failed);
+        long file_size = ftell(kvstore->heap_file);
+        if (file_size > kvstore->heap_size) {
+            fprintf(stderr, "Dropping %ld bytes of torn or damaged log at offset %ld of %s\n",
+                    file_size - kvstore->heap_size, kvstore->heap_size, heap_path);
+        }
+        
+        // Once part of the log went to L0, the rest follows so the log can
+        // start over empty instead of being replayed into L0 again. Its
+        // offset is reset in the MANIFEST before the log is truncated; if
+        // that fails the log is kept and replay resumes at its end.
+        if (runs > imm_runs && !failed &&
+            flush_replayed_memtable(kvstore, kvstore->memtable, &kvstore->heap_replayed, kvstore->heap_size) == 0) {
+            memtable_unref(kvstore->memtable);
+            kvstore->memtable = memtable_create();
+            kvstore->heap_replayed = 0;
+            if (manifest_log_edit(kvstore, NULL, 0, NULL, 0) == 0) {
+                kvstore->heap_size = 0;
+            } else {
+                kvstore->heap_replayed = kvstore->heap_size;
+            }
+        }
+        if (kvstore->heap_size == 0) {
+            if (index_file) {
+                if (ftruncate(fileno(index_file), 0) != 0) {
+                    perror("ftruncate index file");
+                }
+                write_index_header(index_file);
+            }
+        }
+        if (ftruncate(fileno(kvstore->heap_file), kvstore->heap_size) != 0) {
+            perror("ftruncate heap file");
+        }
+        
+        // A log written before checksums keeps its format until it is
+        // rotated out; an empty one starts over in the current format
+        kvstore->heap_version = heap_file_seek_to_first(kvstore->heap_file);
+        if (kvstore->heap_size == 0) {
+            write_heap_header(kvstore->heap_file);
+            kvstore->heap_size = HEAP_FILE_HEADER_SIZE;
+            kvstore->heap_version = HEAP_FILE_VERSION;
+        }
+    }
+    
+    version_install(kvstore);
+    wal_start_sync_thread(kvstore);
+    
+    // Flush what is left of an interrupted flush, and merge any runs
+    // replay wrote
+    if (kvstore->imm || runs > 0) {
+        kv_compact(kvstore);
     }
+    return kvstore;
 }
 
 // Write a key-value pair
-void put(char* key, char* value) {
-    if (!kvstore || !kvstore->heap_file || !kvstore->index_file) return;
-    
-    pthread_mutex_lock(&kvstore->store_mutex);
+int kv_put(KVStore* kvstore, char* key, char* value) {
+    return kv_put_with_options(kvstore, key, value, NULL);
+}
+
+// Write a key-value pair, optionally syncing the log before returning
+int kv_put_with_options(KVStore* kvstore, char* key, char* value, WriteOptions* options) {
+    return kv_put_n(kvstore, key, strlen(key), value, value ? strlen(value) : 0, options);
+}
+
+// Write a key-value pair of kLen and vLen bytes. A NULL value deletes key.
+// Returns 0 once the write is logged and visible, or -1 if the log write
+// failed, the store has no log, the key is longer than INT_MAX bytes,
+// the value does not fit the log's length fields or the memtable ran out
+// of memory (the write is then logged but only visible after replay).
+int kv_put_n(KVStore* kvstore, char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options) {
+    if (!kvstore || kLen > INT_MAX || (value && vLen > INT64_MAX)) return -1;
     
-    long position = ftell(kvstore->heap_file);
-    DataRecord* record = create_record(key, value, position);
+    WriteOp op = {key, (int) kLen, value, value ? (int64_t) vLen : -1};
+    WALWriter writer;
+    writer.ops = &op;
+    writer.count = 1;
+    writer.sync = options ? options->sync : 0;
+    writer.status = -1;
     
-    write_record_to_file(kvstore->heap_file, record);
-    write_index_entry_to_file(kvstore->index_file, record);
+    // The files are only swapped under the mutex, so check them there
+    pthread_mutex_lock(&kvstore->store_mutex);
+    if (kvstore->heap_file && kvstore->index_file) {
+        wal_commit(kvstore, &writer);
+    }
+    pthread_mutex_unlock(&kvstore->store_mutex);
+    return writer.status;
+}
+
+// Apply every put and delete of a batch atomically
+int kv_write_batch(KVStore* kvstore, WriteBatch* batch, WriteOptions* options) {
+    if (!kvstore || !batch) return -1;
+    if (batch->count == 0) return 0;
     
-    kvstore->heap_size = get_heap_size();
+    WALWriter writer;
+    writer.ops = batch->ops;
+    writer.count = batch->count;
+    writer.sync = options ? options->sync : 0;
+    writer.status = -1;
     
-    // Check if compaction is needed
-    if (kvstore->heap_size > kvstore->compaction_threshold && 
-        kvstore->compaction_status == COMPACTION_COMPLETED) {
-        compact();
+    pthread_mutex_lock(&kvstore->store_mutex);
+    if (kvstore->heap_file && kvstore->index_file) {
+        wal_commit(kvstore, &writer);
     }
-    
-    free_record(record);
     pthread_mutex_unlock(&kvstore->store_mutex);
+    return writer.status;
 }
 
-// Get value for a key
-char* get(char* key) {
-    if (!kvstore) return NULL;
+WriteBatch* write_batch_create() {
+    return calloc(1, sizeof(WriteBatch));
+}
+
+int write_batch_add(WriteBatch* batch, char* key, size_t kLen, char* value, size_t vLen) {
+    if (kLen > INT_MAX || (value && vLen > INT64_MAX)) return -1;
+    if (batch->count == batch->cap) {
+        batch->cap = batch->cap ? batch->cap * 2 : 8;
+        batch->ops = realloc(batch->ops, batch->cap * sizeof(WriteOp));
+    }
+    WriteOp* op = &batch->ops[batch->count++];
+    op->key = copy_bytes(key, kLen);
+    op->kLen = (int) kLen;
+    op->value = value ? copy_bytes(value, vLen) : NULL;
+    op->vLen = value ? (int64_t) vLen : -1;
+    return 0;
+}
+
+// Queue a put; later operations on the same key win
+void write_batch_put(WriteBatch* batch, char* key, char* value) {
+    write_batch_add(batch, key, strlen(key), value, value ? strlen(value) : 0);
+}
+
+void write_batch_delete(WriteBatch* batch, char* key) {
+    write_batch_add(batch, key, strlen(key), NULL, 0);
+}
+
+int write_batch_put_n(WriteBatch* batch, char* key, size_t kLen, char* value, size_t vLen) {
+    return write_batch_add(batch, key, kLen, value, vLen);
+}
+
+int write_batch_delete_n(WriteBatch* batch, char* key, size_t kLen) {
+    return write_batch_add(batch, key, kLen, NULL, 0);
+}
+
+int write_batch_count(WriteBatch* batch) {
+    return batch ? batch->count : 0;
+}
+
+void write_batch_clear(WriteBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        free(batch->ops[i].key);
+        free(batch->ops[i].value);
+    }
+    batch->count = 0;
+}
+
+void write_batch_free(WriteBatch* batch) {
+    if (!batch) return;
+    write_batch_clear(batch);
+    free(batch->ops);
+    free(batch);
+}
+
+// Get value for a key without copying it. Reads the current version and
+// never takes the store mutex, so readers run in parallel with each
+// other, writers and flushes. Returns 1 with slice pinning the version
+// (and the value's block) until kv_pinned_release(), 0 with nothing
+// pinned if the key is missing or deleted, or -1 with nothing pinned if
+// a table that may hold the key could not be read. The lookup stops
+// there: an older table could only return a stale or deleted value.
+int kv_get_pinned(KVStore* kvstore, char* key, PinnedSlice* slice) {
+    return kv_get_pinned_n(kvstore, key, strlen(key), slice);
+}
+
+int kv_get_pinned_n(KVStore* kvstore, char* key, size_t kLen, PinnedSlice* slice) {
+    memset(slice, 0, sizeof(PinnedSlice));
+    // No key that long can have been written
+    if (!kvstore || kLen > INT_MAX) return 0;
     
-    pthread_mutex_lock(&kvstore->store_mutex);
+    Version* version = version_acquire(kvstore);
+    uint64_t sequence = __atomic_load_n(&kvstore->last_sequence, __ATOMIC_ACQUIRE);
     
-    // First check heap file (most recent)
-    if (kvstore->index_file) {
-        int position = find_key_in_index(kvstore->index_file, key);
-        if (position != -1) {
-            DataRecord* record = read_record_from_file(kvstore->heap_file, position);
-            if (record) {
-                char* result = NULL;
-                if (record->vLen >= 0) {
-                    result = strdup(record->value ? record->value : "");
+    // First check the memtable (mirrors the heap file, most recent), then
+    // the memtable being flushed. Arena memory lives as long as the
+    // version holds the memtable.
+    MemtableNode* node = memtable_get(version->memtable, key, kLen, sequence);
+    if (!node && version->imm) {
+        node = memtable_get(version->imm, key, kLen, sequence);
+    }
+    if (node) {
+        if (node->vLen < 0) {
+            version_unref(version);
+            return 0;
+        }
+        slice->data = node->value ? node->value : "";
+        slice->size = (size_t) node->vLen;
+        slice->version = version;
+        return 1;
+    }
+    
+    // Then check SSTables, newest level first. L0 tables may overlap and
+    // are searched newest first; deeper levels hold at most one table
+    // whose range covers the key, found by binary search.
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        int first = 0, end = version->num_files[level];
+        if (level > 0) {
+            first = version_find_file(version, level, key, (int) kLen);
+            if (first < end) end = first + 1;
+        }
+        for (int i = first; i < end; i++) {
+            SSTable* current = version->files[level][i];
+            if (!sstable_contains_key(current, key, kLen)) continue;
+            if (sstable_may_contain(kvstore, current, key, kLen)) {
+                const char* value;
+                int64_t vLen;
+                int found = sstable_find_value(current, key, (int) kLen, &slice->contents, &value, &vLen);
+                if (found < 0) {
+                    version_unref(version);
+                    return -1;
+                }
+                if (found) {
+                    if (!value) {
+                        sstable_release_block(current, &slice->contents);
+                        version_unref(version);
+                        return 0;
+                    }
+                    slice->data = value;
+                    slice->size = (size_t) vLen;
+                    slice->version = version;
+                    slice->sstable = current;
+                    return 1;
+                }
+                if (current->bloom) {
+                    __atomic_add_fetch(&kvstore->stats.bloom_false_positives, 1, __ATOMIC_RELAXED);
                 }
-                free_record(record);
-                pthread_mutex_unlock(&kvstore->store_mutex);
-                return result;
             }
         }
     }
     
-    // Then check SSTables (older data)
-    SSTable* current = kvstore->sstables;
-    while (current) {
-        char* result = search_sstable(current->filename, current->index_filename, key);
-        if (result) {
-            pthread_mutex_unlock(&kvstore->store_mutex);
-            return result;
-        }
-        current = current->next;
+    version_unref(version);
+    return 0;
+}
+
+// Unpin a slice filled by kv_get_pinned(). Safe on a slice it left empty.
+void kv_pinned_release(PinnedSlice* slice) {
+    if (!slice->version) return;
+    if (slice->sstable) {
+        sstable_release_block(slice->sstable, &slice->contents);
     }
+    version_unref(slice->version);
+    memset(slice, 0, sizeof(PinnedSlice));
+}
+
+// Get the latest value for key as a string the caller frees, NULL if the
+// key is missing or deleted
+char* kv_get(KVStore* kvstore, char* key) {
+    return kv_get_n(kvstore, key, strlen(key), NULL);
+}
+
+// Same for a kLen-byte key, storing the value's length in *vLen if vLen
+// is not NULL. Also NULL if the key could not be read; kv_get_pinned_n()
+// tells that apart.
+char* kv_get_n(KVStore* kvstore, char* key, size_t kLen, size_t* vLen) {
+    PinnedSlice slice;
+    if (kv_get_pinned_n(kvstore, key, kLen, &slice) != 1) return NULL;
     
-    pthread_mutex_unlock(&kvstore->store_mutex);
-    return NULL;
+    char* result = copy_bytes(slice.data, slice.size);
+    if (vLen) *vLen = slice.size;
+    kv_pinned_release(&slice);
+    return result;
+}
+
+// Print len bytes for the debug trace, escaping any that are not
+// printable so binary keys and values show in full
+void debug_print_bytes(const char* label, const char* data, size_t len) {
+    printf("[DEBUG]   - %s: ", label);
+    if (!data) {
+        printf("(null)\n");
+        return;
+    }
+    putchar('\'');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) data[i];
+        if (c >= 32 && c < 127 && c != '\\') {
+            putchar(c);
+        } else {
+            printf("\\x%02x", c);
+        }
+    }
+    printf("'\n");
 }
 
 // Get value for a key with comprehensive debugging
-char* debug_get(char* key) {
-    printf("[DEBUG] get() called with key: '%s'\n", key ? key : "(null)");
+char* kv_debug_get(KVStore* kvstore, char* key) {
+    return kv_debug_get_n(kvstore, key, strlen(key), NULL);
+}
+
+// Same for a kLen-byte key, storing the value's length in *vLen if vLen
+// is not NULL
+char* kv_debug_get_n(KVStore* kvstore, char* key, size_t kLen, size_t* vLen) {
+    printf("[DEBUG] get() called with a key of %zu bytes\n", kLen);
+    if (kLen > INT_MAX) {
+        printf("[DEBUG] no key is that long, returning NULL\n");
+        return NULL;
+    }
+    debug_print_bytes("key", key, kLen);
     
     if (!kvstore) {
         printf("[DEBUG] kvstore is NULL, returning NULL\n");
@@ -270,43 +693,59 @@ char* debug_get(char* key) {
     printf("[DEBUG] kvstore found, acquiring mutex\n");
     pthread_mutex_lock(&kvstore->store_mutex);
     
-    printf("[DEBUG] mutex acquired, checking heap file\n");
+    printf("[DEBUG] mutex acquired, checking memtable\n");
+
+    MemtableNode* node = memtable_get(kvstore->memtable, key, (int) kLen, kvstore->last_sequence);
+    printf("[DEBUG] memtable holds %d keys, lookup %s\n",
+           kvstore->memtable->count, node ? "hit" : "missed");
+    if (node) {
+        printf("[DEBUG]   - vLen: %lld\n", (long long) node->vLen);
+    }
+    if (kvstore->imm) {
+        MemtableNode* imm_node = memtable_get(kvstore->imm, key, (int) kLen, kvstore->last_sequence);
+        printf("[DEBUG] memtable being flushed holds %d keys, lookup %s\n",
+               kvstore->imm->count, imm_node ? "hit" : "missed");
+    }
+
+    printf("[DEBUG] checking heap file\n");
     
     // First check heap file (most recent)
     if (kvstore->index_file) {
         printf("[DEBUG] index_file exists, searching for key in index\n");
-        int position = find_key_in_index(kvstore->index_file, key);
-        printf("[DEBUG] find_key_in_index returned position: %d\n", position);
+        int64_t position = find_key_in_index(kvstore->index_file, key, (int) kLen);
+        printf("[DEBUG] find_key_in_index returned position: %lld\n", (long long) position);
         
         if (position != -1) {
-            printf("[DEBUG] key found in index at position %d, reading record from heap\n", position);
-            DataRecord* record = read_record_from_file(kvstore->heap_file, position);
+            printf("[DEBUG] key found in index at position %lld, reading record from heap\n", (long long) position);
+            Arena arena;
+            arena_init(&arena);
+            DataRecord* record = read_record_from_file(kvstore->heap_file, position, kvstore->heap_size,
+                                                        kvstore->heap_version, &arena);
             
             if (record) {
                 printf("[DEBUG] record read successfully:\n");
                 printf("[DEBUG]   - kLen: %d\n", record->kLen);
-                printf("[DEBUG]   - vLen: %d\n", record->vLen);
-                printf("[DEBUG]   - key: '%s'\n", record->key ? record->key : "(null)");
-                printf("[DEBUG]   - value: '%s'\n", record->value ? record->value : "(null)");
+                printf("[DEBUG]   - vLen: %lld\n", (long long) record->vLen);
+                debug_print_bytes("key", record->key, (size_t) record->kLen);
+                debug_print_bytes("value", record->value, record->vLen > 0 ? (size_t) record->vLen : 0);
                 
                 char* result = NULL;
-                if (record->vLen > 0) {
-                    printf("[DEBUG] record is valid, duplicating value\n");
-                    result = strdup(record->value);
-                    printf("[DEBUG] strdup result: '%s'\n", result ? result : "(null)");
+                if (record->vLen >= 0) {
+                    printf("[DEBUG] record is valid, copying %lld value bytes\n", (long long) record->vLen);
+                    result = copy_bytes(record->value, (size_t) record->vLen);
+                    if (vLen) *vLen = (size_t) record->vLen;
                 } else {
-                    if (record->vLen <= 0) {
-                        printf("[DEBUG] record has vLen <= 0, treating as tombstone\n");
-                    }
+                    printf("[DEBUG] record has vLen < 0, treating as tombstone\n");
                 }
                 
-                free_record(record);
+                arena_free(&arena);
                 pthread_mutex_unlock(&kvstore->store_mutex);
-                printf("[DEBUG] returning from heap search with result: '%s'\n", result ? result : "(null)");
+                printf("[DEBUG] returning from heap search with %s\n", result ? "a value" : "no value");
                 return result;
             } else {
-                printf("[DEBUG] read_record_from_file returned NULL for position %d\n", position);
+                printf("[DEBUG] read_record_from_file returned NULL for position %lld\n", (long long) position);
             }
+            arena_free(&arena);
         } else {
             printf("[DEBUG] key not found in index\n");
         }
@@ -316,27 +755,52 @@ char* debug_get(char* key) {
     
     printf("[DEBUG] checking SSTables\n");
     
-    // Then check SSTables (older data)
-    SSTable* current = kvstore->sstables;
+    // Then check SSTables (older data), level by level
     int sstable_count = 0;
     
-    while (current) {
-        printf("[DEBUG] checking SSTable #%d: %s (index: %s)\n", 
-               sstable_count, 
-               current->filename ? current->filename : "(null)",
-               current->index_filename ? current->index_filename : "(null)");
-        
-        char* result = search_sstable(current->filename, current->index_filename, key);
-        printf("[DEBUG] search_sstable returned: '%s'\n", result ? result : "(null)");
-        
-        if (result) {
-            printf("[DEBUG] found result in SSTable #%d, returning: '%s'\n", sstable_count, result);
-            pthread_mutex_unlock(&kvstore->store_mutex);
-            return result;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        for (SSTable* current = kvstore->levels[level]; current; current = current->next) {
+            printf("[DEBUG] checking SSTable #%d: %s (level: %d)\n", 
+                   sstable_count, 
+                   current->filename ? current->filename : "(null)",
+                   level);
+            sstable_count++;
+            
+            if (!sstable_contains_key(current, key, (int) kLen)) {
+                printf("[DEBUG] key is outside the range of SSTable #%d\n", sstable_count - 1);
+                continue;
+            }
+            if (!sstable_may_contain(kvstore, current, key, (int) kLen)) {
+                printf("[DEBUG] bloom filter rules out SSTable #%d\n", sstable_count - 1);
+                continue;
+            }
+            
+            BlockContents contents;
+            const char* data;
+            int64_t found_vLen;
+            int found = sstable_find_value(current, key, (int) kLen, &contents, &data, &found_vLen);
+            printf("[DEBUG] sstable_find_value returned: %d\n", found);
+            
+            if (found < 0) {
+                printf("[DEBUG] SSTable #%d could not be read, returning NULL\n", sstable_count - 1);
+                pthread_mutex_unlock(&kvstore->store_mutex);
+                return NULL;
+            }
+            
+            if (found) {
+                char* result = NULL;
+                if (data) {
+                    debug_print_bytes("value", data, (size_t) found_vLen);
+                    result = copy_bytes(data, (size_t) found_vLen);
+                    if (vLen) *vLen = (size_t) found_vLen;
+                }
+                sstable_release_block(current, &contents);
+                printf("[DEBUG] found result in SSTable #%d, returning %s\n", sstable_count - 1,
+                       result ? "its value" : "nothing (tombstone)");
+                pthread_mutex_unlock(&kvstore->store_mutex);
+                return result;
+            }
         }
-        
-        current = current->next;
-        sstable_count++;
     }
     
     if (sstable_count == 0) {
@@ -351,54 +815,280 @@ char* debug_get(char* key) {
 }
 
 // Delete a key
-void delete(char* key) {
-    if (!kvstore || !kvstore->heap_file || !kvstore->index_file) return;
+int kv_delete(KVStore* kvstore, char* key) {
+    return kv_delete_with_options(kvstore, key, NULL);
+}
+
+// Delete a key, optionally syncing the log before returning
+int kv_delete_with_options(KVStore* kvstore, char* key, WriteOptions* options) {
+    return kv_delete_n(kvstore, key, strlen(key), options);
+}
+
+// Delete a kLen-byte key by logging a tombstone for it
+int kv_delete_n(KVStore* kvstore, char* key, size_t kLen, WriteOptions* options) {
+    return kv_put_n(kvstore, key, kLen, NULL, 0, options);
+}
+
+// Trigger compaction. Callers may or may not hold store_mutex (wal_commit()
+// does), so the status is claimed with a compare-and-swap: of two racing
+// triggers only one starts a worker. Returns 0 once a worker is running,
+// or -1 if its thread could not be started.
+int kv_compact(KVStore* kvstore) {
+    if (!kvstore) return -1;
     
+    int expected = COMPACTION_COMPLETED;
+    if (!__atomic_compare_exchange_n(&kvstore->compaction_status, &expected, COMPACTION_STARTED,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (pthread_create(&kvstore->compaction_thread, NULL, compaction_worker, kvstore) != 0) {
+        // No worker will release the claim, so release it here
+        __atomic_store_n(&kvstore->compaction_status, COMPACTION_COMPLETED, __ATOMIC_RELEASE);
+        return -1;
+    }
+    pthread_detach(kvstore->compaction_thread);
+    return 0;
+}
+
+// COMPACTION_STARTED while a flush or the merges after one are running
+int kv_compaction_status(KVStore* kvstore) {
+    if (!kvstore) return COMPACTION_COMPLETED;
+    if (__atomic_load_n(&kvstore->compaction_status, __ATOMIC_ACQUIRE) == COMPACTION_STARTED ||
+        __atomic_load_n(&kvstore->merging, __ATOMIC_ACQUIRE)) {
+        return COMPACTION_STARTED;
+    }
+    return COMPACTION_COMPLETED;
+}
+
+// Copy out the runtime counters
+void kv_get_stats(KVStore* kvstore, KVStoreStats* stats) {
+    if (!kvstore) {
+        memset(stats, 0, sizeof(KVStoreStats));
+        return;
+    }
     pthread_mutex_lock(&kvstore->store_mutex);
+    *stats = kvstore->stats;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        stats->level_files[level] = level_file_count(kvstore, level);
+        stats->level_bytes[level] = level_bytes(kvstore, level);
+        stats->level_raw_bytes[level] = level_raw_bytes(kvstore, level);
+    }
+    pthread_mutex_unlock(&kvstore->store_mutex);
     
-    long position = ftell(kvstore->heap_file);
-    DataRecord* tombstone = create_record(key, NULL, position);
-	printf("[DEBUG] Creating tombstone record for key %s with heap offset at position %ld\n", key, position);
+    if (kvstore->block_cache) {
+        block_cache_add_stats(kvstore->block_cache, stats);
+    }
+}
+
+// Create an iterator over a snapshot of the store: a copy of the
+// memtables plus the current version, which keeps every SSTable it saw
+// open, so later writes, flushes and compactions do not disturb it.
+// Starts unpositioned; call iterator_seek_to_first() or iterator_seek().
+KVIterator* kv_iterator_create(KVStore* kvstore) {
+    if (!kvstore) return NULL;
     
-    write_record_to_file(kvstore->heap_file, tombstone);
-	printf("[DEBUG] Written tombstone to heap file\n");
-    write_index_entry_to_file(kvstore->index_file, tombstone);
-	printf("[DEBUG] Written index entry for tombstone\n");
-	debug_all_entries(key);
+    KVIterator* it = calloc(1, sizeof(KVIterator));
+    it->version = version_acquire(kvstore);
+    Version* version = it->version;
+    uint64_t sequence = __atomic_load_n(&kvstore->last_sequence, __ATOMIC_ACQUIRE);
     
-    kvstore->heap_size = get_heap_size();
+    arena_init(&it->arena);
+    it->memtable_records = memtable_snapshot(version->memtable, sequence, &it->num_memtable_records, &it->arena);
+    if (version->imm) {
+        it->imm_records = memtable_snapshot(version->imm, sequence, &it->num_imm_records, &it->arena);
+    }
     
-    // Check if compaction is needed
-    if (kvstore->heap_size > kvstore->compaction_threshold && 
-        kvstore->compaction_status == COMPACTION_COMPLETED) {
-		printf("[DEBUG] Triggering compactiong...(heap file too big)\n");
-        compact();
+    int num_tables = 0;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        num_tables += version->num_files[level];
     }
     
-    free_record(tombstone);
-    pthread_mutex_unlock(&kvstore->store_mutex);
-	printf("[DEBUG] Deletion complete\n");
+    // Children run from newest to oldest: memtable, memtable being flushed,
+    // L0 newest first, L1...
+    merging_iter_init(&it->merge, num_tables + 2);
+    table_iter_init_records(&it->merge.children[0], it->memtable_records, it->num_memtable_records);
+    table_iter_init_records(&it->merge.children[1], it->imm_records, it->num_imm_records);
+    int child = 2;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        for (int i = 0; i < version->num_files[level]; i++) {
+            table_iter_init(&it->merge.children[child++], version->files[level][i]);
+        }
+    }
+    return it;
 }
 
-// Trigger compaction
-void compact() {
-    if (!kvstore || kvstore->compaction_status == COMPACTION_STARTED) return;
-    
-    kvstore->compaction_status = COMPACTION_STARTED;
-    pthread_create(&kvstore->compaction_thread, NULL, compaction_worker, NULL);
-    pthread_detach(kvstore->compaction_thread);
+// Advance the merge to the next live entry, skipping older versions of
+// the key just visited and keys whose newest version is a tombstone.
+// Stops for good once a table fails to read: its missing entries could
+// otherwise be replaced by stale ones from older tables.
+void iterator_find_next_entry(KVIterator* it, int has_key) {
+    it->valid = 0;
+    while (merging_iter_valid(&it->merge) && merging_iter_status(&it->merge) == 0) {
+        TableIter* current = merging_iter_current(&it->merge);
+        if (has_key && compare_key_bytes(current->key, current->kLen, it->key, it->kLen) == 0) {
+            merging_iter_next(&it->merge);
+            continue;
+        }
+        
+        if (current->kLen + 1 > it->key_cap) {
+            it->key_cap = (current->kLen + 1) * 2;
+            it->key = realloc(it->key, it->key_cap);
+        }
+        memcpy(it->key, current->key, current->kLen);
+        it->key[current->kLen] = '\0';
+        it->kLen = current->kLen;
+        has_key = 1;
+        
+        if (current->vLen < 0) {
+            merging_iter_next(&it->merge);
+            continue;
+        }
+        
+        size_t vLen = (size_t) current->vLen;
+        if (vLen + 1 > it->value_cap) {
+            it->value_cap = (vLen + 1) * 2;
+            it->value = realloc(it->value, it->value_cap);
+        }
+        memcpy(it->value, current->value, vLen);
+        it->value[vLen] = '\0';
+        it->vLen = vLen;
+        it->valid = 1;
+        return;
+    }
 }
 
-// Get compaction status
-int getCompactionStatus() {
-    return kvstore ? kvstore->compaction_status : COMPACTION_COMPLETED;
+void iterator_seek_to_first(KVIterator* it) {
+    if (it->shard_iters) {
+        for (int i = 0; i < it->num_shard_iters; i++) {
+            iterator_seek_to_first(it->shard_iters[i]);
+        }
+        sharded_iterator_pick(it);
+        return;
+    }
+    merging_iter_seek_to_first(&it->merge);
+    iterator_find_next_entry(it, 0);
 }
 
-// Cleanup function
-void cleanup() {
+// Position the iterator at the first live key >= key
+void iterator_seek(KVIterator* it, char* key) {
+    iterator_seek_n(it, key, strlen(key));
+}
+
+void iterator_seek_n(KVIterator* it, char* key, size_t kLen) {
+    if (it->shard_iters) {
+        for (int i = 0; i < it->num_shard_iters; i++) {
+            iterator_seek_n(it->shard_iters[i], key, kLen);
+        }
+        sharded_iterator_pick(it);
+        return;
+    }
+    // Stored keys are at most INT_MAX bytes, so a longer key sorts right
+    // after its first INT_MAX bytes
+    merging_iter_seek(&it->merge, key, kLen > INT_MAX ? INT_MAX : (int) kLen);
+    iterator_find_next_entry(it, 0);
+    if (kLen > INT_MAX && it->valid && compare_key_bytes(it->key, it->kLen, key, INT_MAX) == 0) {
+        iterator_next(it);
+    }
+}
+
+int iterator_valid(KVIterator* it) {
+    if (it->shard_iters) return it->current_shard >= 0;
+    return it->valid;
+}
+
+// 0, or -1 if the scan ended early because a table could not be read.
+// Check it once iterator_valid() turns false.
+int iterator_status(KVIterator* it) {
+    if (it->shard_iters) {
+        for (int i = 0; i < it->num_shard_iters; i++) {
+            if (iterator_status(it->shard_iters[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    return merging_iter_status(&it->merge);
+}
+
+void iterator_next(KVIterator* it) {
+    if (it->shard_iters) {
+        if (it->current_shard < 0) return;
+        iterator_next(it->shard_iters[it->current_shard]);
+        sharded_iterator_pick(it);
+        return;
+    }
+    if (!it->valid) return;
+    merging_iter_next(&it->merge);
+    iterator_find_next_entry(it, 1);
+}
+
+// Current key and value; valid until the iterator moves
+const char* iterator_key(KVIterator* it) {
+    if (it->shard_iters) {
+        return it->current_shard >= 0 ? iterator_key(it->shard_iters[it->current_shard]) : NULL;
+    }
+    return it->valid ? it->key : NULL;
+}
+
+const char* iterator_value(KVIterator* it) {
+    if (it->shard_iters) {
+        return it->current_shard >= 0 ? iterator_value(it->shard_iters[it->current_shard]) : NULL;
+    }
+    return it->valid ? it->value : NULL;
+}
+
+// Byte lengths of the current key and value, -1 if the iterator is done
+int iterator_key_length(KVIterator* it) {
+    if (it->shard_iters) {
+        return it->current_shard >= 0 ? iterator_key_length(it->shard_iters[it->current_shard]) : -1;
+    }
+    return it->valid ? it->kLen : -1;
+}
+
+int64_t iterator_value_length(KVIterator* it) {
+    if (it->shard_iters) {
+        return it->current_shard >= 0 ? iterator_value_length(it->shard_iters[it->current_shard]) : -1;
+    }
+    return it->valid ? (int64_t) it->vLen : -1;
+}
+
+void iterator_free(KVIterator* it) {
+    if (!it) return;
+    if (it->shard_iters) {
+        for (int i = 0; i < it->num_shard_iters; i++) {
+            iterator_free(it->shard_iters[i]);
+        }
+        free(it->shard_iters);
+        free(it);
+        return;
+    }
+    merging_iter_free(&it->merge);
+    free(it->memtable_records);
+    free(it->imm_records);
+    arena_free(&it->arena);
+    version_unref(it->version);
+    free(it->key);
+    free(it->value);
+    free(it);
+}
+
+// Close a store opened with kv_open(): wait for its background work,
+// sync the log if the store promised durability, and free it
+void kv_close(KVStore* kvstore) {
     if (!kvstore) return;
     
+    wal_stop_sync_thread(kvstore);
+    
+    // Let an in-flight compaction finish before tearing down its state
     pthread_mutex_lock(&kvstore->store_mutex);
+    while (kv_compaction_status(kvstore) == COMPACTION_STARTED) {
+        pthread_mutex_unlock(&kvstore->store_mutex);
+        usleep(1000);
+        pthread_mutex_lock(&kvstore->store_mutex);
+    }
+    
+    // A store that promised durability syncs its log on the way out
+    if (kvstore->wal_sync_mode != WAL_SYNC_NONE) {
+        wal_sync(kvstore);
+    }
     
     if (kvstore->heap_file) {
         fclose(kvstore->heap_file);
@@ -410,19 +1100,122 @@ void cleanup() {
         kvstore->index_file = NULL;
     }
     
-    // Free SSTable list
-    SSTable* current = kvstore->sstables;
-    while (current) {
-        SSTable* next = current->next;
-        free(current->filename);
-        free(current->index_filename);
-        free(current);
-        current = next;
+    if (kvstore->manifest_fd >= 0) {
+        close(kvstore->manifest_fd);
+        kvstore->manifest_fd = -1;
     }
     
+    // Free every level's SSTables
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        SSTable* current = kvstore->levels[level];
+        while (current) {
+            SSTable* next = current->next;
+            sstable_unref(current);
+            current = next;
+        }
+        free(kvstore->compact_pointer[level]);
+    }
+    
+    version_unref(kvstore->current);
+    memtable_unref(kvstore->memtable);
+    memtable_unref(kvstore->imm);
+    block_cache_free(kvstore->block_cache);
     free(kvstore->data_directory);
     pthread_mutex_unlock(&kvstore->store_mutex);
     pthread_mutex_destroy(&kvstore->store_mutex);
+    pthread_cond_destroy(&kvstore->writer_cond);
+    pthread_cond_destroy(&kvstore->wal_sync_cond);
     free(kvstore);
+}
+
+// Compatibility API: the original functions operate on the global store
+// opened by init()
+
+void init(char* data_directory) {
+    init_with_options(data_directory, NULL);
+}
+
+void init_with_options(char* data_directory, KVStoreOptions* options) {
+    kvstore = kv_open(data_directory, options);
+}
+
+int put(char* key, char* value) {
+    return kv_put(kvstore, key, value);
+}
+
+int put_with_options(char* key, char* value, WriteOptions* options) {
+    return kv_put_with_options(kvstore, key, value, options);
+}
+
+char* get(char* key) {
+    return kv_get(kvstore, key);
+}
+
+char* debug_get(char* key) {
+    return kv_debug_get(kvstore, key);
+}
+
+int get_pinned(char* key, PinnedSlice* slice) {
+    return kv_get_pinned(kvstore, key, slice);
+}
+
+void pinned_release(PinnedSlice* slice) {
+    kv_pinned_release(slice);
+}
+
+int put_n(char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options) {
+    return kv_put_n(kvstore, key, kLen, value, vLen, options);
+}
+
+char* get_n(char* key, size_t kLen, size_t* vLen) {
+    return kv_get_n(kvstore, key, kLen, vLen);
+}
+
+int get_pinned_n(char* key, size_t kLen, PinnedSlice* slice) {
+    return kv_get_pinned_n(kvstore, key, kLen, slice);
+}
+
+int delete_n(char* key, size_t kLen, WriteOptions* options) {
+    return kv_delete_n(kvstore, key, kLen, options);
+}
+
+int multi_get(char** keys, int n, char** values) {
+    return kv_multi_get(kvstore, keys, n, values);
+}
+
+int multi_get_n(char** keys, const size_t* kLens, int n, char** values) {
+    return kv_multi_get_n(kvstore, keys, kLens, n, values);
+}
+
+int delete(char* key) {
+    return kv_delete(kvstore, key);
+}
+
+int delete_with_options(char* key, WriteOptions* options) {
+    return kv_delete_with_options(kvstore, key, options);
+}
+
+int write_batch(WriteBatch* batch, WriteOptions* options) {
+    return kv_write_batch(kvstore, batch, options);
+}
+
+int compact() {
+    return kv_compact(kvstore);
+}
+
+int getCompactionStatus() {
+    return kv_compaction_status(kvstore);
+}
+
+void get_stats(KVStoreStats* stats) {
+    kv_get_stats(kvstore, stats);
+}
+
+KVIterator* iterator_create() {
+    return kv_iterator_create(kvstore);
+}
+
+void cleanup() {
+    kv_close(kvstore);
     kvstore = NULL;
 }
@@ -16,65 +16,729 @@
 // Default compaction threshold (64KB)
 #define DEFAULT_COMPACTION_THRESHOLD (64 * 1024)
 
+// Default Bloom filter size per SSTable key (~1% false positives)
+#define DEFAULT_BLOOM_BITS_PER_KEY 10
+
+// Block cache used for SSTables read with pread() instead of mmap
+#define DEFAULT_BLOCK_CACHE_SIZE (8 * 1024 * 1024)
+#define BLOCK_CACHE_SHARDS 16
+
+// Block-based SSTable format
+#define DEFAULT_BLOCK_SIZE 4096
+#define BLOCK_RESTART_INTERVAL 16
+#define SSTABLE_FORMAT_FLAT 1   // {kLen, vLen, key, value} stream + index file
+#define SSTABLE_FORMAT_BLOCK 2  // Data blocks + block index + footer
+#define SSTABLE_FORMAT_UNREADABLE 3  // Missing or damaged; reads in its key range fail
+#define SSTABLE_MAGIC 0x74696e7964627462ULL  // "tinydbtb"
+
+// Footer versions of block-based tables (see sstable.h for the layouts)
+#define SSTABLE_FOOTER_V2 2  // Initial block format
+#define SSTABLE_FOOTER_V3 3  // Adds the table's LSM level
+#define SSTABLE_FOOTER_V4 4  // Adds block trailers and the compression codec
+#define SSTABLE_FOOTER_V5 5  // Block trailers gain a CRC32C of the block
+#define SSTABLE_FOOTER_V6 6  // Same layout; values may reach 2 GiB and more
+#define SSTABLE_FOOTER_VERSION SSTABLE_FOOTER_V6
+#define BLOCK_CHECKSUM_SIZE 4  // uint32 CRC32C ending each v5 block
+#define SSTABLE_FOOTER_MAX_SIZE 64
+#define BLOOM_FILE_MAGIC 0x6d6f6c62U  // "blom", starts checksummed filter files
+
+// Block compression codecs (see compression.h). Ids are stored in
+// SSTables, so an id must never be reused for another codec.
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ 1           // Built-in LZ77 codec, LZ4-style blocks
+#define MAX_COMPRESSION_CODECS 16
+
+// Leveled compaction
+#define NUM_LEVELS 7
+#define DEFAULT_LEVEL0_FILE_TRIGGER 4
+#define DEFAULT_LEVEL1_MAX_BYTES (10 * DEFAULT_COMPACTION_THRESHOLD)
+#define DEFAULT_LEVEL_SIZE_MULTIPLIER 10
+#define DEFAULT_TARGET_FILE_SIZE (2 * DEFAULT_COMPACTION_THRESHOLD)
+
+// Leveled compactions are split by key range into up to this many
+// subcompactions merged in parallel, each given at least two output
+// files' worth of input
+#define DEFAULT_MAX_SUBCOMPACTIONS 4
+
+// Compaction policies, chosen when the store is opened
+#define COMPACTION_STYLE_LEVELED 0     // Levels with growing size targets
+#define COMPACTION_STYLE_SIZE_TIERED 1 // Merge runs of similar-sized L0 tables
+
+// Size-tiered compaction: tables within [0.5, 1.5] of the run's average
+// size are "similar"; a run of at least min width is merged into one table
+#define DEFAULT_TIERED_MIN_MERGE_WIDTH 4
+#define DEFAULT_TIERED_MAX_MERGE_WIDTH 32
+#define TIERED_BUCKET_LOW 0.5
+#define TIERED_BUCKET_HIGH 1.5
+
+// Write-ahead log (heap.dat) durability
+#define WAL_SYNC_NONE 0      // Write to the OS, leave flushing to it
+#define WAL_SYNC_ALWAYS 1    // fsync every group commit before acknowledging it
+#define WAL_SYNC_PERIODIC 2  // fsync from a background thread every interval
+#define DEFAULT_WAL_SYNC_INTERVAL_MS 100
+#define WAL_MAX_GROUP_BYTES (1024 * 1024)  // Cap on one group commit
+// A write batch is logged as a header record {WAL_BATCH_MARKER, count}
+// followed by its count records; replay applies a batch only if all of
+// it reached the log
+#define WAL_BATCH_MARKER -2
+
+// heap.dat starts with {int: HEAP_FILE_MARKER, int: version}; files
+// without it are version 1. From version 2 on, every record and batch
+// header is followed by a uint32 CRC32C of its bytes. The two length
+// fields starting records and batch headers are ints before version 3
+// and int64s from it on.
+#define HEAP_FILE_MARKER -1
+#define HEAP_FILE_V1 1  // Records {int: kLen, int: vLen, key, value}
+#define HEAP_FILE_V2 2  // Records and batch headers end in a CRC32C
+#define HEAP_FILE_V3 3  // Records {int64: kLen, int64: vLen, key, value, crc}
+#define HEAP_FILE_VERSION HEAP_FILE_V3
+#define HEAP_FILE_HEADER_SIZE (2 * sizeof(int))
+
+// index.dat (the debug index of heap.dat) starts with {int:
+// INDEX_FILE_MARKER, int: version}; files without it are version 1
+#define INDEX_FILE_MARKER -1
+#define INDEX_FILE_V1 1  // Entries {int: kLen, int32: position, key}
+#define INDEX_FILE_V2 2  // Entries {int: kLen, int64: position, key}
+#define INDEX_FILE_VERSION INDEX_FILE_V2
+
+// Longest run of adjacent SSTable blocks multi_get fetches with one read
+#define MULTI_GET_MAX_READ_BYTES (256 * 1024)
+
 // File naming constants
 #define HEAP_FILE_NAME "heap.dat"
 #define INDEX_FILE_NAME "index.dat"
+#define IMM_HEAP_FILE_NAME "heap.imm"  // Log of the memtable being flushed
+#define SHARD_DIR_PREFIX "shard_"     // shard_NNN/ holds one shard of a sharded store
+#define SHARD_COUNT_FILE_NAME "SHARDS"  // Shard count of a sharded store
 #define SSTABLE_PREFIX "sstable_"
 #define SSTABLE_INDEX_PREFIX "sstable_index_"
+#define SSTABLE_BLOOM_PREFIX "sstable_bloom_"
+#define MANIFEST_FILE_NAME "MANIFEST"          // Log of table additions and removals
+#define MANIFEST_TEMP_FILE_NAME "MANIFEST.tmp" // Snapshot being written at open
+
+// MANIFEST edits (see manifest.h). Each is {uint32: body size} followed by
+// {int: next_file_number, int: num_deleted, int: num_added, int[]: deleted
+// file numbers} and, per added table, {int: file_number, int: level,
+// uint64: sequence, int: smallest kLen, int: largest kLen, smallest key,
+// largest key}, then {int64: heap.imm offset, int64: heap.dat offset}
+// replay resumes from. Replay stops at the first incomplete edit.
+#define MANIFEST_EDIT_HEADER_SIZE (3 * sizeof(int))
+#define MANIFEST_TABLE_HEADER_SIZE (4 * sizeof(int) + sizeof(uint64_t))
+#define MANIFEST_EDIT_TRAILER_SIZE (2 * sizeof(int64_t))
 
-// Data record structure for in-memory operations
+// Data record structure for in-memory operations. Keys are at most
+// INT_MAX bytes; values may be longer.
 typedef struct {
     int kLen;
-    int vLen;  // -1 for tombstone
+    int64_t vLen;  // -1 for tombstone
     char* key;
     char* value;  // NULL for tombstone
-    int position; // Position in heap file (for index entries)
-	int original_index;  // Useful during sorting, not to be persisted
-
+    int64_t position; // Position in heap file (for index entries)
 } DataRecord;
 
 // Data Entry structure for in-memory operations
 typedef struct {
     int kLen;
-    int position; // Position in heap file 
+    int64_t position; // Position in heap file
     char* key;
 } DataEntry;
 
 
+// Options for a single write
+typedef struct {
+    int sync;  // fsync the log before returning, whatever the store's mode
+} WriteOptions;
+
+// One put (or delete, with value NULL) of a write. Keys and values are
+// byte strings of the given lengths.
+typedef struct {
+    char* key;
+    int kLen;
+    char* value;
+    int64_t vLen;  // -1 for a delete
+} WriteOp;
+
+// Puts and deletes applied atomically by kv_write_batch(). Holds its own
+// copies of the keys and values.
+typedef struct {
+    WriteOp* ops;
+    int count;
+    int cap;
+} WriteBatch;
+
+// A write (one put or delete, or a batch) queued for group commit. The
+// first writer in the queue commits everyone queued behind it with one
+// write and at most one fsync.
+typedef struct WALWriter {
+    WriteOp* ops;
+    int count;
+    int sync;
+    int done;
+    int status;   // 0 once durable per the requested policy, -1 on I/O error
+    struct WALWriter* next;
+} WALWriter;
+
+// Bump allocator freed all at once (see arena.h)
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;            // Usable bytes in data
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;     // Newest first
+    char* ptr;              // Free space left in the current block
+    size_t remaining;
+    size_t memory_usage;    // Bytes taken from malloc, headers included
+} Arena;
+
+// Memtable skiplist node: one record for one key. An overwrite links a
+// new node in front of the old one, so the first node of a key is its
+// latest record; nodes are never changed once linked.
+typedef struct MemtableNode {
+    int kLen;
+    int64_t vLen;  // -1 for tombstone
+    char* key;
+    char* value;  // NULL for tombstone
+    uint64_t seq; // Readers only see records up to the store's last_sequence
+    int height;
+    struct MemtableNode* next[];
+} MemtableNode;
+
+// Maximum height of a memtable skiplist tower
+#define MEMTABLE_MAX_HEIGHT 12
+
+// Sorted in-memory table mirroring the current heap file. One writer at
+// a time (under the store mutex) may insert while readers search it
+// without locks.
+typedef struct Memtable {
+    MemtableNode* head;
+    int height;
+    int count;    // Distinct keys
+    long bytes;
+    unsigned int rand_state;
+    int refs;     // The store's plus one per version holding it
+    Arena arena;  // Nodes, keys and values; freed with the memtable
+    size_t empty_usage;  // Arena bytes taken by the head of an empty memtable
+} Memtable;
+
+// Builds one prefix-compressed block (see block.h for the layout)
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+    uint32_t* restarts;
+    int num_restarts;
+    int restarts_cap;
+    int counter;       // Entries since the last restart point
+    int entries;
+    char* last_key;
+    int last_key_len;
+    int last_key_cap;
+} BlockBuilder;
+
+// Cursor over the entries of one finished block
+typedef struct {
+    const char* data;
+    size_t restarts;        // Offset of the restart array
+    uint32_t num_restarts;
+    size_t next_offset;     // Offset of the entry after the current one
+    char* key;              // Current key, rebuilt from the shared prefix
+    int kLen;
+    int key_cap;
+    const char* value;      // Points into data, NULL for tombstone
+    int64_t vLen;
+    int valid;
+} BlockIter;
+
+// A block compression codec. compress() writes at most
+// max_compressed_size(n) bytes and returns how many, 0 on failure;
+// decompress() must produce exactly size bytes and returns 0 on success.
+typedef struct {
+    int id;
+    const char* name;
+    size_t (*max_compressed_size)(size_t n);
+    size_t (*compress)(const char* src, size_t n, char* dst);
+    int (*decompress)(const char* src, size_t n, char* dst, size_t size);
+} BlockCodec;
+
+// Streams sorted records into a block-based SSTable file
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+    int block_size;
+    BlockBuilder data_block;
+    BlockBuilder index_block;
+    int record_count;
+    int block_count;
+    int level;
+    int compression;        // Codec for the blocks, COMPRESSION_NONE for none
+    uint64_t raw_data_size; // Data block bytes before compression
+    char* scratch;          // Compressed form of the block being written
+    size_t scratch_cap;
+} TableBuilder;
+
+// Trailer of a block-based SSTable, always the last bytes of the file
+typedef struct {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint32_t record_count;
+    uint32_t level;
+    uint32_t compression;
+    uint64_t raw_data_size;
+    uint32_t version;
+    uint64_t magic;
+} TableFooter;
+
+// In-memory block index entry: the last key in each data block
+typedef struct {
+    char* last_key;
+    int kLen;
+    uint64_t offset;
+    uint64_t size;
+} TableBlockHandle;
+
+// One cached SSTable block
+typedef struct CacheEntry {
+    uint64_t table_id;
+    uint64_t offset;
+    uint64_t hash;
+    char* data;
+    size_t size;
+    int refs;  // Pins held by readers; pinned entries are never evicted
+    struct CacheEntry* hash_next;
+    struct CacheEntry* lru_prev;
+    struct CacheEntry* lru_next;
+} CacheEntry;
+
+// Independently locked slice of the block cache
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t capacity;
+    size_t usage;
+    CacheEntry** buckets;
+    int num_buckets;
+    int num_entries;
+    CacheEntry lru;  // List head: lru.lru_next is the least recently used
+    long hits;
+    long misses;
+    long evictions;
+} CacheShard;
+
+// Sharded LRU cache of SSTable blocks
+typedef struct {
+    CacheShard shards[BLOCK_CACHE_SHARDS];
+    uint64_t next_table_id;
+    pthread_mutex_t id_mutex;
+} BlockCache;
+
+// Bytes of one block, either borrowed from the mapping or pinned in the cache
+typedef struct {
+    const char* data;
+    size_t size;
+    CacheEntry* cache_entry;  // Pinned cache entry, NULL if not cached
+    char* owned;              // Private copy when there is no cache
+} BlockContents;
+
+// Bloom filter over the keys of one SSTable
+typedef struct {
+    int num_probes;
+    int num_bytes;
+    uint8_t* bits;
+} BloomFilter;
+
 // SSTable metadata
 typedef struct SSTable {
     char* filename;
-    char* index_filename;
+    char* index_filename;  // Only used by SSTABLE_FORMAT_FLAT tables
+    int file_number;    // N in sstable_N.dat
+    int format;
+    int block_trailers; // Blocks end in a codec byte (SSTABLE_FOOTER_V4 on)
+    int block_checksums; // ... and a CRC32C (SSTABLE_FOOTER_V5 on)
+    int verify_checksums; // Check block CRCs on every read
+    long* checksum_failures; // Store counter bumped on a mismatch
+    int compression;    // Codec the table was written with
+    int level;          // LSM level, 0 for flushed and flat tables
+    uint64_t sequence;  // Newest write the table holds; orders L0
     int record_count;
-    struct SSTable* next;
+    char* smallest_key; // Key range, NULL for an empty table
+    int smallest_kLen;
+    char* largest_key;
+    int largest_kLen;
+    DataEntry* index;   // Sorted index entries, loaded once at open
+    char* index_keys;   // Backing storage for the keys in index
+    TableBlockHandle* blocks;  // Block index of SSTABLE_FORMAT_BLOCK tables
+    int block_count;
+    char* block_keys;   // Backing storage for the keys in blocks
+    char* bloom_filename;
+    BloomFilter* bloom; // NULL if the table has no filter
+    char* data_map;     // Read-only mapping of the data file, NULL if unmapped
+    size_t data_size;
+    uint64_t raw_size;  // data_size had no block been compressed
+    int fd;             // Open data file when not mapped, -1 otherwise
+    uint64_t id;        // Block cache key, unique for the life of the process
+    BlockCache* cache;  // NULL if reads bypass the cache
+    int refs;           // One for the level list plus one per version holding it
+    struct SSTable* next;  // Next table in the same level
 } SSTable;
 
+// A table as the MANIFEST describes it, collected while replaying edits
+typedef struct {
+    int file_number;
+    int level;
+    uint64_t sequence;
+    char* smallest_key;
+    int smallest_kLen;
+    char* largest_key;
+    int largest_kLen;
+} ManifestTable;
+
+// Immutable snapshot of what reads see: both memtables and the SSTables of
+// every level. get() and iterators pin the current version instead of
+// taking the store mutex; see version.h.
+typedef struct {
+    int refs;
+    Memtable* memtable;
+    Memtable* imm;          // NULL when no flush is running
+    SSTable** files[NUM_LEVELS];  // In level list order
+    int num_files[NUM_LEVELS];
+} Version;
+
+// Cursor over every record of one SSTable, in key order. With sstable
+// NULL it walks a sorted record array (a memtable snapshot) instead.
+typedef struct {
+    SSTable* sstable;
+    DataRecord* records;    // Record arrays: sorted records
+    int num_records;
+    int block_index;        // Block tables: current data block
+    BlockContents contents;
+    BlockIter block_iter;
+    int entry_index;        // Flat tables and record arrays: current entry
+    char* flat_buffer;      // Flat tables: record copy when not mapped
+    const char* key;
+    int kLen;
+    const char* value;      // NULL for tombstone
+    int64_t vLen;
+    int valid;
+    int status;             // -1 once a block could not be read or decoded
+} TableIter;
+
+// K-way merge over several TableIters; child 0 holds the newest data
+typedef struct {
+    TableIter* children;
+    int num_children;
+    int* heap;              // Child indexes ordered by (key, child index)
+    int heap_size;
+    int status;             // -1 once a child stopped on a read error
+} MergingIter;
+
+// One key of a multi_get batch (see multi_get.h)
+typedef struct {
+    char* key;
+    int kLen;
+    int index;    // Position in the caller's key and value arrays
+    int block;    // Data block of the current table that may hold the key
+    int done;     // Found, possibly as a tombstone
+} MultiGetKey;
+
+// Range scan over the whole store (see iterator_create). Holds a copy of
+// the memtables and the version current at creation time. An iterator
+// over a sharded store instead merges one iterator per shard.
+typedef struct KVIterator {
+    struct KVIterator** shard_iters;  // Sharded stores only, else NULL
+    int num_shard_iters;
+    int current_shard;      // Shard holding the smallest key, -1 when done
+    MergingIter merge;      // Children 0 and 1 are the memtable copies, then L0..Ln tables
+    DataRecord* memtable_records;
+    int num_memtable_records;
+    DataRecord* imm_records;  // Copy of the memtable being flushed, if any
+    int num_imm_records;
+    Arena arena;            // Keys and values of both memtable copies
+    Version* version;
+    char* key;              // Current entry, copied out of the child
+    int kLen;
+    int key_cap;
+    char* value;
+    size_t vLen;
+    size_t value_cap;
+    int valid;
+} KVIterator;
+
+// Value handed out by get_pinned() without a copy. data points into the
+// memtable arena, a pinned cache block or the table mapping and stays
+// valid until pinned_release(); it is not NUL-terminated.
+typedef struct {
+    const char* data;
+    size_t size;
+    Version* version;       // Keeps the memtable or table alive, NULL if empty
+    SSTable* sstable;       // Owner of contents, NULL for memtable hits
+    BlockContents contents; // Pinned block, or the value read for unmapped flat tables
+} PinnedSlice;
+
+// One SSTable being written by a flush or compaction
+typedef struct {
+    int file_number;
+    TableBuilder builder;
+    uint32_t* key_hashes;   // Bloom filter input, built once the table is done
+    int num_hashes;
+    int hashes_cap;
+} CompactionOutput;
+
+// Tunables chosen when the store is opened
+typedef struct {
+    long compaction_threshold;
+    int bloom_bits_per_key;  // 0 disables Bloom filters for new SSTables
+    int block_size;          // Target size of SSTable data blocks
+    int use_mmap;            // Map SSTables; 0 reads blocks with pread()
+    int compression;         // Codec for new SSTable blocks, COMPRESSION_NONE for none
+    int verify_checksums;    // Check SSTable block CRCs on reads; 0 trusts the disk
+    size_t block_cache_size; // Bytes of blocks cached for pread() reads, 0 disables
+    int level0_file_trigger; // L0 tables that trigger a compaction into L1
+    long level1_max_bytes;   // Size target of L1
+    int level_size_multiplier; // Each deeper level may be this much larger
+    long target_file_size;   // Compaction output tables are split at this size
+    int max_subcompactions;  // Threads one leveled compaction may use, 1 for none
+    int compaction_style;    // COMPACTION_STYLE_LEVELED or COMPACTION_STYLE_SIZE_TIERED
+    int tiered_min_merge_width; // Size-tiered: fewest similar tables worth merging
+    int tiered_max_merge_width; // Size-tiered: most tables merged at once
+    int wal_sync_mode;       // WAL_SYNC_NONE, WAL_SYNC_ALWAYS or WAL_SYNC_PERIODIC
+    int wal_sync_interval_ms; // Period of WAL_SYNC_PERIODIC
+} KVStoreOptions;
+
+// Runtime counters, see get_stats()
+typedef struct {
+    long bloom_negatives;        // SSTable probes skipped by the filter
+    long bloom_positives;        // Filter said "maybe", table was probed
+    long bloom_false_positives;  // Probed after a "maybe" but key absent
+    long block_cache_hits;
+    long block_cache_misses;
+    long block_cache_evictions;
+    long block_cache_usage;      // Bytes currently cached
+    long flushes;                // Memtables flushed to L0
+    long compactions;            // Level or size-tiered compactions run
+    long subcompactions;         // Key ranges those were merged in, in parallel
+    // Write amplification is (flush_bytes_written + compaction_bytes_written)
+    // divided by user_bytes_written
+    long user_bytes_written;     // Key and value bytes passed to put/delete
+    long flush_bytes_written;    // SSTable bytes written by memtable flushes
+    long compaction_bytes_read;  // SSTable bytes read by compactions
+    long compaction_bytes_written; // SSTable bytes written by compactions
+    long wal_records;            // Records appended to the log
+    long wal_batches;            // Group commits (one write each)
+    long wal_syncs;              // fsyncs of the log
+    long multi_get_blocks;       // Uncached data blocks multi_get fetched with pread()
+    long multi_get_reads;        // pread() calls those blocks took after coalescing
+    long checksum_failures;      // SSTable blocks read back with a bad CRC
+    long replay_runs;            // L0 tables written while replaying an oversized log at open
+    int level_files[NUM_LEVELS];
+    long level_bytes[NUM_LEVELS];
+    // level_raw_bytes / level_bytes is a level's compression ratio
+    long level_raw_bytes[NUM_LEVELS]; // What level_bytes would be uncompressed
+} KVStoreStats;
+
 // Main KVStore structure
 typedef struct {
     char* data_directory;
     FILE* heap_file;
     FILE* index_file;
-    SSTable* sstables;
+    int manifest_fd;             // MANIFEST open for appending edits, -1 if unwritable
+    SSTable* levels[NUM_LEVELS];  // L0 newest first, deeper levels by key
+    char* compact_pointer[NUM_LEVELS];  // Largest key of the last table compacted per level
+    int compact_pointer_kLen[NUM_LEVELS];
+    int next_file_number;
+    Memtable* memtable;
+    Memtable* imm;               // Memtable being flushed, still read by get()
+    uint64_t last_sequence;      // Newest memtable record visible to readers
+    Version* current;            // Published read state, see version.h
+    int version_epoch;           // Grace period slot new readers count in
+    int version_readers[2];      // Readers between loading current and pinning it
     long heap_size;
-    int compaction_threshold;
+    long imm_size;               // Length of heap.imm while imm holds it
+    long heap_replayed;          // Bytes of heap.dat already in tables, as logged in the MANIFEST
+    long imm_replayed;           // Same for heap.imm
+    int heap_version;            // Record format of heap.dat, HEAP_FILE_V1 for old logs
+    long compaction_threshold;
+    int bloom_bits_per_key;
+    int block_size;
+    int use_mmap;
+    int compression;
+    int verify_checksums;
+    BlockCache* block_cache;
+    int level0_file_trigger;
+    long level1_max_bytes;
+    int level_size_multiplier;
+    long target_file_size;
+    int max_subcompactions;
+    int compaction_style;
+    int tiered_min_merge_width;
+    int tiered_max_merge_width;
+    WALWriter* writers_head;     // Group commit queue; the head is the leader
+    WALWriter* writers_tail;
+    int wal_busy;                // A leader or the sync thread is using the log
+    int wal_dirty;               // Log has unsynced writes
+    int wal_sync_mode;
+    int wal_sync_interval_ms;
+    int wal_sync_running;
+    pthread_t wal_sync_thread;
+    pthread_cond_t writer_cond;  // Signalled when the queue or wal_busy changes
+    pthread_cond_t wal_sync_cond;
+    KVStoreStats stats;
     pthread_t compaction_thread;
-    int compaction_status;
+    int compaction_status;       // Flush claimed by kv_compact() with a compare-and-swap
+    int imm_flushing;            // A worker is writing imm out
+    int merging;                 // A worker is running merges; set and cleared under store_mutex
     pthread_mutex_t store_mutex;
 } KVStore;
 
-// Global KVStore instance
+// One key range [start, limit) of a compaction, merged on its own thread
+// into its own output tables. start and limit are NULL for the first and
+// last range.
+typedef struct {
+    KVStore* kvstore;
+    Version* version;       // Levels as of the compaction's start
+    SSTable** inputs;
+    int num_inputs;
+    int output_level;
+    long max_output_size;
+    const char* start;
+    int start_kLen;
+    const char* limit;
+    int limit_kLen;
+    SSTable** outputs;      // In key order
+    int num_outputs;
+    int outputs_cap;
+    int result;             // -1 if an output or input failed
+} Subcompaction;
+
+// Front-end over num_shards independent stores in one data directory
+// (see shard.h). Keys are routed by hash, so each shard has its own log,
+// memtable, SSTables and compaction thread.
+typedef struct {
+    char* data_directory;
+    int num_shards;
+    KVStore** shards;
+} ShardedStore;
+
+// Store API. Every operation takes the handle returned by kv_open(), so
+// one process can keep several stores open (one per data directory).
+// Puts and deletes return 0 once the write is logged, -1 if it was not.
+// Reads stop at a table that may hold a key but cannot be read rather
+// than fall back to older data: kv_get_pinned() and the multi_gets
+// return -1 (leaving every value NULL), kv_get() NULL.
+KVStoreOptions default_options();
+KVStore* kv_open(const char* data_directory, KVStoreOptions* options);
+int kv_put(KVStore* store, char* key, char* value);
+int kv_put_with_options(KVStore* store, char* key, char* value, WriteOptions* options);
+char* kv_get(KVStore* store, char* key);
+char* kv_debug_get(KVStore* store, char* key);
+int kv_get_pinned(KVStore* store, char* key, PinnedSlice* slice);
+void kv_pinned_release(PinnedSlice* slice);
+int kv_multi_get(KVStore* store, char** keys, int n, char** values);
+int kv_delete(KVStore* store, char* key);
+int kv_delete_with_options(KVStore* store, char* key, WriteOptions* options);
+int kv_write_batch(KVStore* store, WriteBatch* batch, WriteOptions* options);
+int kv_compact(KVStore* store);
+int kv_compaction_status(KVStore* store);
+void kv_get_stats(KVStore* store, KVStoreStats* stats);
+void kv_close(KVStore* store);
+
+// Length-delimited variants of the above for binary keys and values,
+// which may contain NUL bytes. kv_get_n() returns a copy the caller
+// frees (NUL-terminated for convenience) and stores its length in *vLen.
+// options may be NULL. Keys are limited to INT_MAX bytes: writes with a
+// longer key fail and reads find no key that long. Values have no such
+// limit, except while heap.dat is still a log in a format from before
+// HEAP_FILE_V3, which only takes values up to INT_MAX bytes until it is
+// flushed.
+int kv_put_n(KVStore* store, char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options);
+char* kv_get_n(KVStore* store, char* key, size_t kLen, size_t* vLen);
+char* kv_debug_get_n(KVStore* store, char* key, size_t kLen, size_t* vLen);
+int kv_get_pinned_n(KVStore* store, char* key, size_t kLen, PinnedSlice* slice);
+int kv_delete_n(KVStore* store, char* key, size_t kLen, WriteOptions* options);
+int kv_multi_get_n(KVStore* store, char** keys, const size_t* kLens, int n, char** values);
+
+// Write batches. kv_write_batch() logs a batch with one append and makes
+// all of it visible to readers at once; after a crash replay restores all
+// of it or none. Returns 0 on success, -1 if the log write failed.
+WriteBatch* write_batch_create();
+void write_batch_put(WriteBatch* batch, char* key, char* value);
+void write_batch_delete(WriteBatch* batch, char* key);
+int write_batch_put_n(WriteBatch* batch, char* key, size_t kLen, char* value, size_t vLen);
+int write_batch_delete_n(WriteBatch* batch, char* key, size_t kLen);
+int write_batch_count(WriteBatch* batch);
+void write_batch_clear(WriteBatch* batch);
+void write_batch_free(WriteBatch* batch);
+
+// Block codecs. Register custom codecs before opening a store whose
+// options.compression names them. Returns -1 if the id is taken or out
+// of range.
+int block_codec_register(BlockCodec* codec);
+
+// Range scans. Entries come back in key order with deleted keys hidden,
+// as of the moment the iterator was created. Free every iterator before
+// closing its store. A scan that stops at a table it cannot read ends
+// early with iterator_status() at -1.
+KVIterator* kv_iterator_create(KVStore* store);
+void iterator_seek_to_first(KVIterator* it);
+void iterator_seek(KVIterator* it, char* key);
+void iterator_seek_n(KVIterator* it, char* key, size_t kLen);
+int iterator_valid(KVIterator* it);
+int iterator_status(KVIterator* it);
+void iterator_next(KVIterator* it);
+const char* iterator_key(KVIterator* it);
+const char* iterator_value(KVIterator* it);
+int iterator_key_length(KVIterator* it);
+int64_t iterator_value_length(KVIterator* it);
+void iterator_free(KVIterator* it);
+
+// Sharded stores. num_shards is fixed when the directory is created; pass
+// 0 to reopen with the recorded count. Returns NULL if the directory was
+// created with a different count.
+ShardedStore* kv_sharded_open(const char* data_directory, int num_shards, KVStoreOptions* options);
+int kv_sharded_put(ShardedStore* store, char* key, char* value);
+int kv_sharded_put_with_options(ShardedStore* store, char* key, char* value, WriteOptions* options);
+char* kv_sharded_get(ShardedStore* store, char* key);
+int kv_sharded_get_pinned(ShardedStore* store, char* key, PinnedSlice* slice);
+int kv_sharded_put_n(ShardedStore* store, char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options);
+char* kv_sharded_get_n(ShardedStore* store, char* key, size_t kLen, size_t* vLen);
+int kv_sharded_delete_n(ShardedStore* store, char* key, size_t kLen, WriteOptions* options);
+int kv_sharded_multi_get(ShardedStore* store, char** keys, int n, char** values);
+int kv_sharded_multi_get_n(ShardedStore* store, char** keys, const size_t* kLens, int n, char** values);
+int kv_sharded_delete(ShardedStore* store, char* key);
+int kv_sharded_delete_with_options(ShardedStore* store, char* key, WriteOptions* options);
+int kv_sharded_compact(ShardedStore* store);
+int kv_sharded_compaction_status(ShardedStore* store);
+void kv_sharded_get_stats(ShardedStore* store, KVStoreStats* stats);
+KVIterator* kv_sharded_iterator_create(ShardedStore* store);
+void kv_sharded_close(ShardedStore* store);
+
+// Compatibility API over a single global store: init() opens it into
+// kvstore, cleanup() closes it, and the rest forward to the kv_ functions
 extern KVStore* kvstore;
 
-// Public API functions
 void init(char* data_directory);
-void put(char* key, char* value);
+void init_with_options(char* data_directory, KVStoreOptions* options);
+int put(char* key, char* value);
+int put_with_options(char* key, char* value, WriteOptions* options);
 char* get(char* key);
 char* debug_get(char* key);
-void delete(char* key);
-void compact();
+int get_pinned(char* key, PinnedSlice* slice);
+void pinned_release(PinnedSlice* slice);
+int put_n(char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options);
+char* get_n(char* key, size_t kLen, size_t* vLen);
+int get_pinned_n(char* key, size_t kLen, PinnedSlice* slice);
+int delete_n(char* key, size_t kLen, WriteOptions* options);
+int multi_get(char** keys, int n, char** values);
+int multi_get_n(char** keys, const size_t* kLens, int n, char** values);
+int delete(char* key);
+int delete_with_options(char* key, WriteOptions* options);
+int write_batch(WriteBatch* batch, WriteOptions* options);
+int compact();
 int getCompactionStatus();
-
-// Cleanup function
+void get_stats(KVStoreStats* stats);
+KVIterator* iterator_create();
 void cleanup();
 
 #endif // KVSTORE_H
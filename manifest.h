@@ -0,0 +1,284 @@
+#include "kvstore.h"
+#include <fcntl.h>
+
+// The MANIFEST records which SSTables make up the store. It is a log of
+// edits, each adding and removing tables; a table's entry holds its file
+// number, level, key range and the sequence number of the newest write
+// in it. Opening a store replays the log instead of listing the data
+// directory, so L0 comes back in write order and no file number still
+// on disk is handed out again.
+//
+// Flushes and compactions append one edit, synced, before the tables it
+// adds become visible and before the tables it removes are deleted, so a
+// crash at any point leaves the MANIFEST describing complete files. An
+// edit cut short by a crash is ignored. Every open rewrites the log as a
+// single edit listing the live tables.
+//
+// Each edit ends with how many bytes of heap.imm and of heap.dat are
+// already in tables (see replay_log()); the last edit's values hold. A
+// replay that writes a log out in runs logs each run with the offset it
+// reached, so replay after a crash resumes there instead of writing the
+// same runs again. Edits written before these offsets existed end after
+// their tables and count as 0, i.e. replay everything.
+
+// Append a table's entry to an edit body
+void manifest_encode_table(char** buf, size_t* len, size_t* cap, SSTable* sstable) {
+    int smallest_kLen = sstable->smallest_key ? sstable->smallest_kLen : 0;
+    int largest_kLen = sstable->largest_key ? sstable->largest_kLen : 0;
+    buffer_append(buf, len, cap, (char*) &sstable->file_number, sizeof(int));
+    buffer_append(buf, len, cap, (char*) &sstable->level, sizeof(int));
+    buffer_append(buf, len, cap, (char*) &sstable->sequence, sizeof(uint64_t));
+    buffer_append(buf, len, cap, (char*) &smallest_kLen, sizeof(int));
+    buffer_append(buf, len, cap, (char*) &largest_kLen, sizeof(int));
+    buffer_append(buf, len, cap, sstable->smallest_key, smallest_kLen);
+    buffer_append(buf, len, cap, sstable->largest_key, largest_kLen);
+}
+
+// Encode an edit, size prefix included
+char* manifest_encode_edit(KVStore* kvstore, SSTable** added, int num_added,
+                           SSTable** deleted, int num_deleted, size_t* size) {
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    uint32_t body_size = 0;
+    // A merge may be numbering its outputs without the mutex meanwhile
+    int next_file_number = __atomic_load_n(&kvstore->next_file_number, __ATOMIC_RELAXED);
+    buffer_append(&buf, &len, &cap, (char*) &body_size, sizeof(uint32_t));
+    buffer_append(&buf, &len, &cap, (char*) &next_file_number, sizeof(int));
+    buffer_append(&buf, &len, &cap, (char*) &num_deleted, sizeof(int));
+    buffer_append(&buf, &len, &cap, (char*) &num_added, sizeof(int));
+    for (int i = 0; i < num_deleted; i++) {
+        buffer_append(&buf, &len, &cap, (char*) &deleted[i]->file_number, sizeof(int));
+    }
+    for (int i = 0; i < num_added; i++) {
+        manifest_encode_table(&buf, &len, &cap, added[i]);
+    }
+    int64_t replayed[2] = {kvstore->imm_replayed, kvstore->heap_replayed};
+    buffer_append(&buf, &len, &cap, (char*) replayed, sizeof(replayed));
+    body_size = (uint32_t) (len - sizeof(uint32_t));
+    memcpy(buf, &body_size, sizeof(uint32_t));
+    *size = len;
+    return buf;
+}
+
+// Write and sync all of buf to fd
+int manifest_write_fully(int fd, const char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return fdatasync(fd);
+}
+
+// Sync the data directory so files created or renamed in it survive a crash
+int manifest_sync_directory(KVStore* kvstore) {
+    int dir_fd = open(kvstore->data_directory, O_RDONLY);
+    if (dir_fd < 0) return -1;
+    int result = fsync(dir_fd);
+    close(dir_fd);
+    return result;
+}
+
+// Durably log that added replace deleted. Called with the store mutex
+// held, before either change is made visible. Returns -1 (leaving the
+// log as it was) if the edit could not be written.
+int manifest_log_edit(KVStore* kvstore, SSTable** added, int num_added, SSTable** deleted, int num_deleted) {
+    if (kvstore->manifest_fd < 0) return -1;
+    
+    size_t size;
+    char* edit = manifest_encode_edit(kvstore, added, num_added, deleted, num_deleted, &size);
+    off_t start = lseek(kvstore->manifest_fd, 0, SEEK_END);
+    int result = manifest_write_fully(kvstore->manifest_fd, edit, size);
+    free(edit);
+    
+    // Never leave a partial edit in front of the next one
+    if (result != 0 && start >= 0 && ftruncate(kvstore->manifest_fd, start) != 0) {
+        perror("ftruncate manifest");
+    }
+    return result;
+}
+
+void manifest_table_free(ManifestTable* table) {
+    free(table->smallest_key);
+    free(table->largest_key);
+}
+
+// Read a key of kLen bytes at *p, advancing it. NULL for an empty key.
+char* manifest_read_key(const char** p, int kLen) {
+    if (kLen == 0) return NULL;
+    char* key = malloc(kLen + 1);
+    memcpy(key, *p, kLen);
+    key[kLen] = '\0';
+    *p += kLen;
+    return key;
+}
+
+// Apply one edit body to the table list. Returns -1 if it is malformed.
+int manifest_apply_edit(KVStore* kvstore, const char* body, uint32_t size,
+                        ManifestTable** tables, int* count, int* cap) {
+    const char* p = body;
+    const char* limit = body + size;
+    if (size < MANIFEST_EDIT_HEADER_SIZE) return -1;
+    
+    int next_file_number, num_deleted, num_added;
+    memcpy(&next_file_number, p, sizeof(int));
+    memcpy(&num_deleted, p + sizeof(int), sizeof(int));
+    memcpy(&num_added, p + 2 * sizeof(int), sizeof(int));
+    p += MANIFEST_EDIT_HEADER_SIZE;
+    if (num_deleted < 0 || num_added < 0 ||
+        (size_t) (limit - p) < (size_t) num_deleted * sizeof(int)) {
+        return -1;
+    }
+    
+    for (int d = 0; d < num_deleted; d++, p += sizeof(int)) {
+        int file_number;
+        memcpy(&file_number, p, sizeof(int));
+        for (int i = 0; i < *count; i++) {
+            if ((*tables)[i].file_number == file_number) {
+                manifest_table_free(&(*tables)[i]);
+                (*tables)[i] = (*tables)[--*count];
+                break;
+            }
+        }
+    }
+    
+    for (int a = 0; a < num_added; a++) {
+        if ((size_t) (limit - p) < MANIFEST_TABLE_HEADER_SIZE) return -1;
+        ManifestTable table;
+        memcpy(&table.file_number, p, sizeof(int));
+        memcpy(&table.level, p + sizeof(int), sizeof(int));
+        memcpy(&table.sequence, p + 2 * sizeof(int), sizeof(uint64_t));
+        memcpy(&table.smallest_kLen, p + 2 * sizeof(int) + sizeof(uint64_t), sizeof(int));
+        memcpy(&table.largest_kLen, p + 3 * sizeof(int) + sizeof(uint64_t), sizeof(int));
+        p += MANIFEST_TABLE_HEADER_SIZE;
+        if (table.level < 0 || table.level >= NUM_LEVELS ||
+            table.smallest_kLen < 0 || table.largest_kLen < 0 ||
+            (size_t) (limit - p) < (size_t) table.smallest_kLen + (size_t) table.largest_kLen) {
+            return -1;
+        }
+        table.smallest_key = manifest_read_key(&p, table.smallest_kLen);
+        table.largest_key = manifest_read_key(&p, table.largest_kLen);
+        
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *tables = realloc(*tables, *cap * sizeof(ManifestTable));
+        }
+        (*tables)[(*count)++] = table;
+    }
+    
+    int64_t replayed[2] = {0, 0};
+    if ((size_t) (limit - p) >= MANIFEST_EDIT_TRAILER_SIZE) {
+        memcpy(replayed, p, sizeof(replayed));
+    }
+    kvstore->imm_replayed = (long) replayed[0];
+    kvstore->heap_replayed = (long) replayed[1];
+    
+    if (next_file_number > kvstore->next_file_number) {
+        kvstore->next_file_number = next_file_number;
+    }
+    return 0;
+}
+
+// Open the tables listed in the MANIFEST. Returns -1 if the store has no
+// MANIFEST yet.
+int manifest_recover(KVStore* kvstore) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", kvstore->data_directory, MANIFEST_FILE_NAME);
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    
+    ManifestTable* tables = NULL;
+    int count = 0, cap = 0;
+    char* body = NULL;
+    uint32_t size;
+    while (fread(&size, sizeof(uint32_t), 1, file) == 1) {
+        body = realloc(body, size > 0 ? size : 1);
+        if (fread(body, 1, size, file) != size) break;
+        if (manifest_apply_edit(kvstore, body, size, &tables, &count, &cap) != 0) break;
+    }
+    free(body);
+    fclose(file);
+    
+    for (int i = 0; i < count; i++) {
+        ManifestTable* table = &tables[i];
+        SSTable* sstable = open_sstable_files(kvstore, table->file_number);
+        
+        // A missing or damaged table keeps its entry: dropping it would let
+        // older versions of its keys show through, and the snapshot written
+        // next would make that permanent. Reads in its range fail instead.
+        if (sstable->format == SSTABLE_FORMAT_UNREADABLE) {
+            fprintf(stderr, "SSTable %s listed in %s cannot be read\n", sstable->filename, MANIFEST_FILE_NAME);
+        }
+        
+        // The MANIFEST is authoritative for level and key range
+        sstable->level = table->level;
+        sstable->sequence = table->sequence;
+        sstable->smallest_key = table->smallest_key;
+        sstable->smallest_kLen = table->smallest_kLen;
+        sstable->largest_key = table->largest_key;
+        sstable->largest_kLen = table->largest_kLen;
+        if (!sstable->smallest_key || !sstable->largest_key) {
+            free(sstable->smallest_key);
+            free(sstable->largest_key);
+            sstable->smallest_key = NULL;
+            sstable->largest_key = NULL;
+        }
+        sstable->cache = kvstore->block_cache;
+        add_sstable_to_level(kvstore, sstable);
+        
+        if (table->sequence > kvstore->last_sequence) {
+            kvstore->last_sequence = table->sequence;
+        }
+        if (table->file_number >= kvstore->next_file_number) {
+            kvstore->next_file_number = table->file_number + 1;
+        }
+    }
+    free(tables);
+    return 0;
+}
+
+// Replace the MANIFEST with one edit listing every live table and keep it
+// open for appending. Called at open, before any other thread runs.
+int manifest_write_snapshot(KVStore* kvstore) {
+    char path[512];
+    char temp_path[512];
+    snprintf(path, sizeof(path), "%s/%s", kvstore->data_directory, MANIFEST_FILE_NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", kvstore->data_directory, MANIFEST_TEMP_FILE_NAME);
+    
+    int count = 0, cap = 16;
+    SSTable** tables = malloc(cap * sizeof(SSTable*));
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        for (SSTable* t = kvstore->levels[level]; t; t = t->next) {
+            if (count == cap) {
+                cap *= 2;
+                tables = realloc(tables, cap * sizeof(SSTable*));
+            }
+            tables[count++] = t;
+        }
+    }
+    
+    size_t size;
+    char* edit = manifest_encode_edit(kvstore, tables, count, NULL, 0, &size);
+    free(tables);
+    
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = fd >= 0 ? manifest_write_fully(fd, edit, size) : -1;
+    if (fd >= 0) close(fd);
+    free(edit);
+    if (result == 0) {
+        result = rename(temp_path, path);
+    }
+    
+    // Make the rename itself durable
+    if (result == 0) {
+        manifest_sync_directory(kvstore);
+    } else {
+        unlink(temp_path);
+    }
+    
+    // Edits may only follow a MANIFEST known to end in a complete edit;
+    // without one, flushes fail and the data stays in the logs
+    kvstore->manifest_fd = result == 0 ? open(path, O_WRONLY | O_APPEND) : -1;
+    return kvstore->manifest_fd >= 0 ? 0 : -1;
+}
@@ -0,0 +1,293 @@
+#include "kvstore.h"
+
+// Sorted in-memory table holding the latest record for every key written
+// to the current heap file. Implemented as a skiplist so that point reads
+// and writes cost O(log n) instead of a scan over index.dat.
+//
+// Readers search it without the store mutex while one writer inserts:
+// a node is filled in completely before a release store links it, and
+// readers follow links with acquire loads. Nodes are never modified or
+// freed while the memtable is alive, so an overwrite links a new node in
+// front of the key's older ones instead of replacing the value.
+//
+// Every record carries the sequence number of its write. The committing
+// writer publishes the group's last sequence only once all of it is
+// linked, and readers skip records newer than the sequence they started
+// with, so a write batch becomes visible all at once.
+
+// Pick a random tower height with p = 1/4 per level
+int memtable_random_height(Memtable* memtable) {
+    int height = 1;
+    while (height < MEMTABLE_MAX_HEIGHT) {
+        memtable->rand_state = memtable->rand_state * 1103515245 + 12345;
+        if (((memtable->rand_state >> 16) & 3) != 0) break;
+        height++;
+    }
+    return height;
+}
+
+// Nodes, keys and values all come from the memtable's arena and are only
+// freed, in one go, with the memtable. NULL if memory runs out.
+MemtableNode* memtable_new_node(Memtable* memtable, int height) {
+    MemtableNode* node = arena_alloc(&memtable->arena, sizeof(MemtableNode) + height * sizeof(MemtableNode*));
+    if (!node) return NULL;
+    node->key = NULL;
+    node->value = NULL;
+    node->kLen = 0;
+    node->vLen = -1;
+    node->seq = 0;
+    node->height = height;
+    for (int i = 0; i < height; i++) {
+        node->next[i] = NULL;
+    }
+    return node;
+}
+
+Memtable* memtable_create() {
+    Memtable* memtable = malloc(sizeof(Memtable));
+    arena_init(&memtable->arena);
+    memtable->head = memtable_new_node(memtable, MEMTABLE_MAX_HEIGHT);
+    memtable->empty_usage = memtable->arena.memory_usage - memtable->arena.remaining;
+    memtable->height = 1;
+    memtable->count = 0;
+    memtable->bytes = 0;
+    memtable->rand_state = 0x2545F491;
+    memtable->refs = 1;
+    return memtable;
+}
+
+// Find the first node whose key is >= key, filling prev[] with the
+// rightmost node before it on every level (if prev is not NULL)
+MemtableNode* memtable_find_greater_or_equal(Memtable* memtable, const char* key, int kLen,
+                                             MemtableNode** prev) {
+    MemtableNode* node = memtable->head;
+    int height = __atomic_load_n(&memtable->height, __ATOMIC_RELAXED);
+    for (int level = height - 1; level >= 0; level--) {
+        MemtableNode* next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+        while (next && compare_key_bytes(next->key, next->kLen, key, kLen) < 0) {
+            node = next;
+            next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+        }
+        if (prev) prev[level] = node;
+    }
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+// Insert or overwrite the record for key as write number seq, which must
+// exceed every seq inserted before. A NULL value stores a tombstone.
+// Returns -1, leaving the memtable as it was, if memory runs out.
+int memtable_put(Memtable* memtable, const char* key, int kLen, const char* value, int64_t vLen, uint64_t seq) {
+    MemtableNode* prev[MEMTABLE_MAX_HEIGHT];
+    MemtableNode* older = memtable_find_greater_or_equal(memtable, key, kLen, prev);
+    if (older && compare_key_bytes(older->key, older->kLen, key, kLen) != 0) older = NULL;
+
+    // Fill the node in before anything is linked, so a failed copy
+    // leaves nothing half inserted
+    int height = memtable_random_height(memtable);
+    MemtableNode* node = memtable_new_node(memtable, height);
+    if (!node) return -1;
+    node->kLen = kLen;
+    node->key = arena_copy(&memtable->arena, key, kLen);
+    node->vLen = value ? vLen : -1;
+    node->value = value ? arena_copy(&memtable->arena, value, node->vLen) : NULL;
+    node->seq = seq;
+    if (!node->key || (value && !node->value)) return -1;
+
+    if (height > memtable->height) {
+        for (int level = memtable->height; level < height; level++) {
+            prev[level] = memtable->head;
+        }
+        // A reader seeing the new height before the links finds NULL
+        // there and drops down a level
+        __atomic_store_n(&memtable->height, height, __ATOMIC_RELAXED);
+    }
+
+    // prev[] holds the nodes just before key's first (newest) node, so
+    // the new node goes in front of any older records of key
+    for (int level = 0; level < height; level++) {
+        node->next[level] = prev[level]->next[level];
+        __atomic_store_n(&prev[level]->next[level], node, __ATOMIC_RELEASE);
+    }
+
+    if (older) {
+        // Older records stay linked behind the new one until the memtable
+        // is freed; bytes counts only the latest record of each key
+        if (older->vLen > 0) memtable->bytes -= older->vLen;
+        if (node->vLen > 0) memtable->bytes += node->vLen;
+        return 0;
+    }
+    memtable->count++;
+    memtable->bytes += node->kLen + (node->vLen > 0 ? node->vLen : 0);
+    return 0;
+}
+
+// First record at or after node visible at sequence. Records of a key run
+// newest first, so this is the newest visible record of its key.
+MemtableNode* memtable_visible(MemtableNode* node, uint64_t sequence) {
+    while (node && node->seq > sequence) {
+        node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+    }
+    return node;
+}
+
+// Look up key as of sequence, returning its newest visible record
+// (possibly a tombstone) or NULL if absent
+MemtableNode* memtable_get(Memtable* memtable, const char* key, int kLen, uint64_t sequence) {
+    MemtableNode* node = memtable_find_greater_or_equal(memtable, key, kLen, NULL);
+    node = memtable_visible(node, sequence);
+    if (node && compare_key_bytes(node->key, node->kLen, key, kLen) == 0) {
+        return node;
+    }
+    return NULL;
+}
+
+// Newest visible record of the smallest key, or NULL if there is none
+MemtableNode* memtable_first(Memtable* memtable, uint64_t sequence) {
+    return memtable_visible(__atomic_load_n(&memtable->head->next[0], __ATOMIC_ACQUIRE), sequence);
+}
+
+// Newest visible record of the key after node's, skipping node's older
+// records
+MemtableNode* memtable_next_key(MemtableNode* node, uint64_t sequence) {
+    MemtableNode* next = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+    while (next && compare_key_bytes(next->key, next->kLen, node->key, node->kLen) == 0) {
+        next = __atomic_load_n(&next->next[0], __ATOMIC_ACQUIRE);
+    }
+    return memtable_visible(next, sequence);
+}
+
+// Copy the latest record of every key as of sequence, in key order, into
+// an array that stays valid after the memtable changes or is flushed.
+// Keys and values are copied into arena. Safe to call while a writer
+// inserts. Free the array, and the arena once done with the copies.
+DataRecord* memtable_snapshot(Memtable* memtable, uint64_t sequence, int* count, Arena* arena) {
+    int capacity = __atomic_load_n(&memtable->count, __ATOMIC_RELAXED) + 16;
+    DataRecord* records = malloc(capacity * sizeof(DataRecord));
+    int n = 0;
+    for (MemtableNode* node = memtable_first(memtable, sequence); node;
+         node = memtable_next_key(node, sequence)) {
+        if (n >= capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(DataRecord));
+        }
+        DataRecord* record = &records[n++];
+        record->kLen = node->kLen;
+        record->vLen = node->vLen;
+        record->key = arena_copy(arena, node->key, node->kLen);
+        record->value = node->value ? arena_copy(arena, node->value, node->vLen) : NULL;
+        record->position = 0;
+    }
+    *count = n;
+    return records;
+}
+
+// Free the memtable and every node; only once nothing else holds it
+void memtable_free(Memtable* memtable) {
+    if (!memtable) return;
+    arena_free(&memtable->arena);
+    free(memtable);
+}
+
+void memtable_ref(Memtable* memtable) {
+    __atomic_add_fetch(&memtable->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference, freeing the memtable with the last one
+void memtable_unref(Memtable* memtable) {
+    if (memtable && __atomic_sub_fetch(&memtable->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        memtable_free(memtable);
+    }
+}
+
+// Memory the memtable's records take, including superseded records,
+// skiplist nodes and space left at the ends of arena blocks, but not the
+// head every memtable starts with or the unused rest of the current
+// block. Replay and the write path both cut memtables at this.
+size_t memtable_memory_usage(Memtable* memtable) {
+    return memtable->arena.memory_usage - memtable->arena.remaining - memtable->empty_usage;
+}
+
+// Rebuild the memtable by replaying the records of the heap file from
+// offset start on (0 for the first record), numbering them from
+// *sequence on, and write an index entry for each to index_file unless it
+// is NULL. Returns the offset just past the last complete record or
+// batch; anything after it is a write torn by a crash or, in logs with
+// checksums, damaged.
+//
+// With limit > 0 replay stops at the first batch boundary once the
+// memtable holds limit bytes of memory and sets *full, so the caller can
+// write the memtable out and continue from the returned offset with a
+// fresh one.
+//
+// Each batch is decoded into one arena, recycled for the next batch, so
+// replay does no allocation per record beyond the memtable's own copy.
+long memtable_load_from_heap(Memtable* memtable, FILE* heap_file, long start, FILE* index_file,
+                             uint64_t* sequence, long limit, int* full) {
+    if (full) *full = 0;
+    if (!heap_file) return 0;
+
+    // Records are bounded by the size the log had when replay started
+    struct stat st;
+    if (fstat(fileno(heap_file), &st) != 0) return 0;
+    int64_t file_size = (int64_t) st.st_size;
+
+    Arena arena;
+    arena_init(&arena);
+    int version = heap_file_seek_to_first(heap_file);
+    if (start > file_size) start = (long) file_size;
+    if (start > 0) fseek(heap_file, start, SEEK_SET);
+    start = ftell(heap_file);
+    long end = start;
+    while (!feof(heap_file)) {
+        long pos = ftell(heap_file);
+        char raw[2 * sizeof(int64_t)];
+        int64_t header[2];
+        if (!read_heap_lengths(heap_file, version, raw, header)) break;
+
+        int count = 1;
+        if (header[0] == WAL_BATCH_MARKER) {
+            if (header[1] < 0 || header[1] > INT_MAX) break;
+            count = (int) header[1];
+            uint32_t stored;
+            if (version >= HEAP_FILE_V2 &&
+                (fread(&stored, sizeof(uint32_t), 1, heap_file) != 1 ||
+                 stored != crc32c_value(raw, 2 * heap_length_size(version)))) {
+                break;
+            }
+        } else {
+            fseek(heap_file, pos, SEEK_SET);
+        }
+
+        // Read all of a batch before applying any of it
+        arena_reset(&arena);
+        DataRecord** records = arena_alloc(&arena, (count > 0 ? count : 1) * sizeof(DataRecord*));
+        if (!records) break;
+        int n = 0;
+        while (n < count) {
+            DataRecord* record = read_record_from_file(heap_file, ftell(heap_file), file_size, version, &arena);
+            if (!record) break;
+            records[n++] = record;
+        }
+        if (n == count) {
+            for (int i = 0; i < n; i++) {
+                // The record stays in the log, so it is not lost
+                if (memtable_put(memtable, records[i]->key, records[i]->kLen,
+                                 records[i]->value, records[i]->vLen, ++*sequence) != 0) {
+                    fprintf(stderr, "Out of memory replaying the record at %lld\n",
+                            (long long) records[i]->position);
+                }
+                if (index_file) write_index_entry_to_file(index_file, records[i]);
+            }
+            end = ftell(heap_file);
+        }
+        if (n < count) break;
+        if (limit > 0 && memtable_memory_usage(memtable) >= (size_t) limit) {
+            if (full) *full = 1;
+            break;
+        }
+    }
+    arena_free(&arena);
+    fseek(heap_file, 0, SEEK_END);
+    if (index_file) fflush(index_file);
+    return end;
+}
@@ -0,0 +1,122 @@
+#include "kvstore.h"
+
+// K-way merge over a set of SSTables (and memtable snapshots) using a
+// binary min-heap of table iterators. Entries come out in key order; when
+// several children hold the same key, the one from the lowest child index
+// (the newest data) comes out first, so callers keep the first entry of
+// each key and skip the rest.
+
+// Heap order: smaller key first, then newer child first
+int merging_iter_less(MergingIter* merge, int a, int b) {
+    TableIter* x = &merge->children[a];
+    TableIter* y = &merge->children[b];
+    int cmp = compare_key_bytes(x->key, x->kLen, y->key, y->kLen);
+    if (cmp != 0) return cmp < 0;
+    return a < b;
+}
+
+void merging_iter_sift_down(MergingIter* merge, int pos) {
+    int* heap = merge->heap;
+    while (1) {
+        int smallest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < merge->heap_size && merging_iter_less(merge, heap[left], heap[smallest])) smallest = left;
+        if (right < merge->heap_size && merging_iter_less(merge, heap[right], heap[smallest])) smallest = right;
+        if (smallest == pos) return;
+        int tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+// Allocate num_children children for the caller to initialize, newest
+// data first
+void merging_iter_init(MergingIter* merge, int num_children) {
+    merge->num_children = num_children;
+    merge->children = calloc(num_children > 0 ? num_children : 1, sizeof(TableIter));
+    merge->heap = malloc((num_children > 0 ? num_children : 1) * sizeof(int));
+    merge->heap_size = 0;
+    merge->status = 0;
+}
+
+// Merge over tables; tables[0] must be the newest table
+void merging_iter_init_tables(MergingIter* merge, SSTable** tables, int num_tables) {
+    merging_iter_init(merge, num_tables);
+    for (int i = 0; i < num_tables; i++) {
+        table_iter_init(&merge->children[i], tables[i]);
+    }
+}
+
+// Rebuild the heap from every child that is positioned on an entry
+void merging_iter_build_heap(MergingIter* merge) {
+    merge->heap_size = 0;
+    for (int i = 0; i < merge->num_children; i++) {
+        if (merge->children[i].valid) {
+            merge->heap[merge->heap_size++] = i;
+        } else if (merge->children[i].status != 0) {
+            merge->status = -1;
+        }
+    }
+    for (int pos = merge->heap_size / 2 - 1; pos >= 0; pos--) {
+        merging_iter_sift_down(merge, pos);
+    }
+}
+
+int merging_iter_seek_to_first(MergingIter* merge) {
+    for (int i = 0; i < merge->num_children; i++) {
+        table_iter_seek_to_first(&merge->children[i]);
+    }
+    merging_iter_build_heap(merge);
+    return merge->heap_size > 0;
+}
+
+int merging_iter_seek(MergingIter* merge, const char* key, int kLen) {
+    for (int i = 0; i < merge->num_children; i++) {
+        table_iter_seek(&merge->children[i], key, kLen);
+    }
+    merging_iter_build_heap(merge);
+    return merge->heap_size > 0;
+}
+
+int merging_iter_valid(MergingIter* merge) {
+    return merge->heap_size > 0;
+}
+
+// Entry with the smallest key (newest version first)
+TableIter* merging_iter_current(MergingIter* merge) {
+    return &merge->children[merge->heap[0]];
+}
+
+int merging_iter_next(MergingIter* merge) {
+    if (merge->heap_size == 0) return 0;
+
+    TableIter* top = &merge->children[merge->heap[0]];
+    if (!table_iter_next(top)) {
+        if (top->status != 0) merge->status = -1;
+        merge->heap[0] = merge->heap[--merge->heap_size];
+    }
+    if (merge->heap_size > 0) {
+        merging_iter_sift_down(merge, 0);
+    }
+    return merge->heap_size > 0;
+}
+
+// -1 if any child stopped early because a block could not be read, in
+// which case the merge is missing entries
+int merging_iter_status(MergingIter* merge) {
+    return merge->status;
+}
+
+void merging_iter_free(MergingIter* merge) {
+    for (int i = 0; i < merge->num_children; i++) {
+        table_iter_free(&merge->children[i]);
+    }
+    free(merge->children);
+    free(merge->heap);
+    merge->children = NULL;
+    merge->heap = NULL;
+    merge->num_children = 0;
+    merge->heap_size = 0;
+}
@@ -0,0 +1,206 @@
+#include "kvstore.h"
+
+// Batched point lookups. A batch reads one version: keys found in the
+// memtables are resolved first, then the rest are sorted and every SSTable
+// is probed once, newest first, with all keys still unresolved at that
+// point. Within a block-based table the keys map to data blocks in file
+// order; runs of adjacent blocks are fetched together (see
+// sstable_read_blocks()) and each block is searched for all of its keys.
+
+int compare_multi_get_keys(const void* a, const void* b) {
+    const MultiGetKey* x = a;
+    const MultiGetKey* y = b;
+    return compare_key_bytes(x->key, x->kLen, y->key, y->kLen);
+}
+
+// Index of the first data block whose last key is >= key, or block_count
+int find_data_block(SSTable* sstable, const char* key, int kLen) {
+    int lo = 0;
+    int hi = sstable->block_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        TableBlockHandle* block = &sstable->blocks[mid];
+        if (compare_key_bytes(block->last_key, block->kLen, key, kLen) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Search one block for a key, copying its value out on a hit. Returns -1
+// if the block could not be decoded.
+int multi_get_search_block(BlockContents* contents, MultiGetKey* key, char** value) {
+    BlockIter iter;
+    if (block_iter_init(&iter, contents->data, contents->size) != 0) return -1;
+
+    int found = 0;
+    if (block_iter_seek(&iter, key->key, key->kLen) &&
+        compare_key_bytes(iter.key, iter.kLen, key->key, key->kLen) == 0) {
+        found = 1;
+        if (iter.vLen >= 0) {
+            *value = copy_bytes(iter.value, iter.vLen);
+        }
+    }
+    block_iter_free(&iter);
+    return found;
+}
+
+// Probe one table for the sorted keys that are not done yet, marking the
+// ones it holds as done with their value in values[]. Returns -1 if a
+// record or block a key may be in could not be read.
+int multi_get_table(KVStore* kvstore, SSTable* sstable, MultiGetKey* keys, int n, char** values) {
+    int status = 0;
+    int* candidates = malloc((n > 0 ? n : 1) * sizeof(int));
+    int num_candidates = 0;
+    for (int i = 0; i < n; i++) {
+        if (keys[i].done || !sstable_contains_key(sstable, keys[i].key, keys[i].kLen)) continue;
+        if (!sstable_may_contain(kvstore, sstable, keys[i].key, keys[i].kLen)) continue;
+        candidates[num_candidates++] = i;
+    }
+
+    if (sstable->format != SSTABLE_FORMAT_BLOCK) {
+        for (int c = 0; c < num_candidates && status == 0; c++) {
+            MultiGetKey* key = &keys[candidates[c]];
+            int found = search_sstable(sstable, key->key, key->kLen, &values[key->index]);
+            if (found < 0) {
+                status = -1;
+            } else {
+                key->done = found;
+            }
+        }
+    } else {
+        // Keys are sorted, so their blocks come out in file offset order
+        for (int c = 0; c < num_candidates; c++) {
+            MultiGetKey* key = &keys[candidates[c]];
+            key->block = find_data_block(sstable, key->key, key->kLen);
+        }
+
+        int c = 0;
+        while (status == 0 && c < num_candidates && keys[candidates[c]].block < sstable->block_count) {
+            // Gather the keys of a run of adjacent blocks
+            int first = keys[candidates[c]].block;
+            int last = first;
+            int end = c + 1;
+            while (end < num_candidates) {
+                int block = keys[candidates[end]].block;
+                if (block >= sstable->block_count || block > last + 1) break;
+                last = block;
+                end++;
+            }
+
+            int count = last - first + 1;
+            BlockContents* contents = malloc(count * sizeof(BlockContents));
+            int reads = 0;
+            if (sstable_read_blocks(sstable, first, count, contents, &reads) == 0) {
+                for (int k = c; k < end; k++) {
+                    MultiGetKey* key = &keys[candidates[k]];
+                    int found = multi_get_search_block(&contents[key->block - first], key, &values[key->index]);
+                    if (found < 0) {
+                        status = -1;
+                    } else {
+                        key->done = found;
+                    }
+                }
+                for (int b = 0; b < count; b++) {
+                    sstable_release_block(sstable, &contents[b]);
+                }
+            } else {
+                status = -1;
+            }
+            if (reads > 0) {
+                __atomic_add_fetch(&kvstore->stats.multi_get_blocks, count, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&kvstore->stats.multi_get_reads, reads, __ATOMIC_RELAXED);
+            }
+            free(contents);
+            c = end;
+        }
+    }
+
+    if (sstable->bloom && status == 0) {
+        for (int c = 0; c < num_candidates; c++) {
+            if (!keys[candidates[c]].done) {
+                __atomic_add_fetch(&kvstore->stats.bloom_false_positives, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(candidates);
+    return status;
+}
+
+// Look up n keys of kLens[i] bytes at once, storing a copy of each value
+// (NULL if absent or deleted) in values[]. Like get(), never takes the
+// store mutex. Returns 0, or -1 with every value NULL if a table that may
+// hold one of the keys could not be read. Keys over INT_MAX bytes are
+// never found.
+int kv_multi_get_n(KVStore* kvstore, char** keys, const size_t* kLens, int n, char** values) {
+    for (int i = 0; i < n; i++) {
+        values[i] = NULL;
+    }
+    if (!kvstore || n <= 0) return 0;
+
+    Version* version = version_acquire(kvstore);
+    uint64_t sequence = __atomic_load_n(&kvstore->last_sequence, __ATOMIC_ACQUIRE);
+    MultiGetKey* pending = malloc(n * sizeof(MultiGetKey));
+    int num_pending = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (kLens[i] > INT_MAX) continue;
+        int kLen = (int) kLens[i];
+        MemtableNode* node = memtable_get(version->memtable, keys[i], kLen, sequence);
+        if (!node && version->imm) {
+            node = memtable_get(version->imm, keys[i], kLen, sequence);
+        }
+        if (node) {
+            if (node->vLen >= 0) {
+                values[i] = copy_bytes(node->value ? node->value : "", node->vLen);
+            }
+            continue;
+        }
+        MultiGetKey* key = &pending[num_pending++];
+        key->key = keys[i];
+        key->kLen = kLen;
+        key->index = i;
+        key->block = -1;
+        key->done = 0;
+    }
+    qsort(pending, num_pending, sizeof(MultiGetKey), compare_multi_get_keys);
+
+    // Newest tables first; drop resolved keys after each table so deeper
+    // tables only see what is still missing. A table that cannot be read
+    // ends the lookup, as older tables could only return stale values.
+    int status = 0;
+    for (int level = 0; level < NUM_LEVELS && num_pending > 0 && status == 0; level++) {
+        for (int i = 0; i < version->num_files[level] && num_pending > 0 && status == 0; i++) {
+            status = multi_get_table(kvstore, version->files[level][i], pending, num_pending, values);
+
+            int kept = 0;
+            for (int k = 0; k < num_pending; k++) {
+                if (!pending[k].done) pending[kept++] = pending[k];
+            }
+            num_pending = kept;
+        }
+    }
+
+    free(pending);
+    version_unref(version);
+    if (status != 0) {
+        for (int i = 0; i < n; i++) {
+            free(values[i]);
+            values[i] = NULL;
+        }
+    }
+    return status;
+}
+
+int kv_multi_get(KVStore* kvstore, char** keys, int n, char** values) {
+    if (n <= 0) return 0;
+    size_t* kLens = malloc(n * sizeof(size_t));
+    for (int i = 0; i < n; i++) {
+        kLens[i] = strlen(keys[i]);
+    }
+    int status = kv_multi_get_n(kvstore, keys, kLens, n, values);
+    free(kLens);
+    return status;
+}
@@ -0,0 +1,313 @@
+#include "kvstore.h"
+
+// Hash-sharded store: num_shards independent stores under one data
+// directory (shard_000/, shard_001/, ...), with the shard count recorded
+// in SHARDS. Every key lives in exactly one shard, picked by hashing it,
+// so writes, flushes and compactions of different shards run in parallel
+// and point operations touch a single shard. Scans merge one iterator
+// per shard; shards hold disjoint keys, so the merge never has to pick
+// between versions of a key.
+
+// 32-bit FNV-1a over the key bytes. Deliberately not bloom_hash(): every
+// key of a shard would share its residue modulo num_shards, which would
+// skew the probe bits of that shard's Bloom filters.
+uint32_t shard_hash(const char* key, int kLen) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < kLen; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+KVStore* shard_for_key_n(ShardedStore* store, const char* key, int kLen) {
+    return store->shards[shard_hash(key, kLen) % (uint32_t) store->num_shards];
+}
+
+KVStore* shard_for_key(ShardedStore* store, const char* key) {
+    return shard_for_key_n(store, key, (int) strlen(key));
+}
+
+// Read the shard count recorded in the directory, or 0 if there is none
+int read_shard_count(const char* data_directory) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", data_directory, SHARD_COUNT_FILE_NAME);
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+
+    int count = 0;
+    if (fscanf(file, "%d", &count) != 1 || count < 0) count = 0;
+    fclose(file);
+    return count;
+}
+
+// Durably record the shard count. It is written to a temporary file and
+// renamed into place, so a crash never leaves an empty or partial SHARDS
+// behind that a reopen would take for a different count.
+int write_shard_count(const char* data_directory, int num_shards) {
+    char path[512];
+    char temp_path[512];
+    snprintf(path, sizeof(path), "%s/%s", data_directory, SHARD_COUNT_FILE_NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.tmp", data_directory, SHARD_COUNT_FILE_NAME);
+    FILE* file = fopen(temp_path, "w");
+    if (!file) return -1;
+
+    int result = fprintf(file, "%d\n", num_shards) > 0 && fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    if (fclose(file) != 0) result = -1;
+    if (result == 0) result = rename(temp_path, path);
+    if (result != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+
+    // Make the rename itself durable
+    int dir_fd = open(data_directory, O_RDONLY);
+    if (dir_fd < 0) return -1;
+    result = fsync(dir_fd);
+    close(dir_fd);
+    return result;
+}
+
+// Open a sharded store. Each shard gets options, except that the block
+// cache budget is split between the shards.
+ShardedStore* kv_sharded_open(const char* data_directory, int num_shards, KVStoreOptions* options) {
+    KVStoreOptions shard_options = options ? *options : default_options();
+    mkdir(data_directory, 0755);
+
+    int recorded = read_shard_count(data_directory);
+    if (num_shards <= 0) num_shards = recorded;
+    if (num_shards <= 0) {
+        fprintf(stderr, "No shard count given for new sharded store %s\n", data_directory);
+        return NULL;
+    }
+    if (recorded > 0 && recorded != num_shards) {
+        fprintf(stderr, "Sharded store %s has %d shards, not %d\n", data_directory, recorded, num_shards);
+        return NULL;
+    }
+    if (recorded == 0 && write_shard_count(data_directory, num_shards) != 0) {
+        perror("write shard count");
+        return NULL;
+    }
+    shard_options.block_cache_size /= (size_t) num_shards;
+
+    ShardedStore* store = malloc(sizeof(ShardedStore));
+    store->data_directory = strdup(data_directory);
+    store->num_shards = num_shards;
+    store->shards = malloc(num_shards * sizeof(KVStore*));
+    for (int i = 0; i < num_shards; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s%03d", data_directory, SHARD_DIR_PREFIX, i);
+        store->shards[i] = kv_open(path, &shard_options);
+    }
+    return store;
+}
+
+int kv_sharded_put(ShardedStore* store, char* key, char* value) {
+    return kv_put(shard_for_key(store, key), key, value);
+}
+
+int kv_sharded_put_with_options(ShardedStore* store, char* key, char* value, WriteOptions* options) {
+    return kv_put_with_options(shard_for_key(store, key), key, value, options);
+}
+
+char* kv_sharded_get(ShardedStore* store, char* key) {
+    return kv_get(shard_for_key(store, key), key);
+}
+
+int kv_sharded_get_pinned(ShardedStore* store, char* key, PinnedSlice* slice) {
+    return kv_get_pinned(shard_for_key(store, key), key, slice);
+}
+
+int kv_sharded_put_n(ShardedStore* store, char* key, size_t kLen, char* value, size_t vLen, WriteOptions* options) {
+    if (kLen > INT_MAX) return -1;
+    return kv_put_n(shard_for_key_n(store, key, (int) kLen), key, kLen, value, vLen, options);
+}
+
+char* kv_sharded_get_n(ShardedStore* store, char* key, size_t kLen, size_t* vLen) {
+    if (kLen > INT_MAX) return NULL;
+    return kv_get_n(shard_for_key_n(store, key, (int) kLen), key, kLen, vLen);
+}
+
+int kv_sharded_delete_n(ShardedStore* store, char* key, size_t kLen, WriteOptions* options) {
+    if (kLen > INT_MAX) return -1;
+    return kv_delete_n(shard_for_key_n(store, key, (int) kLen), key, kLen, options);
+}
+
+// Split the batch by shard and run one multi_get per shard. Each key is
+// hashed once; a counting pass then groups the keys of every shard into
+// one contiguous run. Fails as a whole if any shard does.
+int kv_sharded_multi_get_n(ShardedStore* store, char** keys, const size_t* kLens, int n, char** values) {
+    if (n <= 0) return 0;
+    int* shard_of = malloc(n * sizeof(int));
+    int* starts = calloc(store->num_shards + 1, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        // No shard holds a key over INT_MAX bytes; the first one reports
+        // it missing
+        shard_of[i] = kLens[i] > INT_MAX ? 0 :
+                      (int) (shard_hash(keys[i], (int) kLens[i]) % (uint32_t) store->num_shards);
+        starts[shard_of[i] + 1]++;
+    }
+    for (int shard = 0; shard < store->num_shards; shard++) {
+        starts[shard + 1] += starts[shard];
+    }
+
+    char** shard_keys = malloc(n * sizeof(char*));
+    size_t* shard_kLens = malloc(n * sizeof(size_t));
+    char** shard_values = malloc(n * sizeof(char*));
+    int* positions = malloc(n * sizeof(int));
+    int* next = malloc(store->num_shards * sizeof(int));
+    memcpy(next, starts, store->num_shards * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int slot = next[shard_of[i]]++;
+        shard_keys[slot] = keys[i];
+        shard_kLens[slot] = kLens[i];
+        positions[slot] = i;
+    }
+
+    int status = 0;
+    for (int shard = 0; shard < store->num_shards; shard++) {
+        int first = starts[shard];
+        int count = starts[shard + 1] - first;
+        if (count == 0) continue;
+        if (kv_multi_get_n(store->shards[shard], shard_keys + first, shard_kLens + first, count,
+                           shard_values + first) != 0) {
+            status = -1;
+        }
+        for (int i = first; i < first + count; i++) {
+            values[positions[i]] = shard_values[i];
+        }
+    }
+    if (status != 0) {
+        for (int i = 0; i < n; i++) {
+            free(values[i]);
+            values[i] = NULL;
+        }
+    }
+    free(shard_of);
+    free(starts);
+    free(shard_keys);
+    free(shard_kLens);
+    free(shard_values);
+    free(positions);
+    free(next);
+    return status;
+}
+
+int kv_sharded_multi_get(ShardedStore* store, char** keys, int n, char** values) {
+    if (n <= 0) return 0;
+    size_t* kLens = malloc(n * sizeof(size_t));
+    for (int i = 0; i < n; i++) {
+        kLens[i] = strlen(keys[i]);
+    }
+    int status = kv_sharded_multi_get_n(store, keys, kLens, n, values);
+    free(kLens);
+    return status;
+}
+
+int kv_sharded_delete(ShardedStore* store, char* key) {
+    return kv_delete(shard_for_key(store, key), key);
+}
+
+int kv_sharded_delete_with_options(ShardedStore* store, char* key, WriteOptions* options) {
+    return kv_delete_with_options(shard_for_key(store, key), key, options);
+}
+
+// Start a flush in every shard; each runs on its own thread. Returns -1
+// if any shard's could not be started.
+int kv_sharded_compact(ShardedStore* store) {
+    int result = 0;
+    for (int i = 0; i < store->num_shards; i++) {
+        if (kv_compact(store->shards[i]) != 0) result = -1;
+    }
+    return result;
+}
+
+// COMPACTION_STARTED while any shard is still compacting
+int kv_sharded_compaction_status(ShardedStore* store) {
+    for (int i = 0; i < store->num_shards; i++) {
+        if (kv_compaction_status(store->shards[i]) == COMPACTION_STARTED) return COMPACTION_STARTED;
+    }
+    return COMPACTION_COMPLETED;
+}
+
+// Add the counters of stats to total
+void kv_stats_add(KVStoreStats* total, KVStoreStats* stats) {
+    total->bloom_negatives += stats->bloom_negatives;
+    total->bloom_positives += stats->bloom_positives;
+    total->bloom_false_positives += stats->bloom_false_positives;
+    total->block_cache_hits += stats->block_cache_hits;
+    total->block_cache_misses += stats->block_cache_misses;
+    total->block_cache_evictions += stats->block_cache_evictions;
+    total->block_cache_usage += stats->block_cache_usage;
+    total->flushes += stats->flushes;
+    total->compactions += stats->compactions;
+    total->subcompactions += stats->subcompactions;
+    total->user_bytes_written += stats->user_bytes_written;
+    total->flush_bytes_written += stats->flush_bytes_written;
+    total->compaction_bytes_read += stats->compaction_bytes_read;
+    total->compaction_bytes_written += stats->compaction_bytes_written;
+    total->wal_records += stats->wal_records;
+    total->wal_batches += stats->wal_batches;
+    total->wal_syncs += stats->wal_syncs;
+    total->multi_get_blocks += stats->multi_get_blocks;
+    total->multi_get_reads += stats->multi_get_reads;
+    total->checksum_failures += stats->checksum_failures;
+    total->replay_runs += stats->replay_runs;
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        total->level_files[level] += stats->level_files[level];
+        total->level_bytes[level] += stats->level_bytes[level];
+        total->level_raw_bytes[level] += stats->level_raw_bytes[level];
+    }
+}
+
+// Counters summed over every shard
+void kv_sharded_get_stats(ShardedStore* store, KVStoreStats* stats) {
+    memset(stats, 0, sizeof(KVStoreStats));
+    for (int i = 0; i < store->num_shards; i++) {
+        KVStoreStats shard_stats;
+        kv_get_stats(store->shards[i], &shard_stats);
+        kv_stats_add(stats, &shard_stats);
+    }
+}
+
+// Iterator merging a snapshot iterator of every shard. Used through the
+// iterator_* functions like any other iterator.
+KVIterator* kv_sharded_iterator_create(ShardedStore* store) {
+    KVIterator* it = calloc(1, sizeof(KVIterator));
+    it->shard_iters = malloc(store->num_shards * sizeof(KVIterator*));
+    it->num_shard_iters = store->num_shards;
+    it->current_shard = -1;
+    for (int i = 0; i < store->num_shards; i++) {
+        it->shard_iters[i] = kv_iterator_create(store->shards[i]);
+    }
+    return it;
+}
+
+// Point current_shard at the shard iterator with the smallest key. A
+// shard that stopped on a read error ends the whole scan.
+void sharded_iterator_pick(KVIterator* it) {
+    it->current_shard = -1;
+    for (int i = 0; i < it->num_shard_iters; i++) {
+        if (iterator_status(it->shard_iters[i]) != 0) return;
+    }
+    for (int i = 0; i < it->num_shard_iters; i++) {
+        KVIterator* child = it->shard_iters[i];
+        if (!iterator_valid(child)) continue;
+        if (it->current_shard < 0 ||
+            compare_key_bytes(iterator_key(child), iterator_key_length(child),
+                              iterator_key(it->shard_iters[it->current_shard]),
+                              iterator_key_length(it->shard_iters[it->current_shard])) < 0) {
+            it->current_shard = i;
+        }
+    }
+}
+
+void kv_sharded_close(ShardedStore* store) {
+    if (!store) return;
+    for (int i = 0; i < store->num_shards; i++) {
+        kv_close(store->shards[i]);
+    }
+    free(store->shards);
+    free(store->data_directory);
+    free(store);
+}
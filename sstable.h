@@ -1,72 +1,1206 @@
 #include "kvstore.h"
 #include <sys/stat.h>
 #include <sys/types.h>
-// Load existing SSTables
+#include <sys/mman.h>
+#include <fcntl.h>
 
+// Load the SSTable's index file into a sorted in-memory array. Flat tables
+// have one entry per key in key order, in the version 1 index layout with
+// 32-bit positions, so lookups can binary search it instead of rescanning
+// the file on every probe.
+int load_sstable_index(SSTable* sstable) {
+    FILE* idx_file = fopen(sstable->index_filename, "rb");
+    if (!idx_file) return -1;
+    
+    fseek(idx_file, 0, SEEK_END);
+    long size = ftell(idx_file);
+    fseek(idx_file, 0, SEEK_SET);
+    
+    char* buffer = malloc(size > 0 ? size : 1);
+    if (fread(buffer, 1, (size_t) size, idx_file) != (size_t) size) {
+        free(buffer);
+        fclose(idx_file);
+        return -1;
+    }
+    fclose(idx_file);
+    
+    // Every entry carries an 8 byte header, so NUL-terminated keys
+    // always fit in a buffer the size of the file
+    int capacity = 64;
+    DataEntry* index = malloc(capacity * sizeof(DataEntry));
+    char* keys = malloc(size > 0 ? size : 1);
+    int count = 0;
+    long offset = 0;
+    long key_offset = 0;
+    
+    while (offset + 2 * (long) sizeof(int) <= size) {
+        int kLen, vPos;
+        memcpy(&kLen, buffer + offset, sizeof(int));
+        memcpy(&vPos, buffer + offset + sizeof(int), sizeof(int));
+        offset += 2 * sizeof(int);
+        if (kLen < 0 || offset + kLen > size) break;
+        
+        if (count >= capacity) {
+            capacity *= 2;
+            index = realloc(index, capacity * sizeof(DataEntry));
+        }
+        
+        memcpy(keys + key_offset, buffer + offset, kLen);
+        keys[key_offset + kLen] = '\0';
+        index[count].kLen = kLen;
+        index[count].position = vPos;
+        index[count].key = keys + key_offset;
+        count++;
+        
+        key_offset += kLen + 1;
+        offset += kLen;
+    }
+    free(buffer);
+    
+    sstable->index = index;
+    sstable->index_keys = keys;
+    sstable->record_count = count;
+    return 0;
+}
+
+// Open the SSTable's data file for the lifetime of the table. SSTables
+// are immutable once written, so with use_mmap the file is mapped and
+// lookups decode straight from the mapping without per-probe syscalls;
+// otherwise the descriptor stays open for pread() through the block cache.
+int open_sstable_data(SSTable* sstable, int use_mmap) {
+    sstable->data_map = NULL;
+    sstable->data_size = 0;
+    sstable->fd = -1;
+    
+    int fd = open(sstable->filename, O_RDONLY);
+    if (fd < 0) return -1;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    sstable->data_size = (size_t) st.st_size;
+    
+    if (use_mmap) {
+        void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            sstable->data_map = map;
+            close(fd);
+            return 0;
+        }
+    }
+    sstable->fd = fd;
+    return 0;
+}
+
+// Read size bytes at offset into a fresh buffer
+char* sstable_pread(SSTable* sstable, uint64_t offset, size_t size) {
+    char* buf = malloc(size > 0 ? size : 1);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(sstable->fd, buf + done, size - done, (off_t) (offset + done));
+        if (n <= 0) {
+            free(buf);
+            return NULL;
+        }
+        done += (size_t) n;
+    }
+    return buf;
+}
+
+// Does the stored block end in a CRC32C of the bytes before it?
+int block_checksum_matches(const char* raw, size_t size) {
+    uint32_t stored;
+    memcpy(&stored, raw + size - BLOCK_CHECKSUM_SIZE, BLOCK_CHECKSUM_SIZE);
+    return crc32c_value(raw, size - BLOCK_CHECKSUM_SIZE) == stored;
+}
+
+// Turn the stored bytes of a block into its contents: checked against its
+// CRC and decoded when the table has block trailers, then pinned in the
+// block cache if there is one or kept by block. buf is a malloc'd copy of
+// raw, or NULL when raw points into the mapping (which is borrowed when
+// it needs no decoding); buf is consumed either way. A block failing its
+// checksum is reported and counted, and returns -1.
+int sstable_finish_block(SSTable* sstable, uint64_t offset, const char* raw, size_t size, char* buf,
+                         BlockContents* block) {
+    if (sstable->block_checksums) {
+        if (size <= BLOCK_CHECKSUM_SIZE ||
+            (sstable->verify_checksums && !block_checksum_matches(raw, size))) {
+            fprintf(stderr, "Checksum mismatch in %s, block at offset %llu\n",
+                    sstable->filename, (unsigned long long) offset);
+            if (sstable->checksum_failures) {
+                __atomic_add_fetch(sstable->checksum_failures, 1, __ATOMIC_RELAXED);
+            }
+            free(buf);
+            return -1;
+        }
+        size -= BLOCK_CHECKSUM_SIZE;
+    }
+    
+    const char* data = raw;
+    size_t data_size = size;
+    char* owned = buf;
+    if (sstable->block_trailers) {
+        char* decoded;
+        if (block_decode(raw, size, &data, &data_size, &decoded) != 0) {
+            free(buf);
+            return -1;
+        }
+        if (decoded) {
+            free(buf);
+            owned = decoded;
+        }
+    }
+    
+    if (!owned) {
+        block->data = data;
+        block->size = data_size;
+    } else if (sstable->cache) {
+        CacheEntry* entry = block_cache_insert(sstable->cache, sstable->id, offset, owned, data_size);
+        block->data = entry->data;
+        block->size = entry->size;
+        block->cache_entry = entry;
+    } else {
+        block->owned = owned;
+        block->data = owned;
+        block->size = data_size;
+    }
+    return 0;
+}
+
+// Fetch the block stored at [offset, offset + size): borrowed from the
+// mapping when the table is mapped and the block is not compressed,
+// otherwise from the block cache with a pread() and decode on a miss.
+// Cached blocks are held decoded. Release the result with
+// sstable_release_block().
+int sstable_read_block(SSTable* sstable, uint64_t offset, uint64_t size, BlockContents* block) {
+    memset(block, 0, sizeof(BlockContents));
+    if (offset + size > sstable->data_size) return -1;
+    
+    const char* mapped = sstable->data_map ? sstable->data_map + offset : NULL;
+    size_t checksum = sstable->block_checksums ? BLOCK_CHECKSUM_SIZE : 0;
+    if (mapped && (!sstable->block_trailers ||
+                   (size > checksum && mapped[size - checksum - 1] == COMPRESSION_NONE))) {
+        return sstable_finish_block(sstable, offset, mapped, size, NULL, block);
+    }
+    if (!mapped && sstable->fd < 0) return -1;
+    
+    if (sstable->cache) {
+        CacheEntry* entry = block_cache_lookup(sstable->cache, sstable->id, offset);
+        if (entry) {
+            block->data = entry->data;
+            block->size = entry->size;
+            block->cache_entry = entry;
+            return 0;
+        }
+    }
+    if (mapped) {
+        return sstable_finish_block(sstable, offset, mapped, size, NULL, block);
+    }
+    
+    char* buf = sstable_pread(sstable, offset, size);
+    if (!buf) return -1;
+    return sstable_finish_block(sstable, offset, buf, size, buf, block);
+}
+
+void sstable_release_block(SSTable* sstable, BlockContents* block) {
+    if (block->cache_entry) {
+        block_cache_release(sstable->cache, block->cache_entry);
+    }
+    free(block->owned);
+    memset(block, 0, sizeof(BlockContents));
+}
+
+// Fetch count adjacent data blocks, starting at block first, into
+// blocks[]. Mapped tables borrow from the mapping. Otherwise cached blocks
+// are pinned and every run of missing blocks (up to
+// MULTI_GET_MAX_READ_BYTES) is fetched with a single pread() and split
+// into one buffer per block, each decoded and inserted into the cache if
+// there is one.
+// *num_reads counts the pread() calls. Release each block with
+// sstable_release_block().
+int sstable_read_blocks(SSTable* sstable, int first, int count, BlockContents* blocks, int* num_reads) {
+    memset(blocks, 0, count * sizeof(BlockContents));
+    int status = 0;
+    
+    if (sstable->data_map || sstable->fd < 0) {
+        for (int i = 0; i < count && status == 0; i++) {
+            TableBlockHandle* handle = &sstable->blocks[first + i];
+            status = sstable_read_block(sstable, handle->offset, handle->size, &blocks[i]);
+        }
+    } else {
+        if (sstable->cache) {
+            for (int i = 0; i < count; i++) {
+                TableBlockHandle* handle = &sstable->blocks[first + i];
+                CacheEntry* entry = block_cache_lookup(sstable->cache, sstable->id, handle->offset);
+                if (entry) {
+                    blocks[i].data = entry->data;
+                    blocks[i].size = entry->size;
+                    blocks[i].cache_entry = entry;
+                }
+            }
+        }
+        
+        int i = 0;
+        while (i < count && status == 0) {
+            if (blocks[i].data) {
+                i++;
+                continue;
+            }
+            uint64_t start = sstable->blocks[first + i].offset;
+            int end = i + 1;
+            while (end < count && !blocks[end].data) {
+                TableBlockHandle* next = &sstable->blocks[first + end];
+                if (next->offset + next->size - start > MULTI_GET_MAX_READ_BYTES) break;
+                end++;
+            }
+            TableBlockHandle* last = &sstable->blocks[first + end - 1];
+            if (last->offset + last->size > sstable->data_size) {
+                status = -1;
+                break;
+            }
+            
+            char* run = sstable_pread(sstable, start, last->offset + last->size - start);
+            (*num_reads)++;
+            if (!run) {
+                status = -1;
+                break;
+            }
+            for (int k = i; k < end; k++) {
+                TableBlockHandle* handle = &sstable->blocks[first + k];
+                char* data = run;
+                if (end - i > 1) {
+                    data = malloc(handle->size > 0 ? handle->size : 1);
+                    memcpy(data, run + (handle->offset - start), handle->size);
+                }
+                if (sstable_finish_block(sstable, handle->offset, data, handle->size, data, &blocks[k]) != 0) {
+                    status = -1;
+                }
+            }
+            // A lone block hands the read buffer itself on
+            if (end - i > 1) free(run);
+            i = end;
+        }
+    }
+    
+    if (status != 0) {
+        for (int i = 0; i < count; i++) {
+            sstable_release_block(sstable, &blocks[i]);
+        }
+    }
+    return status;
+}
+
+// Footer layouts; version and magic always occupy the last 12 bytes so a
+// reader can identify the layout before decoding the rest:
+//   v2: {uint64: index_offset, uint64: index_size, uint32: record_count,
+//        uint32: version, uint64: magic}
+//   v3: {uint64: index_offset, uint64: index_size, uint32: record_count,
+//        uint32: level, uint32: version, uint64: magic}
+//   v4: {uint64: index_offset, uint64: index_size, uint32: record_count,
+//        uint32: level, uint32: compression, uint64: raw_data_size,
+//        uint32: version, uint64: magic}, and every block (the index
+//        included) ends in a codec trailer byte; see compression.h
+//   v5: as v4, with every block's trailer followed by a uint32 CRC32C of
+//        the block and its codec byte
+//   v6: as v5; value lengths in data blocks may exceed INT_MAX
+int table_footer_size(uint32_t version) {
+    switch (version) {
+        case SSTABLE_FOOTER_V2: return 32;
+        case SSTABLE_FOOTER_V3: return 36;
+        case SSTABLE_FOOTER_V4:
+        case SSTABLE_FOOTER_V5:
+        case SSTABLE_FOOTER_V6: return 48;
+        default: return -1;
+    }
+}
+
+// Serialize footer (at SSTABLE_FOOTER_VERSION) into buf, returning its size
+int encode_table_footer(char* buf, TableFooter* footer) {
+    char* p = buf;
+    memcpy(p, &footer->index_offset, 8); p += 8;
+    memcpy(p, &footer->index_size, 8); p += 8;
+    memcpy(p, &footer->record_count, 4); p += 4;
+    memcpy(p, &footer->level, 4); p += 4;
+    memcpy(p, &footer->compression, 4); p += 4;
+    memcpy(p, &footer->raw_data_size, 8); p += 8;
+    memcpy(p, &footer->version, 4); p += 4;
+    memcpy(p, &footer->magic, 8); p += 8;
+    return (int) (p - buf);
+}
+
+// Decode the footer from the last tail_len bytes of a table. Returns -1
+// if the tail does not end in a known block-format footer.
+int decode_table_footer(const char* tail, size_t tail_len, TableFooter* footer) {
+    if (tail_len < 12) return -1;
+    memcpy(&footer->magic, tail + tail_len - 8, 8);
+    memcpy(&footer->version, tail + tail_len - 12, 4);
+    if (footer->magic != SSTABLE_MAGIC) return -1;
+    
+    int size = table_footer_size(footer->version);
+    if (size < 0 || (size_t) size > tail_len) return -1;
+    
+    const char* p = tail + tail_len - size;
+    memcpy(&footer->index_offset, p, 8); p += 8;
+    memcpy(&footer->index_size, p, 8); p += 8;
+    memcpy(&footer->record_count, p, 4); p += 4;
+    footer->level = 0;
+    footer->compression = COMPRESSION_NONE;
+    footer->raw_data_size = footer->index_offset;
+    if (footer->version >= SSTABLE_FOOTER_V3) {
+        memcpy(&footer->level, p, 4); p += 4;
+    }
+    if (footer->version >= SSTABLE_FOOTER_V4) {
+        memcpy(&footer->compression, p, 4); p += 4;
+        memcpy(&footer->raw_data_size, p, 8);
+    }
+    return size;
+}
+
+// Start writing a block-based SSTable to filename
+int table_builder_open(TableBuilder* builder, const char* filename, int block_size, int level, int compression) {
+    memset(builder, 0, sizeof(TableBuilder));
+    builder->level = level;
+    builder->compression = compression;
+    builder->file = fopen(filename, "wb");
+    if (!builder->file) return -1;
+    
+    builder->block_size = block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE;
+    block_builder_init(&builder->data_block);
+    block_builder_init(&builder->index_block);
+    return 0;
+}
+
+// Write a finished block, compressed if that pays off, with its trailer
+// and checksum. Returns the number of bytes written.
+uint64_t table_builder_write_block(TableBuilder* builder, BlockBuilder* block) {
+    size_t size = block_compress(builder->compression, block->buf, block->len, &builder->scratch, &builder->scratch_cap);
+    uint32_t crc;
+    if (size > 0) {
+        fwrite(builder->scratch, 1, size, builder->file);
+        crc = crc32c_value(builder->scratch, size);
+    } else {
+        char trailer = COMPRESSION_NONE;
+        fwrite(block->buf, 1, block->len, builder->file);
+        fwrite(&trailer, 1, 1, builder->file);
+        size = block->len + 1;
+        crc = crc32c_extend(crc32c_value(block->buf, block->len), &trailer, 1);
+    }
+    fwrite(&crc, 1, BLOCK_CHECKSUM_SIZE, builder->file);
+    return size + BLOCK_CHECKSUM_SIZE;
+}
+
+// Write out the pending data block and index it by its last key
+void table_builder_flush_block(TableBuilder* builder) {
+    BlockBuilder* block = &builder->data_block;
+    if (block->entries == 0) return;
+    
+    block_builder_finish(block);
+    uint64_t size = table_builder_write_block(builder, block);
+    
+    char handle[20];
+    int n = encode_varint64(handle, builder->offset);
+    n += encode_varint64(handle + n, size);
+    block_builder_add(&builder->index_block, block->last_key, block->last_key_len, handle, n);
+    
+    builder->offset += size;
+    builder->raw_data_size += block->len + 1 + BLOCK_CHECKSUM_SIZE;
+    builder->block_count++;
+    block_builder_reset(block);
+}
+
+// Append a record. Keys must be added in strictly increasing order.
+void table_builder_add(TableBuilder* builder, const char* key, int kLen, const char* value, int64_t vLen) {
+    block_builder_add(&builder->data_block, key, kLen, value, vLen);
+    builder->record_count++;
+    
+    if (block_builder_size_estimate(&builder->data_block) >= (size_t) builder->block_size) {
+        table_builder_flush_block(builder);
+    }
+}
+
+// Write the last data block, the block index and the footer, then close
+int table_builder_finish(TableBuilder* builder) {
+    table_builder_flush_block(builder);
+    
+    BlockBuilder* index = &builder->index_block;
+    if (index->entries == 0) {
+        // An empty table still gets a well-formed (empty) index block
+        index->restarts = malloc(sizeof(uint32_t));
+        index->restarts_cap = 1;
+        index->restarts[index->num_restarts++] = 0;
+    }
+    block_builder_finish(index);
+    uint64_t index_size = table_builder_write_block(builder, index);
+    
+    TableFooter footer;
+    footer.index_offset = builder->offset;
+    footer.index_size = index_size;
+    footer.record_count = (uint32_t) builder->record_count;
+    footer.level = (uint32_t) builder->level;
+    footer.compression = (uint32_t) builder->compression;
+    footer.raw_data_size = builder->raw_data_size;
+    footer.version = SSTABLE_FOOTER_VERSION;
+    footer.magic = SSTABLE_MAGIC;
+    
+    char footer_buf[SSTABLE_FOOTER_MAX_SIZE];
+    int footer_size = encode_table_footer(footer_buf, &footer);
+    fwrite(footer_buf, 1, footer_size, builder->file);
+    builder->offset += index_size + footer_size;
+    
+    // The table must be durable before the log it replaces is truncated
+    int result = ferror(builder->file) ? -1 : 0;
+    if (fflush(builder->file) != 0 || fdatasync(fileno(builder->file)) != 0) result = -1;
+    if (fclose(builder->file) != 0) result = -1;
+    builder->file = NULL;
+    
+    block_builder_free(&builder->data_block);
+    block_builder_free(&builder->index_block);
+    free(builder->scratch);
+    builder->scratch = NULL;
+    return result;
+}
+
+// Recognise a block-based table by its footer and load its block index.
+// Returns 0 once loaded, 1 for tables without a block footer (the flat
+// format) and -1 for block tables whose index cannot be read.
+int load_sstable_blocks(SSTable* sstable) {
+    // The footer and index are read once and held decoded in memory, so
+    // they bypass the block cache
+    BlockCache* cache = sstable->cache;
+    sstable->cache = NULL;
+    
+    size_t tail_len = sstable->data_size < SSTABLE_FOOTER_MAX_SIZE ? sstable->data_size : SSTABLE_FOOTER_MAX_SIZE;
+    TableFooter footer;
+    BlockContents contents;
+    if (sstable_read_block(sstable, sstable->data_size - tail_len, tail_len, &contents) != 0) {
+        sstable->cache = cache;
+        return -1;
+    }
+    int footer_size = decode_table_footer(contents.data, contents.size, &footer);
+    sstable_release_block(sstable, &contents);
+    if (footer_size < 0) {
+        sstable->cache = cache;
+        return 1;
+    }
+    
+    // Blocks before v4 have no trailer and before v5 no checksum; the
+    // footer itself has neither
+    sstable->block_trailers = footer.version >= SSTABLE_FOOTER_V4;
+    sstable->block_checksums = footer.version >= SSTABLE_FOOTER_V5;
+    if (footer.index_offset + footer.index_size > sstable->data_size - footer_size ||
+        sstable_read_block(sstable, footer.index_offset, footer.index_size, &contents) != 0) {
+        sstable->block_trailers = 0;
+        sstable->block_checksums = 0;
+        sstable->cache = cache;
+        return -1;
+    }
+    sstable->cache = cache;
+    
+    BlockIter iter;
+    if (block_iter_init(&iter, contents.data, contents.size) != 0) {
+        sstable_release_block(sstable, &contents);
+        return -1;
+    }
+    
+    int capacity = 16;
+    TableBlockHandle* blocks = malloc(capacity * sizeof(TableBlockHandle));
+    char* keys = NULL;
+    size_t keys_len = 0, keys_cap = 0;
+    int count = 0;
+    int damaged = 0;
+    
+    for (int ok = block_iter_seek_to_first(&iter); ok; ok = block_iter_next(&iter)) {
+        uint64_t offset, size;
+        const char* limit = iter.value + (iter.vLen > 0 ? iter.vLen : 0);
+        const char* p = iter.vLen > 0 ? decode_varint64(iter.value, limit, &offset) : NULL;
+        if (p) p = decode_varint64(p, limit, &size);
+        if (!p || offset + size > footer.index_offset) {
+            damaged = 1;
+            break;
+        }
+        
+        if (count >= capacity) {
+            capacity *= 2;
+            blocks = realloc(blocks, capacity * sizeof(TableBlockHandle));
+        }
+        // Keys are appended to one buffer; pointers are fixed up below
+        blocks[count].last_key = (char*) keys_len;
+        blocks[count].kLen = iter.kLen;
+        blocks[count].offset = offset;
+        blocks[count].size = size;
+        buffer_append(&keys, &keys_len, &keys_cap, iter.key, iter.kLen + 1);
+        count++;
+    }
+    block_iter_free(&iter);
+    sstable_release_block(sstable, &contents);
+    
+    // Missing blocks would read as missing keys
+    if (damaged) {
+        free(blocks);
+        free(keys);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        blocks[i].last_key = keys + (size_t) blocks[i].last_key;
+    }
+    
+    sstable->format = SSTABLE_FORMAT_BLOCK;
+    sstable->blocks = blocks;
+    sstable->block_count = count;
+    sstable->block_keys = keys;
+    sstable->record_count = (int) footer.record_count;
+    sstable->level = (int) footer.level;
+    sstable->compression = (int) footer.compression;
+    sstable->raw_size = sstable->data_size - footer.index_offset + footer.raw_data_size;
+    return 0;
+}
+
+// Build the path of one of a table's files, e.g. <dir>/sstable_7.dat
+void sstable_file_path(KVStore* kvstore, char* buf, size_t size, const char* prefix, int file_number) {
+    snprintf(buf, size, "%s/%s%d.dat", kvstore->data_directory, prefix, file_number);
+}
+
+// Read the first key of a block table (the largest comes from the index)
+void load_sstable_key_range(SSTable* sstable) {
+    sstable->smallest_key = NULL;
+    sstable->largest_key = NULL;
+    sstable->smallest_kLen = 0;
+    sstable->largest_kLen = 0;
+    
+    if (sstable->format == SSTABLE_FORMAT_FLAT) {
+        if (sstable->record_count == 0) return;
+        DataEntry* first = &sstable->index[0];
+        DataEntry* last = &sstable->index[sstable->record_count - 1];
+        sstable->smallest_key = copy_bytes(first->key, first->kLen);
+        sstable->smallest_kLen = first->kLen;
+        sstable->largest_key = copy_bytes(last->key, last->kLen);
+        sstable->largest_kLen = last->kLen;
+        return;
+    }
+    
+    if (sstable->block_count == 0) return;
+    
+    BlockContents contents;
+    if (sstable_read_block(sstable, sstable->blocks[0].offset, sstable->blocks[0].size, &contents) != 0) return;
+    BlockIter iter;
+    if (block_iter_init(&iter, contents.data, contents.size) == 0 && block_iter_seek_to_first(&iter)) {
+        sstable->smallest_key = copy_bytes(iter.key, iter.kLen);
+        sstable->smallest_kLen = iter.kLen;
+        TableBlockHandle* last = &sstable->blocks[sstable->block_count - 1];
+        sstable->largest_key = copy_bytes(last->last_key, last->kLen);
+        sstable->largest_kLen = last->kLen;
+    }
+    block_iter_free(&iter);
+    sstable_release_block(sstable, &contents);
+}
+
+// Release the in-memory index and the SSTable metadata
+void free_sstable(SSTable* sstable) {
+    if (!sstable) return;
+    if (sstable->data_map) {
+        munmap(sstable->data_map, sstable->data_size);
+    }
+    if (sstable->fd >= 0) {
+        close(sstable->fd);
+    }
+    free(sstable->filename);
+    free(sstable->index_filename);
+    free(sstable->index);
+    free(sstable->index_keys);
+    free(sstable->blocks);
+    free(sstable->block_keys);
+    free(sstable->smallest_key);
+    free(sstable->largest_key);
+    free(sstable->bloom_filename);
+    bloom_free(sstable->bloom);
+    free(sstable);
+}
+
+void sstable_ref(SSTable* sstable) {
+    __atomic_add_fetch(&sstable->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference, releasing the table with the last one. Readers drop
+// theirs without the store mutex, so the count is atomic.
+void sstable_unref(SSTable* sstable) {
+    if (__atomic_sub_fetch(&sstable->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_sstable(sstable);
+    }
+}
+
+// Remove a table's files from disk and drop the level's reference. A
+// version still holding the table keeps reading through its mapping or
+// descriptor, which outlive the unlink, until it lets go of the table.
+void delete_sstable(SSTable* sstable) {
+    unlink(sstable->filename);
+    unlink(sstable->index_filename);
+    unlink(sstable->bloom_filename);
+    sstable_unref(sstable);
+}
+
+// Open SSTable number file_number: open or map its data file and load
+// the in-memory index for its format, plus its Bloom filter if one was
+// written. The key range is left unset and reads bypass the block cache;
+// open_sstable() fills in both.
+SSTable* open_sstable_files(KVStore* kvstore, int file_number) {
+    char path[512];
+    SSTable* sstable = malloc(sizeof(SSTable));
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_PREFIX, file_number);
+    sstable->filename = strdup(path);
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_INDEX_PREFIX, file_number);
+    sstable->index_filename = strdup(path);
+    sstable_file_path(kvstore, path, sizeof(path), SSTABLE_BLOOM_PREFIX, file_number);
+    sstable->bloom_filename = strdup(path);
+    sstable->bloom = bloom_read_from_file(path);
+    sstable->file_number = file_number;
+    sstable->format = SSTABLE_FORMAT_FLAT;
+    sstable->block_trailers = 0;
+    sstable->block_checksums = 0;
+    sstable->verify_checksums = 1;
+    sstable->checksum_failures = &kvstore->stats.checksum_failures;
+    sstable->compression = COMPRESSION_NONE;
+    sstable->level = 0;
+    sstable->sequence = 0;
+    sstable->record_count = 0;
+    sstable->index = NULL;
+    sstable->index_keys = NULL;
+    sstable->blocks = NULL;
+    sstable->block_count = 0;
+    sstable->block_keys = NULL;
+    sstable->refs = 1;
+    sstable->next = NULL;
+    sstable->cache = NULL;
+    sstable->id = kvstore->block_cache ? block_cache_new_table_id(kvstore->block_cache) : 0;
+    
+    // Block-based tables carry their own index; older flat tables
+    // still use the separate index file. A table whose data or index
+    // cannot be read is kept as unreadable rather than taken for empty,
+    // which would let older versions of its keys show through.
+    int loaded = open_sstable_data(sstable, kvstore->use_mmap);
+    sstable->raw_size = sstable->data_size;
+    if (loaded == 0) {
+        loaded = load_sstable_blocks(sstable);
+        if (loaded == 1) loaded = load_sstable_index(sstable);
+    }
+    if (loaded != 0) {
+        // Any level the footer gave may be wrong too; L0 is searched
+        // without relying on key order
+        sstable->format = SSTABLE_FORMAT_UNREADABLE;
+        sstable->level = 0;
+    }
+    if (sstable->level < 0 || sstable->level >= NUM_LEVELS) {
+        sstable->level = NUM_LEVELS - 1;
+    }
+    // The block index is always checked; data blocks as configured
+    sstable->verify_checksums = kvstore->verify_checksums;
+    sstable->smallest_key = NULL;
+    sstable->largest_key = NULL;
+    sstable->smallest_kLen = 0;
+    sstable->largest_kLen = 0;
+    return sstable;
+}
+
+SSTable* open_sstable(KVStore* kvstore, int file_number) {
+    SSTable* sstable = open_sstable_files(kvstore, file_number);
+    
+    // The one-off read of the first key bypasses the block cache. A
+    // table with blocks but no readable first key is damaged.
+    load_sstable_key_range(sstable);
+    if (sstable->format == SSTABLE_FORMAT_BLOCK && sstable->block_count > 0 && !sstable->smallest_key) {
+        sstable->format = SSTABLE_FORMAT_UNREADABLE;
+        sstable->level = 0;
+    }
+    sstable->cache = kvstore->block_cache;
+    return sstable;
+}
+
+// Does the table's key range include key? An unreadable table whose
+// range is unknown may hold any key.
+int sstable_contains_key(SSTable* sstable, const char* key, int kLen) {
+    if (!sstable->smallest_key) return sstable->format == SSTABLE_FORMAT_UNREADABLE;
+    return compare_key_bytes(sstable->smallest_key, sstable->smallest_kLen, key, kLen) <= 0 &&
+           compare_key_bytes(sstable->largest_key, sstable->largest_kLen, key, kLen) >= 0;
+}
+
+// Does the table's key range intersect [smallest, largest]?
+int sstable_overlaps(SSTable* sstable, const char* smallest, int smallest_kLen,
+                     const char* largest, int largest_kLen) {
+    if (!sstable->smallest_key) return sstable->format == SSTABLE_FORMAT_UNREADABLE;
+    return compare_key_bytes(sstable->largest_key, sstable->largest_kLen, smallest, smallest_kLen) >= 0 &&
+           compare_key_bytes(sstable->smallest_key, sstable->smallest_kLen, largest, largest_kLen) <= 0;
+}
+
+// Link a table into its level: L0 stays newest (highest sequence, then
+// file number) first, deeper levels are kept sorted by smallest key
+void add_sstable_to_level(KVStore* kvstore, SSTable* sstable) {
+    SSTable** link = &kvstore->levels[sstable->level];
+    while (*link) {
+        SSTable* current = *link;
+        if (sstable->level == 0) {
+            if (current->sequence < sstable->sequence ||
+                (current->sequence == sstable->sequence && current->file_number < sstable->file_number)) {
+                break;
+            }
+        } else if (!sstable->smallest_key ||
+                   (current->smallest_key &&
+                    compare_key_bytes(current->smallest_key, current->smallest_kLen,
+                                      sstable->smallest_key, sstable->smallest_kLen) > 0)) {
+            break;
+        }
+        link = &current->next;
+    }
+    sstable->next = *link;
+    *link = sstable;
+}
+
+void remove_sstable_from_level(KVStore* kvstore, SSTable* sstable) {
+    SSTable** link = &kvstore->levels[sstable->level];
+    while (*link && *link != sstable) link = &(*link)->next;
+    if (*link) *link = sstable->next;
+    sstable->next = NULL;
+}
+
+int compare_file_numbers(const void* a, const void* b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+// Open the SSTables of a directory written before the store kept a
+// MANIFEST. Tables carry no sequence numbers there, so they are numbered
+// in file number order, which is the order they were written in.
 void load_sstables(KVStore* kvstore) {
     DIR* dir = opendir(kvstore->data_directory);
     if (!dir) return;
     
+    int* numbers = NULL;
+    int count = 0, cap = 0;
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
         if (strncmp(entry->d_name, SSTABLE_PREFIX, strlen(SSTABLE_PREFIX)) == 0 &&
+            strncmp(entry->d_name, SSTABLE_INDEX_PREFIX, strlen(SSTABLE_INDEX_PREFIX)) != 0 &&
+            strncmp(entry->d_name, SSTABLE_BLOOM_PREFIX, strlen(SSTABLE_BLOOM_PREFIX)) != 0 &&
             strstr(entry->d_name, ".dat") != NULL) {
             
-            SSTable* sstable = malloc(sizeof(SSTable));
-            sstable->filename = malloc(strlen(kvstore->data_directory) + strlen(entry->d_name) + 2);
-            sprintf(sstable->filename, "%s/%s", kvstore->data_directory, entry->d_name);
+            // Only sstable_<number>.dat names belong to the store
+            char* number = entry->d_name + strlen(SSTABLE_PREFIX);
+            char* end;
+            long file_number = strtol(number, &end, 10);
+            if (end == number || strcmp(end, ".dat") != 0 || file_number < 0) continue;
             
-            // Generate corresponding index filename
-            char index_name[256];
-            strcpy(index_name, entry->d_name);
-            char* dot = strrchr(index_name, '.');
-            if (dot) *dot = '\0';
-            
-            char* sstable_part = strstr(index_name, SSTABLE_PREFIX);
-            if (sstable_part) {
-                memmove(index_name + strlen(SSTABLE_INDEX_PREFIX), 
-                       sstable_part + strlen(SSTABLE_PREFIX),
-                       strlen(sstable_part + strlen(SSTABLE_PREFIX)) + 1);
-                memcpy(index_name, SSTABLE_INDEX_PREFIX, strlen(SSTABLE_INDEX_PREFIX));
+            if (count == cap) {
+                cap = cap ? cap * 2 : 16;
+                numbers = realloc(numbers, cap * sizeof(int));
             }
-            strcat(index_name, ".dat");
-            
-            sstable->index_filename = malloc(strlen(kvstore->data_directory) + strlen(index_name) + 2);
-            sprintf(sstable->index_filename, "%s/%s", kvstore->data_directory, index_name);
-            
-            sstable->record_count = 0;
-            sstable->next = kvstore->sstables;
-            kvstore->sstables = sstable;
+            numbers[count++] = (int) file_number;
         }
     }
     closedir(dir);
+    
+    qsort(numbers, count, sizeof(int), compare_file_numbers);
+    for (int i = 0; i < count; i++) {
+        SSTable* sstable = open_sstable(kvstore, numbers[i]);
+        sstable->sequence = (uint64_t) i + 1;
+        add_sstable_to_level(kvstore, sstable);
+        
+        // Never reuse the number of a table that is already on disk
+        if (numbers[i] >= kvstore->next_file_number) {
+            kvstore->next_file_number = numbers[i] + 1;
+        }
+    }
+    if (count > 0) {
+        kvstore->last_sequence = (uint64_t) count;
+    }
+    free(numbers);
+}
+
+// Position a table iterator on its first record, or leave it invalid. An
+// unreadable table starts out failed, so merges over it fail too.
+void table_iter_init(TableIter* iter, SSTable* sstable) {
+    memset(iter, 0, sizeof(TableIter));
+    iter->sstable = sstable;
+    if (sstable->format == SSTABLE_FORMAT_UNREADABLE) iter->status = -1;
 }
 
-// Search for key in SSTable
-char* search_sstable(char* sstable_file, char* index_file, char* key) {
-    FILE* idx_file = fopen(index_file, "rb");
-    if (!idx_file) return NULL;
+// Iterate over a sorted record array instead of a table
+void table_iter_init_records(TableIter* iter, DataRecord* records, int num_records) {
+    memset(iter, 0, sizeof(TableIter));
+    iter->records = records;
+    iter->num_records = num_records;
+}
+
+void table_iter_free(TableIter* iter) {
+    if (iter->sstable) {
+        sstable_release_block(iter->sstable, &iter->contents);
+    }
+    block_iter_free(&iter->block_iter);
+    free(iter->flat_buffer);
+    iter->flat_buffer = NULL;
+    iter->valid = 0;
+}
+
+// Expose the block iterator's current entry through the table iterator
+void table_iter_copy_block_entry(TableIter* iter) {
+    iter->key = iter->block_iter.key;
+    iter->kLen = iter->block_iter.kLen;
+    iter->value = iter->block_iter.value;
+    iter->vLen = iter->block_iter.vLen;
+    iter->valid = 1;
+}
+
+// Load data block block_index, returning 0 if there is no such block
+int table_iter_load_block(TableIter* iter, int block_index) {
+    SSTable* sstable = iter->sstable;
+    sstable_release_block(sstable, &iter->contents);
+    iter->block_index = block_index;
+    if (block_index >= sstable->block_count) return 0;
     
-    int position = find_key_in_index(idx_file, key);
-    fclose(idx_file);
+    TableBlockHandle* block = &sstable->blocks[block_index];
+    if (sstable_read_block(sstable, block->offset, block->size, &iter->contents) != 0) {
+        iter->status = -1;
+        return 0;
+    }
     
-    if (position == -1) return NULL;
+    // Keep the key buffer across blocks
+    char* key = iter->block_iter.key;
+    int key_cap = iter->block_iter.key_cap;
+    if (block_iter_init(&iter->block_iter, iter->contents.data, iter->contents.size) != 0) {
+        free(key);
+        iter->status = -1;
+        return 0;
+    }
+    iter->block_iter.key = key;
+    iter->block_iter.key_cap = key_cap;
+    return 1;
+}
+
+// Skip forward from the current block to the first entry of a later one
+int table_iter_next_block(TableIter* iter) {
+    while (table_iter_load_block(iter, iter->block_index + 1)) {
+        if (block_iter_seek_to_first(&iter->block_iter)) {
+            table_iter_copy_block_entry(iter);
+            return 1;
+        }
+    }
+    iter->valid = 0;
+    return 0;
+}
+
+// Decode the flat-format record behind index entry entry_index, which
+// must exist. Returns 0 if it could not be read.
+int table_iter_read_flat_entry(TableIter* iter) {
+    SSTable* sstable = iter->sstable;
+    size_t position = (size_t) sstable->index[iter->entry_index].position;
+    size_t header = 2 * sizeof(int);
+    int kLen, vLen;
+    const char* record;
     
-    FILE* data_file = fopen(sstable_file, "rb");
-    if (!data_file) return NULL;
+    if (sstable->data_map) {
+        if (position + header > sstable->data_size) return 0;
+        record = sstable->data_map + position;
+        memcpy(&kLen, record, sizeof(int));
+        memcpy(&vLen, record + sizeof(int), sizeof(int));
+    } else if (sstable->fd >= 0) {
+        char lengths[2 * sizeof(int)];
+        if (pread(sstable->fd, lengths, header, (off_t) position) != (ssize_t) header) return 0;
+        memcpy(&kLen, lengths, sizeof(int));
+        memcpy(&vLen, lengths + sizeof(int), sizeof(int));
+        // Damaged lengths must not turn into huge reads
+        if (kLen < 0 || position + header + kLen + (vLen > 0 ? vLen : 0) > sstable->data_size) return 0;
+        iter->flat_buffer = sstable_pread(sstable, position, header + kLen + (vLen > 0 ? vLen : 0));
+        if (!iter->flat_buffer) return 0;
+        record = iter->flat_buffer;
+    } else {
+        return 0;
+    }
     
-    DataRecord* record = read_record_from_file(data_file, position);
-    fclose(data_file);
+    if (kLen < 0 || position + header + kLen + (vLen > 0 ? vLen : 0) > sstable->data_size) return 0;
+    iter->key = record + header;
+    iter->kLen = kLen;
+    iter->value = vLen >= 0 ? record + header + kLen : NULL;
+    iter->vLen = vLen;
+    iter->valid = 1;
+    return 1;
+}
+
+int table_iter_load_flat_entry(TableIter* iter) {
+    free(iter->flat_buffer);
+    iter->flat_buffer = NULL;
+    iter->valid = 0;
+    if (iter->entry_index >= iter->sstable->record_count) return 0;
+    if (!table_iter_read_flat_entry(iter)) {
+        iter->status = -1;
+        return 0;
+    }
+    return 1;
+}
+
+// Expose record entry_index of a record array
+int table_iter_load_record(TableIter* iter) {
+    iter->valid = 0;
+    if (iter->entry_index >= iter->num_records) return 0;
     
-    if (!record) return NULL;
+    DataRecord* record = &iter->records[iter->entry_index];
+    iter->key = record->key;
+    iter->kLen = record->kLen;
+    iter->value = record->value;
+    iter->vLen = record->vLen;
+    iter->valid = 1;
+    return 1;
+}
+
+int table_iter_seek_to_first(TableIter* iter) {
+    if (!iter->sstable) {
+        iter->entry_index = 0;
+        return table_iter_load_record(iter);
+    }
+    if (iter->sstable->format == SSTABLE_FORMAT_FLAT) {
+        iter->entry_index = 0;
+        return table_iter_load_flat_entry(iter);
+    }
+    iter->block_index = -1;
+    return table_iter_next_block(iter);
+}
+
+int table_iter_next(TableIter* iter) {
+    if (!iter->valid) return 0;
+    if (!iter->sstable) {
+        iter->entry_index++;
+        return table_iter_load_record(iter);
+    }
+    if (iter->sstable->format == SSTABLE_FORMAT_FLAT) {
+        iter->entry_index++;
+        return table_iter_load_flat_entry(iter);
+    }
+    if (block_iter_next(&iter->block_iter)) {
+        table_iter_copy_block_entry(iter);
+        return 1;
+    }
+    return table_iter_next_block(iter);
+}
+
+// Position the iterator at the first record whose key is >= key
+int table_iter_seek(TableIter* iter, const char* key, int kLen) {
+    SSTable* sstable = iter->sstable;
+    if (!sstable) {
+        int lo = 0;
+        int hi = iter->num_records;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            DataRecord* record = &iter->records[mid];
+            if (compare_key_bytes(record->key, record->kLen, key, kLen) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        iter->entry_index = lo;
+        return table_iter_load_record(iter);
+    }
+    if (sstable->format == SSTABLE_FORMAT_FLAT) {
+        int lo = 0;
+        int hi = sstable->record_count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            DataEntry* entry = &sstable->index[mid];
+            if (compare_key_bytes(entry->key, entry->kLen, key, kLen) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        iter->entry_index = lo;
+        return table_iter_load_flat_entry(iter);
+    }
     
-    char* result = NULL;
-    if (record->vLen > 0) {
-        result = strdup(record->value);
+    int lo = 0;
+    int hi = sstable->block_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        TableBlockHandle* block = &sstable->blocks[mid];
+        if (compare_key_bytes(block->last_key, block->kLen, key, kLen) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    if (table_iter_load_block(iter, lo) && block_iter_seek(&iter->block_iter, key, kLen)) {
+        table_iter_copy_block_entry(iter);
+        return 1;
+    }
+    return table_iter_next_block(iter);
+}
+
+// Binary search the in-memory index, returning the data file position
+int64_t find_key_in_sstable_index(SSTable* sstable, const char* key, int kLen) {
+    int lo = 0;
+    int hi = sstable->record_count - 1;
     
-    free_record(record);
-    return result;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = compare_key_bytes(sstable->index[mid].key, sstable->index[mid].kLen, key, kLen);
+        if (cmp == 0) {
+            return sstable->index[mid].position;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
 }
 
+// Consult the table's Bloom filter before any file is touched.
+// Returns 0 if the table definitely does not hold key. Called by readers
+// without the store mutex, hence the atomic counters.
+int sstable_may_contain(KVStore* kvstore, SSTable* sstable, const char* key, int kLen) {
+    if (!sstable->bloom) return 1;
+    
+    if (!bloom_may_contain(sstable->bloom, key, kLen)) {
+        __atomic_add_fetch(&kvstore->stats.bloom_negatives, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_add_fetch(&kvstore->stats.bloom_positives, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Locate the value of the record at position in the mapping without
+// copying it
+int decode_sstable_value(SSTable* sstable, int64_t position, const char** value, int64_t* vLen) {
+    size_t header = 2 * sizeof(int);
+    if (position < 0 || (size_t) position + header > sstable->data_size) return 0;
+    
+    const char* record = sstable->data_map + position;
+    int kLen, stored_vLen;
+    memcpy(&kLen, record, sizeof(int));
+    memcpy(&stored_vLen, record + sizeof(int), sizeof(int));
+    if (kLen < 0) return 0;
+    
+    *vLen = stored_vLen;
+    if (*vLen >= 0) {
+        if ((size_t) position + header + kLen + *vLen > sstable->data_size) return 0;
+        *value = record + header + kLen;
+    }
+    return 1;
+}
+
+// Look key up in a block-based table: binary search the block index for
+// the first block whose last key is >= key, then seek within that block.
+// On a hit the block stays pinned in contents. Returns -1 if the block
+// could not be read or decoded.
+int search_sstable_blocks(SSTable* sstable, const char* key, int kLen, BlockContents* contents,
+                          const char** value, int64_t* vLen) {
+    int lo = 0;
+    int hi = sstable->block_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        TableBlockHandle* block = &sstable->blocks[mid];
+        if (compare_key_bytes(block->last_key, block->kLen, key, kLen) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == sstable->block_count) return 0;
+    
+    TableBlockHandle* block = &sstable->blocks[lo];
+    if (sstable_read_block(sstable, block->offset, block->size, contents) != 0) return -1;
+    
+    BlockIter iter;
+    if (block_iter_init(&iter, contents->data, contents->size) != 0) {
+        sstable_release_block(sstable, contents);
+        return -1;
+    }
+    
+    int found = 0;
+    if (block_iter_seek(&iter, key, kLen) &&
+        compare_key_bytes(iter.key, iter.kLen, key, kLen) == 0) {
+        found = 1;
+        *value = iter.value;
+        *vLen = iter.vLen;
+    }
+    block_iter_free(&iter);
+    if (!found) sstable_release_block(sstable, contents);
+    return found;
+}
 
+// Find key's record in sstable without copying its value. Returns 1 if
+// the table holds a record for key, with *value pointing at its *vLen
+// bytes (NULL for a tombstone) in the pinned block, the mapping or, for
+// unmapped flat tables, a copy owned by contents. Either way the caller
+// releases contents with sstable_release_block(). Returns 0 if the table
+// holds no record for key, and -1 with nothing held if the record could
+// not be read: the key may be in the table, so older tables must not be
+// searched in its place.
+int sstable_find_value(SSTable* sstable, const char* key, int kLen, BlockContents* contents,
+                       const char** value, int64_t* vLen) {
+    memset(contents, 0, sizeof(BlockContents));
+    *value = NULL;
+    *vLen = -1;
+    if (sstable->format == SSTABLE_FORMAT_BLOCK) {
+        return search_sstable_blocks(sstable, key, kLen, contents, value, vLen);
+    }
+    if (sstable->format == SSTABLE_FORMAT_UNREADABLE) return -1;
+    if (!sstable->index) return 0;
+    
+    int64_t position = find_key_in_sstable_index(sstable, key, kLen);
+    if (position == -1) return 0;
+    
+    if (sstable->data_map) {
+        return decode_sstable_value(sstable, position, value, vLen) ? 1 : -1;
+    }
+    
+    // Read through the open descriptor: a compaction may already have
+    // unlinked the file while a reader still holds the table
+    if (sstable->fd < 0) return -1;
+    size_t header = 2 * sizeof(int);
+    char lengths[2 * sizeof(int)];
+    if (pread(sstable->fd, lengths, header, (off_t) position) != (ssize_t) header) return -1;
+    int stored_kLen, stored_vLen;
+    memcpy(&stored_kLen, lengths, sizeof(int));
+    memcpy(&stored_vLen, lengths + sizeof(int), sizeof(int));
+    if (stored_kLen < 0) return -1;
+    *vLen = stored_vLen;
+    if ((size_t) position + header + stored_kLen + (*vLen > 0 ? *vLen : 0) > sstable->data_size) return -1;
+    
+    if (*vLen >= 0) {
+        char* result = malloc(*vLen + 1);
+        off_t offset = (off_t) (position + header + stored_kLen);
+        if (pread(sstable->fd, result, *vLen, offset) != (ssize_t) *vLen) {
+            free(result);
+            return -1;
+        }
+        result[*vLen] = '\0';
+        contents->owned = result;
+        contents->data = result;
+        contents->size = (size_t) *vLen;
+        *value = result;
+    }
+    return 1;
+}
+
+// Search for key in SSTable. Returns 1 if the table holds a record for
+// key, storing a copy of its value in *value (NULL for a tombstone), 0 if
+// the key is not in this table, or -1 if the table could not be read.
+int search_sstable(SSTable* sstable, const char* key, int kLen, char** value) {
+    *value = NULL;
+    BlockContents contents;
+    const char* data;
+    int64_t vLen;
+    int found = sstable_find_value(sstable, key, kLen, &contents, &data, &vLen);
+    if (found != 1) return found;
+    
+    if (data) {
+        if (sstable->format == SSTABLE_FORMAT_FLAT && contents.owned) {
+            // Unmapped flat tables already read a private copy
+            *value = contents.owned;
+            contents.owned = NULL;
+        } else {
+            *value = copy_bytes(data, vLen);
+        }
+    }
+    sstable_release_block(sstable, &contents);
+    return 1;
+}
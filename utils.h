@@ -2,28 +2,71 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-// Helper function to create a data record
-DataEntry* create_entry(char* key, int position) {
-    DataEntry* record = malloc(sizeof(DataEntry));
-    record->kLen = strlen(key);
-    record->key = strdup(key);
-    record->position = position;
-    return record;
+// Compare two keys byte-wise (equivalent to strcmp for C strings). Keys
+// are length-delimited everywhere and may contain NUL bytes.
+int compare_key_bytes(const char* a, int aLen, const char* b, int bLen) {
+    int min_len = aLen < bLen ? aLen : bLen;
+    int cmp = memcmp(a, b, min_len);
+    if (cmp != 0) return cmp;
+    return aLen - bLen;
+}
+
+// Copy n bytes into a new buffer, NUL-terminated for convenience
+char* copy_bytes(const char* data, size_t n) {
+    char* copy = malloc(n + 1);
+    memcpy(copy, data, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+// Start an empty index file with the current format's header
+void write_index_header(FILE* file) {
+    int header[2] = {INDEX_FILE_MARKER, INDEX_FILE_VERSION};
+    fwrite(header, sizeof(int), 2, file);
+    fflush(file);
+}
+
+// Position the index file on its first entry. Returns -1 unless it is in
+// the current format.
+int index_file_seek_to_first(FILE* file) {
+    int header[2];
+    fseek(file, 0, SEEK_SET);
+    if (fread(header, sizeof(int), 2, file) != 2) return -1;
+    return header[0] == INDEX_FILE_MARKER && header[1] == INDEX_FILE_VERSION ? 0 : -1;
+}
+
+// Start an empty log with the current format's header
+void write_heap_header(FILE* file) {
+    int header[2] = {HEAP_FILE_MARKER, HEAP_FILE_VERSION};
+    fwrite(header, sizeof(int), 2, file);
+    fflush(file);
 }
 
-// Write an index entry to file
+// Position the log on its first record and return its format version
+int heap_file_seek_to_first(FILE* file) {
+    int header[2];
+    fseek(file, 0, SEEK_SET);
+    if (fread(header, sizeof(int), 2, file) == 2 && header[0] == HEAP_FILE_MARKER) {
+        return header[1];
+    }
+    fseek(file, 0, SEEK_SET);
+    return HEAP_FILE_V1;
+}
+
+// Write an index entry to file. The caller flushes.
 void write_index_entry_to_file(FILE* file, DataRecord* record) {
     fwrite(&record->kLen, sizeof(int), 1, file);
-    fwrite(&record->position, sizeof(int), 1, file);
+    fwrite(&record->position, sizeof(int64_t), 1, file);
     fwrite(record->key, sizeof(char), record->kLen, file);
-    fflush(file);
 }
 
 // Read an index entry from file
 DataEntry* read_index_entry_from_file(FILE* file) {
-    int kLen, vPos;
+    int kLen;
+    int64_t vPos;
     if (fread(&kLen, sizeof(int), 1, file) != 1) return NULL;
-    if (fread(&vPos, sizeof(int), 1, file) != 1) return NULL;
+    if (fread(&vPos, sizeof(int64_t), 1, file) != 1) return NULL;
+    if (kLen < 0) return NULL;
     
     char* key = malloc(kLen + 1);
     if (fread(key, sizeof(char), (size_t) kLen, file) != (size_t) kLen) {
@@ -32,8 +75,10 @@ DataEntry* read_index_entry_from_file(FILE* file) {
     }
     key[kLen] = '\0';
     
-    DataEntry* record = create_entry(key, vPos);
-    free(key);
+    DataEntry* record = malloc(sizeof(DataEntry));
+    record->kLen = kLen;
+    record->key = key;
+    record->position = vPos;
     return record;
 }
 
@@ -45,47 +90,20 @@ void free_entry(DataEntry* record) {
     }
 }
 
-void debug_all_entries(char* key) {
-    if (!kvstore->index_file) return;
-    
-    printf("[DEBUG] All entries for key '%s':\n", key);
-    fseek(kvstore->index_file, 0, SEEK_SET);
-    
-    while (!feof(kvstore->index_file)) {
-        DataEntry* entry = read_index_entry_from_file(kvstore->index_file);
-        if (!entry) break;
-        
-        if (strcmp(entry->key, key) == 0) {
-            printf("[DEBUG]   Found at position %d\n", entry->position);
-        } else {
-            printf("[DEBUG]   NOT Found at position %d\n", entry->position);
-		}
-
-        free_entry(entry);
-    }
-}
-
-// Find key in index file
-int find_key_in_index(FILE* index_file, char* key) {
-	// debug_all_entries(key);
-    if (!index_file) return -1;
+// Find the kLen-byte key in index file
+int64_t find_key_in_index(FILE* index_file, const char* key, int kLen) {
+    if (!index_file || index_file_seek_to_first(index_file) != 0) return -1;
     
-    fseek(index_file, 0, SEEK_SET);
-    int last_position = -1;  // Track the LAST occurrence
+    int64_t last_position = -1;  // Track the LAST occurrence
     
     while (!feof(index_file)) {
         DataEntry* index_entry = read_index_entry_from_file(index_file);
         if (!index_entry) break;
-		printf("[DEBUG] Fetched Data Entry - key: %s, pos: %d\n",
-			index_entry->key, index_entry->position);
         
-        if (strcmp(index_entry->key, key) == 0) {
+        if (compare_key_bytes(index_entry->key, index_entry->kLen, key, kLen) == 0) {
+            // Keep scanning: a later entry is a more recent write
             last_position = index_entry->position;
-			printf("DATA ENTRY MATCHES, saved position %d\n", last_position);
-            // DON'T break here - continue to find more recent entries
-        } else {
-			// printf("DATA ENTRY MISMATCH\n");
-		}
+        }
         free_entry(index_entry);
     }
     
@@ -0,0 +1,112 @@
+#include "kvstore.h"
+#include <sched.h>
+
+// Versions: reference-counted snapshots of the read state (memtables and
+// the SSTables of every level). The store mutex still guards the mutable
+// state; whenever a flush or compaction changes it, version_install()
+// publishes a new version built from it. Readers pin kvstore->current
+// without the mutex and search it; tables and memtables a version holds
+// stay open until the last version holding them is released.
+//
+// Pinning is a load of kvstore->current followed by a reference count
+// increment, and the version must not be freed in between. Readers
+// announce themselves in one of two counters for that window, picked by
+// version_epoch. An installer swaps current, flips the epoch so new
+// readers use the other counter, and waits for the old counter to drain
+// before dropping the store's reference on the previous version.
+
+// Build a version from the store's current state. Called with the store
+// mutex held.
+Version* version_create(KVStore* kvstore) {
+    Version* version = calloc(1, sizeof(Version));
+    version->refs = 1;
+    version->memtable = kvstore->memtable;
+    memtable_ref(version->memtable);
+    version->imm = kvstore->imm;
+    if (version->imm) memtable_ref(version->imm);
+
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        int count = 0;
+        for (SSTable* t = kvstore->levels[level]; t; t = t->next) count++;
+        version->files[level] = malloc((count > 0 ? count : 1) * sizeof(SSTable*));
+        for (SSTable* t = kvstore->levels[level]; t; t = t->next) {
+            sstable_ref(t);
+            version->files[level][version->num_files[level]++] = t;
+        }
+    }
+    return version;
+}
+
+// Index of the first table of level (1 or deeper, sorted by key and
+// disjoint) whose largest key is not below key: the only one that can
+// hold it. num_files[level] if every table ends before key.
+int version_find_file(Version* version, int level, const char* key, int kLen) {
+    int low = 0, high = version->num_files[level];
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        SSTable* t = version->files[level][mid];
+        // Empty tables have no range and sort first
+        if (!t->largest_key || compare_key_bytes(t->largest_key, t->largest_kLen, key, kLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void version_ref(Version* version) {
+    __atomic_add_fetch(&version->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference; the last one releases everything the version holds
+void version_unref(Version* version) {
+    if (!version || __atomic_sub_fetch(&version->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    memtable_unref(version->memtable);
+    memtable_unref(version->imm);
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        for (int i = 0; i < version->num_files[level]; i++) {
+            sstable_unref(version->files[level][i]);
+        }
+        free(version->files[level]);
+    }
+    free(version);
+}
+
+// Pin the current version without taking the store mutex. Release it
+// with version_unref().
+Version* version_acquire(KVStore* kvstore) {
+    while (1) {
+        int slot = __atomic_load_n(&kvstore->version_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_add_fetch(&kvstore->version_readers[slot], 1, __ATOMIC_SEQ_CST);
+
+        // An installer flipped the epoch meanwhile and may not wait for
+        // this slot; retry in the new one
+        if ((__atomic_load_n(&kvstore->version_epoch, __ATOMIC_SEQ_CST) & 1) != slot) {
+            __atomic_sub_fetch(&kvstore->version_readers[slot], 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        Version* version = __atomic_load_n(&kvstore->current, __ATOMIC_SEQ_CST);
+        version_ref(version);
+        __atomic_sub_fetch(&kvstore->version_readers[slot], 1, __ATOMIC_SEQ_CST);
+        return version;
+    }
+}
+
+// Publish a version of the store's current state. Called with the store
+// mutex held, after every change to the memtables or levels.
+void version_install(KVStore* kvstore) {
+    Version* old = kvstore->current;
+    __atomic_store_n(&kvstore->current, version_create(kvstore), __ATOMIC_SEQ_CST);
+    if (!old) return;
+
+    // Wait out readers that may have loaded the old version but not yet
+    // pinned it; the window is a few instructions long
+    int slot = __atomic_fetch_add(&kvstore->version_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&kvstore->version_readers[slot], __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    version_unref(old);
+}
@@ -0,0 +1,304 @@
+#include "kvstore.h"
+#include <time.h>
+
+// Write-ahead logging with group commit. heap.dat is the log: every put
+// and delete is appended there as a data record (and to index.dat as an
+// index entry) before it reaches the memtable.
+//
+// Writers queue up under the store mutex. The writer at the head of the
+// queue becomes the leader: it takes every queued writer (up to
+// WAL_MAX_GROUP_BYTES), encodes their records into one buffer, drops the
+// mutex, appends the buffer with a single write() per file and, if the
+// store's sync mode or any writer asks for it, one fdatasync(). It then
+// applies the group to the memtable and wakes the writers it committed.
+// Writers that arrive during the I/O form the next group.
+//
+// A writer carrying several operations (a write batch) is logged behind a
+// batch header so replay can tell whether all of it reached the disk.
+// Records and batch headers end in a CRC32C, so replay also stops at the
+// first one damaged on disk instead of applying garbage.
+// Each record gets the next sequence number as it is applied; the group's
+// last one is published in kvstore->last_sequence only after the whole
+// group is in the memtable, so readers never see part of a batch.
+
+// Follow the bytes appended to a heap buffer since start with their
+// CRC32C if the log's format has checksums
+void wal_append_checksum(char** heap, size_t* heap_len, size_t* heap_cap, size_t start, int version) {
+    if (version < HEAP_FILE_V2) return;
+    uint32_t crc = crc32c_value(*heap + start, *heap_len - start);
+    buffer_append(heap, heap_len, heap_cap, (char*) &crc, sizeof(uint32_t));
+}
+
+// Append one data record to a heap buffer and its index entry to an index
+// buffer. position is the record's offset in heap.dat, whose format is
+// version.
+void wal_encode_record(char** heap, size_t* heap_len, size_t* heap_cap,
+                       char** index, size_t* index_len, size_t* index_cap,
+                       WriteOp* op, int64_t position, int version) {
+    int kLen = op->kLen;
+    int64_t vLen = op->value ? op->vLen : -1;
+
+    size_t start = *heap_len;
+    char lengths[2 * sizeof(int64_t)];
+    size_t lengths_size = encode_heap_lengths(lengths, version, kLen, vLen);
+    buffer_append(heap, heap_len, heap_cap, lengths, lengths_size);
+    buffer_append(heap, heap_len, heap_cap, op->key, kLen);
+    if (vLen > 0) {
+        buffer_append(heap, heap_len, heap_cap, op->value, (size_t) vLen);
+    }
+    wal_append_checksum(heap, heap_len, heap_cap, start, version);
+
+    buffer_append(index, index_len, index_cap, (char*) &kLen, sizeof(int));
+    buffer_append(index, index_len, index_cap, (char*) &position, sizeof(int64_t));
+    buffer_append(index, index_len, index_cap, op->key, kLen);
+}
+
+// Append the writer's records, behind a batch header if it has several.
+// heap_base is the offset in heap.dat the heap buffer starts at and
+// version the format of heap.dat.
+void wal_encode_writer(char** heap, size_t* heap_len, size_t* heap_cap,
+                       char** index, size_t* index_len, size_t* index_cap,
+                       WALWriter* writer, long heap_base, int version) {
+    if (writer->count > 1) {
+        size_t start = *heap_len;
+        char header[2 * sizeof(int64_t)];
+        size_t header_size = encode_heap_lengths(header, version, WAL_BATCH_MARKER, writer->count);
+        buffer_append(heap, heap_len, heap_cap, header, header_size);
+        wal_append_checksum(heap, heap_len, heap_cap, start, version);
+    }
+    for (int i = 0; i < writer->count; i++) {
+        wal_encode_record(heap, heap_len, heap_cap, index, index_len, index_cap,
+                          &writer->ops[i], (int64_t) heap_base + (int64_t) *heap_len, version);
+    }
+}
+
+// Bytes the writer's records take in a heap.dat of the given format
+size_t wal_record_size(WALWriter* writer, int version) {
+    size_t checksum = version >= HEAP_FILE_V2 ? sizeof(uint32_t) : 0;
+    size_t lengths = 2 * heap_length_size(version);
+    size_t size = writer->count > 1 ? lengths + checksum : 0;
+    for (int i = 0; i < writer->count; i++) {
+        size += lengths + writer->ops[i].kLen + checksum;
+        if (writer->ops[i].value) size += (size_t) writer->ops[i].vLen;
+    }
+    return size;
+}
+
+// Whether every value of the writer fits the length fields of a log in
+// format version: logs from before HEAP_FILE_V3 store them as ints
+int wal_writer_fits(WALWriter* writer, int version) {
+    if (version >= HEAP_FILE_V3) return 1;
+    for (int i = 0; i < writer->count; i++) {
+        if (writer->ops[i].value && writer->ops[i].vLen > INT_MAX) return 0;
+    }
+    return 1;
+}
+
+int wal_write_fully(int fd, const char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+// Whether the active memtable is due to be swapped out: its log is over
+// compaction_threshold, or its memory has reached the same bound replay
+// cuts runs at, which overwrites and per-record overhead can hit first
+int memtable_over_limit(KVStore* kvstore) {
+    return kvstore->heap_size > kvstore->compaction_threshold ||
+           memtable_memory_usage(kvstore->memtable) >= (size_t) kvstore->compaction_threshold;
+}
+
+// Whether a flush has been claimed and its table is not logged yet.
+// Merges running after a flush do not count.
+int flush_in_progress(KVStore* kvstore) {
+    return __atomic_load_n(&kvstore->compaction_status, __ATOMIC_ACQUIRE) == COMPACTION_STARTED;
+}
+
+// Commit writer through the group commit queue. Called and returns with
+// store_mutex held; writer->status tells whether its record was logged.
+void wal_commit(KVStore* kvstore, WALWriter* writer) {
+    // Stall while the new log is over its limit before the previous
+    // memtable has been flushed; only one can be flushing at a time
+    while (flush_in_progress(kvstore) && memtable_over_limit(kvstore)) {
+        pthread_cond_wait(&kvstore->writer_cond, &kvstore->store_mutex);
+    }
+    // The log only moves to a newer format when it is rotated
+    if (!wal_writer_fits(writer, kvstore->heap_version)) {
+        writer->status = -1;
+        return;
+    }
+
+    writer->done = 0;
+    writer->status = 0;
+    writer->next = NULL;
+    if (kvstore->writers_tail) {
+        kvstore->writers_tail->next = writer;
+    } else {
+        kvstore->writers_head = writer;
+    }
+    kvstore->writers_tail = writer;
+
+    while (!writer->done && (writer != kvstore->writers_head || kvstore->wal_busy)) {
+        pthread_cond_wait(&kvstore->writer_cond, &kvstore->store_mutex);
+    }
+    if (writer->done) return;
+
+    // Leader: gather the group and encode it behind the current log end
+    char* heap = NULL;
+    char* index = NULL;
+    size_t heap_len = 0, heap_cap = 0, index_len = 0, index_cap = 0;
+    int sync = kvstore->wal_sync_mode == WAL_SYNC_ALWAYS;
+    WALWriter* last = writer;
+    for (WALWriter* w = writer; w; w = w->next) {
+        if (w != writer && heap_len + wal_record_size(w, kvstore->heap_version) > WAL_MAX_GROUP_BYTES) break;
+        wal_encode_writer(&heap, &heap_len, &heap_cap, &index, &index_len, &index_cap,
+                          w, kvstore->heap_size, kvstore->heap_version);
+        if (w->sync) sync = 1;
+        last = w;
+    }
+
+    int heap_fd = fileno(kvstore->heap_file);
+    int index_fd = fileno(kvstore->index_file);
+    kvstore->wal_busy = 1;
+    pthread_mutex_unlock(&kvstore->store_mutex);
+
+    long start = kvstore->heap_size;
+    int status = wal_write_fully(heap_fd, heap, heap_len);
+    if (status == 0 && sync) {
+        status = fdatasync(heap_fd);
+    }
+    // Never leave a torn group in front of the next one; replay would
+    // stop at it and lose every record logged after it
+    if (status != 0 && ftruncate(heap_fd, start) != 0) {
+        perror("ftruncate heap");
+    }
+    // index.dat only serves debug lookups, so it is never synced
+    if (status == 0) {
+        wal_write_fully(index_fd, index, index_len);
+    }
+    free(heap);
+    free(index);
+
+    pthread_mutex_lock(&kvstore->store_mutex);
+    kvstore->wal_busy = 0;
+    // A failed group was cut back off the log, so it counts for nothing
+    if (status == 0) {
+        kvstore->heap_size += (long) heap_len;
+        kvstore->stats.wal_batches++;
+        if (sync) {
+            kvstore->stats.wal_syncs++;
+        } else {
+            kvstore->wal_dirty = 1;
+        }
+    }
+
+    // Apply the group in log order, publish it and release its writers.
+    // A writer whose records did not all fit in memory fails; they are
+    // still in the log, so the next replay applies them.
+    uint64_t sequence = kvstore->last_sequence;
+    for (WALWriter* w = writer; status == 0; w = w->next) {
+        for (int i = 0; i < w->count; i++) {
+            WriteOp* op = &w->ops[i];
+            if (memtable_put(kvstore->memtable, op->key, op->kLen, op->value, op->vLen, ++sequence) != 0) {
+                w->status = -1;
+            }
+            kvstore->stats.wal_records++;
+            kvstore->stats.user_bytes_written += (long) op->kLen + (op->value ? (long) op->vLen : 0);
+        }
+        if (w == last) break;
+    }
+    __atomic_store_n(&kvstore->last_sequence, sequence, __ATOMIC_RELEASE);
+
+    WALWriter* w = writer;
+    while (1) {
+        WALWriter* next = w->next;
+        if (status != 0) w->status = -1;
+        w->done = 1;
+        if (w == last) {
+            kvstore->writers_head = next;
+            if (!next) kvstore->writers_tail = NULL;
+            break;
+        }
+        w = next;
+    }
+    pthread_cond_broadcast(&kvstore->writer_cond);
+
+    // Check if compaction is needed
+    if (memtable_over_limit(kvstore) && !flush_in_progress(kvstore)) {
+        kv_compact(kvstore);
+    }
+}
+
+// Wait until no leader or sync is using the log, so it can be swapped out.
+// Called with store_mutex held.
+void wal_wait_idle(KVStore* kvstore) {
+    while (kvstore->wal_busy) {
+        pthread_cond_wait(&kvstore->writer_cond, &kvstore->store_mutex);
+    }
+}
+
+// fsync the log if it has unsynced writes. Called with store_mutex held;
+// the mutex is dropped during the fsync.
+void wal_sync(KVStore* kvstore) {
+    wal_wait_idle(kvstore);
+    if (!kvstore->wal_dirty || !kvstore->heap_file) return;
+
+    int heap_fd = fileno(kvstore->heap_file);
+    kvstore->wal_busy = 1;
+    kvstore->wal_dirty = 0;
+    pthread_mutex_unlock(&kvstore->store_mutex);
+
+    int status = fdatasync(heap_fd);
+
+    pthread_mutex_lock(&kvstore->store_mutex);
+    kvstore->wal_busy = 0;
+    if (status == 0) {
+        kvstore->stats.wal_syncs++;
+    } else {
+        kvstore->wal_dirty = 1;
+    }
+    pthread_cond_broadcast(&kvstore->writer_cond);
+}
+
+// Background thread of WAL_SYNC_PERIODIC
+void* wal_sync_worker(void* arg) {
+    KVStore* store = arg;
+    pthread_mutex_lock(&store->store_mutex);
+    while (store->wal_sync_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += store->wal_sync_interval_ms / 1000;
+        deadline.tv_nsec += (long) (store->wal_sync_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&store->wal_sync_cond, &store->store_mutex, &deadline);
+        wal_sync(store);
+    }
+    pthread_mutex_unlock(&store->store_mutex);
+    return NULL;
+}
+
+void wal_start_sync_thread(KVStore* kvstore) {
+    kvstore->wal_sync_running = 0;
+    if (kvstore->wal_sync_mode != WAL_SYNC_PERIODIC) return;
+    kvstore->wal_sync_running = 1;
+    pthread_create(&kvstore->wal_sync_thread, NULL, wal_sync_worker, kvstore);
+}
+
+// Stop the periodic sync thread. Called without store_mutex held.
+void wal_stop_sync_thread(KVStore* kvstore) {
+    pthread_mutex_lock(&kvstore->store_mutex);
+    int running = kvstore->wal_sync_running;
+    kvstore->wal_sync_running = 0;
+    pthread_cond_signal(&kvstore->wal_sync_cond);
+    pthread_mutex_unlock(&kvstore->store_mutex);
+    if (running) {
+        pthread_join(kvstore->wal_sync_thread, NULL);
+    }
+}